@@ -2,10 +2,40 @@
 
 #define DISK    0
 
+// A report of the kernel's heap, regenerated whenever it is opened
+#define FILESYSTEM_PROC_HEAP "/root/proc/heap"
+
 #include <fatfs/ff.h>
 
 /**
  * @brief Initializes the filesystem
  * 
  */
-void filesystemInitialize();
\ No newline at end of file
+void filesystemInitialize();
+
+/**
+ * @brief   Take the filesystem's lock, which serializes every call into FatFs
+ *          (it isn't reentrant) and the files shared by the processors, like a
+ *          process' stdin that the keyboard writes to.
+ *          The interrupts must be disabled, as the keyboard takes it too.
+ */
+void filesystemLock();
+
+/**
+ * @brief Take the filesystem's lock only if it is free
+ *
+ * @return true If the lock was taken
+ */
+bool filesystemTryLock();
+
+/**
+ * @brief Release the filesystem's lock
+ */
+void filesystemUnlock();
+
+/**
+ * @brief Regenerate a /proc file before it is opened, other paths are left alone
+ *
+ * @param path The path that is about to be opened
+ */
+void filesystemRefreshProcFile(const char *path);
\ No newline at end of file
@@ -120,28 +120,32 @@ struct k_gdt
 /**
  * @brief Creates a GDT entry (Segment Descriptor)
  *
+ * @param processor     The processor whose GDT to insert it in.
  * @param idx           The index to insert it in.
  * @param base          Where the segment starts.
  * @param limit         How long the segment is.
  * @param accessByte    The access byte.
  * @param flags         The flags.
  */
-void gdtCreateEntry(uint8_t idx, uint32_t base, uint32_t limit, uint8_t accessByte, uint8_t flags);
+void gdtCreateEntry(uint64_t processor, uint8_t idx, uint32_t base, uint32_t limit, uint8_t accessByte, uint8_t flags);
 
 /**
  * @brief Creates a TSS entry in the GDT
  *
+ * @param processor     The processor whose GDT and TSS to use.
  */
-void gdtCreateTSSEntry();
+void gdtCreateTSSEntry(uint64_t processor);
 
 /**
- * @brief Initializes the GDT, and loads it into gdtr.
+ * @brief Initializes the GDT and the TSS of a processor, and loads them into gdtr and tr.
+ *        Must run on that processor.
  *
+ * @param processor     The index of the processor.
  */
-void gdtInitialize();
+void gdtInitialize(uint64_t processor = 0);
 
 /**
- * @brief Sets the active "privileged" stack
+ * @brief Sets the active "privileged" stack of the current processor
  *
  * @param stackPtr The pointer to the stack (stack end)
  */
@@ -23,4 +23,18 @@ void interruptsDisable();
  */
 void interruptsEnable();
 
+/**
+ * @brief Disable the interrupts, and return the previous state of the flags.
+ *
+ * @return uint64_t The rflags before the interrupts were disabled.
+ */
+uint64_t interruptsSave();
+
+/**
+ * @brief Restore the interrupts to the state saved by interruptsSave().
+ *
+ * @param rflags The saved rflags.
+ */
+void interruptsRestore(uint64_t rflags);
+
 extern "C" k_thread_state * interruptHandler(k_thread_state *rsp);
\ No newline at end of file
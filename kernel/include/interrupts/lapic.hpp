@@ -59,6 +59,13 @@
 #define APIC_LVT_TIMER_MODE_PERIODIC (1 << 17)     // 01
 #define APIC_LVT_TIMER_MODE_TSC_DEADLINE (2 << 17) // 10
 
+/**
+ * Interrupt command flags
+ */
+#define APIC_ICR_DELIVERY_STATUS (1 << 12)
+#define APIC_ICR_LEVEL_ASSERT (1 << 14)
+
+// The first deadline of a processor's timer, the timer is then armed for when the scheduler needs it
 #define APIC_TIMER_TIMESLOT_MS 2
 
 const k_paging_flags LAPIC_MEMORY_FLAGS = {
@@ -97,11 +104,47 @@ uint32_t lapicRead(uint32_t reg);
 void lapicWrite(uint32_t reg, uint32_t value);
 
 /**
- * @brief Starts the ACPI timer on frequency of 1000hz (interrupt every 1ms)
+ * @brief Measure the rate of the Local APIC timer and the TSC with the PIT, only the first call measures
+ *
+ */
+void lapicCalibrateTimer();
+
+/**
+ * @brief Starts this processor's APIC timer in one-shot mode (TSC-deadline if it is supported),
+ *        the first interrupt comes after APIC_TIMER_TIMESLOT_MS
  *
  */
 void lapicStartTimer();
 
+/**
+ * @brief Arm this processor's timer to interrupt once
+ *
+ * @param ms In how many milliseconds, 0 disarms the timer
+ */
+void lapicArmTimer(uint64_t ms);
+
+/**
+ * @brief Get the time since boot, measured by the TSC
+ *
+ * @return uint64_t The time in milliseconds, 0 until the timer is calibrated
+ */
+uint64_t lapicGetTime();
+
+/**
+ * @brief Send an Inter-Processor Interrupt
+ *
+ * @param apicId The ID of the target processor's Local APIC
+ * @param vector The interrupt vector
+ */
+void lapicSendIPI(uint32_t apicId, uint8_t vector);
+
+/**
+ * @brief Get the ID of this processor's Local APIC
+ *
+ * @return uint32_t The ID
+ */
+uint32_t lapicGetId();
+
 /**
  * @brief Send an End Of Interrupt to the Local APIC
  *
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <types.hpp>
+#include <stdint.h>
+#include <stddef.h>
+
+// The size of an arena's blocks, bigger allocations get a block of their own
+#define ARENA_BLOCK_SIZE 0x4000
+
+// The default alignment of an arena allocation
+#define ARENA_ALIGNMENT 16
+
+/**
+ * @brief   The header of an arena block, placed at the start of the block's memory.
+ *          A block is a run of physical pages used through the direct map.
+ */
+struct k_arena_block
+{
+    // The block that was taken before this one
+    k_arena_block *prev;
+    // The size of the block, including the header
+    uint64_t size;
+};
+
+/**
+ * @brief   A bump allocator for short-lived buffers.
+ *          Allocating moves a pointer inside the current block, and nothing is freed
+ *          on its own, all the memory is given back at once by reset() (or rewind() to
+ *          an earlier mark), so the memory must not be used past it.
+ *          An arena isn't locked, it must be used by a single thread.
+ *
+ *          An arena is an aggregate, zeroed memory is an empty arena.
+ */
+struct k_arena
+{
+    // The current block, the rest of the blocks are linked through it
+    k_arena_block *current;
+    // How much of the current block is used, including the header
+    uint64_t offset;
+
+    /**
+     * @brief A position in the arena, that the arena can be rewound to
+     */
+    struct mark
+    {
+        k_arena_block *block;
+        uint64_t offset;
+    };
+
+    /**
+     * @brief Allocate memory, panics if there is no physical memory
+     *
+     * @param size      How much memory to allocate
+     * @param alignment A power of 2, up to PAGE_SIZE
+     * @return void*    The memory
+     */
+    void *allocate(uint64_t size, uint64_t alignment = ARENA_ALIGNMENT);
+
+    /**
+     * @brief Get the current position of the arena
+     */
+    mark save();
+
+    /**
+     * @brief Free everything that was allocated after a mark
+     *
+     * @param position A mark that was taken from this arena
+     */
+    void rewind(mark position);
+
+    /**
+     * @brief Free everything, the first block is kept for the next allocations
+     */
+    void reset();
+
+    /**
+     * @brief Free everything, and give all the blocks back
+     */
+    void release();
+
+private:
+    /**
+     * @brief Take a new block that can hold an allocation
+     *
+     * @param size      The size of the allocation
+     * @param alignment Its alignment
+     */
+    void _grow(uint64_t size, uint64_t alignment);
+
+    /**
+     * @brief Give back the current block, the previous block becomes current
+     */
+    void _pop();
+};
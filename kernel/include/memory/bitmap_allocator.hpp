@@ -3,9 +3,68 @@
 #include <types.hpp>
 #include <stivale2.h>
 #include <stdint.h>
-#include <Bitmap.hpp>
 #include <strings.hpp>
+#include <memory/paging.hpp>
+#include <system/processor/processor.hpp>
+#include <utils/spinlock.hpp>
+#include <memory/physical_zone.hpp>
+#include <memory/page.hpp>
 
+// How many pages a single bitmap word covers
+#define BITMAP_ALLOCATOR_WORD_PAGES 64
+
+// How many pages a per-processor cache can hold
+#define BITMAP_ALLOCATOR_CACHE_SIZE 64
+// How many pages are moved between a cache and the bitmap at once
+#define BITMAP_ALLOCATOR_CACHE_BATCH 32
+
+// How many zeroed pages the pool keeps
+#define BITMAP_ALLOCATOR_ZERO_POOL_SIZE 256
+// How many pages are zeroed at once, between checks for other work
+#define BITMAP_ALLOCATOR_ZERO_BATCH 8
+
+// The page database starts on a cache line
+#define PAGE_DATABASE_ALIGNMENT 64
+
+// #define BENCHMARK_PHYSICAL_ALLOCATOR
+
+/**
+ * @brief   A per-processor cache (magazine) of free physical pages.
+ *          The pages in the cache are locked in the bitmap, so only the
+ *          owning processor can hand them out.
+ */
+struct k_page_cache
+{
+    physical_address_t pages[BITMAP_ALLOCATOR_CACHE_SIZE];
+    uint64_t count;
+
+    // Statistics
+    uint64_t allocations; // Pages allocated through the cache
+    uint64_t frees;       // Pages freed through the cache
+    uint64_t refills;     // Batches taken from the bitmap
+    uint64_t drains;      // Batches returned to the bitmap
+};
+
+/**
+ * @brief   Physical page allocator.
+ *          Free pages are handed out by a buddy zone (k_physical_zone) seeded from the
+ *          memory map, so blocks of 2^k pages are allocated and freed in O(log n).
+ *          The bitmap holds a bit for every page, a set bit means the page is free,
+ *          it is used to count memory and to reject frees of pages that aren't allocated,
+ *          which would otherwise corrupt the buddy lists.
+ *
+ *          The page database keeps a k_page per page frame next to the bitmap,
+ *          the zone links its free blocks through it, and allocated pages keep
+ *          their flags, reference count and owner in it.
+ *
+ *          A pool of pages that were already zeroed is kept topped up by the idle
+ *          thread, so the paths that need a clean page (page tables, user pages
+ *          backed on fault) don't have to clear it while they wait for it.
+ *
+ *          Single pages are allocated and freed through per-processor caches, which
+ *          are refilled from and drained to the bitmap in batches, so only the batch
+ *          operations and the contiguous allocations have to take the bitmap's lock.
+ */
 class BitmapAllocator
 {
 public:
@@ -22,21 +81,178 @@ public:
      */
     void initialize(stivale2_struct_tag_memmap *memmapStruct);
 
+    /**
+     * @brief                       Allocate a single physical page from the current
+     *                              processor's cache, refilling it if it is empty.
+     *
+     * @return physical_address_t   The address of the page, 0 if there is no free page.
+     */
     physical_address_t allocatePage();
+
+    /**
+     * @brief                   Free an allocated physical page to the current
+     *                          processor's cache, draining it if it is full.
+     *
+     * @param blockAddr         The address of the page, page-aligned.
+     */
     void freePage(physical_address_t blockAddr);
 
+    /**
+     * @brief                       Allocate a single physical page filled with zeros, taken from
+     *                              the zeroed pool, or zeroed right away if the pool is empty.
+     *
+     * @return physical_address_t   The address of the page, 0 if there is no free page.
+     */
+    physical_address_t allocateZeroedPage();
+
+    /**
+     * @brief                   Zero free pages into the zeroed pool, called when the processor
+     *                          has nothing else to do.
+     *
+     * @param pages             The most pages to zero
+     * @return uint64_t         How many pages were added, 0 if the pool is full or there is no free memory
+     */
+    uint64_t fillZeroedPool(uint64_t pages);
+
+    /**
+     * @brief                       Allocate physically contiguous pages, the run is
+     *                              taken from a single buddy block and the pages after
+     *                              the run are returned to the zone.
+     *
+     * @param pages                 How many pages to allocate
+     * @param alignment             The alignment of the first page in bytes, a power of 2,
+     *                              PAGE_SIZE or above (e.g. 2MiB for huge pages)
+     * @return physical_address_t   The address of the first page, 0 if there is no such run.
+     */
+    physical_address_t allocatePages(uint64_t pages, uint64_t alignment = PAGE_SIZE);
+
+    /**
+     * @brief                   Free physically contiguous pages.
+     *
+     * @param blockAddr         The address of the first page, page-aligned.
+     * @param pages             How many pages to free
+     */
+    void freePages(physical_address_t blockAddr, uint64_t pages);
+
+    /**
+     * @brief                   Allocate a batch of single pages, taken from the current
+     *                          processor's cache first and then from the zone under a single
+     *                          lock. The pages aren't necessarily contiguous.
+     *
+     * @param pages             Receives the addresses of the pages
+     * @param count             How many pages to allocate
+     * @return uint64_t         How many pages were allocated, less than count if there is no free memory
+     */
+    uint64_t allocatePageList(physical_address_t *pages, uint64_t count);
+
+    /**
+     * @brief                   Free a batch of single pages under a single lock.
+     *
+     * @param pages             The addresses of the pages, 0 entries are skipped
+     * @param count             How many pages the list has
+     */
+    void freePageList(const physical_address_t *pages, uint64_t count);
+
+    /**
+     * @brief                   Add a reference to an allocated page, the page is
+     *                          only freed once every reference was freed.
+     *
+     * @param blockAddr         The address of the page, page-aligned.
+     */
+    void sharePage(physical_address_t blockAddr);
+
+    /**
+     * @brief                   Get how many mappings share an allocated page besides its owner.
+     *
+     * @param blockAddr         The address of the page, page-aligned.
+     * @return uint64_t         0 if the page has a single owner
+     */
+    uint64_t pageShares(physical_address_t blockAddr);
+
+    /**
+     * @brief                   Get the entry of a page in the page database.
+     *
+     * @param blockAddr         The address of the page
+     * @return k_page*          The entry, NULL if the page is outside of the database
+     */
+    k_page *getPage(physical_address_t blockAddr);
+
+    /**
+     * @brief                   Get the address of the page an entry describes.
+     *
+     * @param page              The entry, from getPage()
+     * @return physical_address_t The address of the page
+     */
+    physical_address_t getPageAddress(k_page *page);
+
     uint64_t totalMemory();
     uint64_t freeMemory();
     uint64_t usedMemory();
     uint64_t reservedMemory();
 
-private: /**
-          * @brief                   Count how much memory there is in the memmap
-          *
-          * @param memmapStruct      The memory map from stivale
-          * @return uint64_t         The total memory present in the memmap
-          */
-    static uint64_t _countMemory(stivale2_struct_tag_memmap *memmapStruct);
+    /**
+     * @brief                   Get how much free memory is held by the processors' caches
+     *                          and the zeroed pool, this memory is included in freeMemory().
+     *
+     * @return uint64_t         The cached memory in bytes
+     */
+    uint64_t cachedMemory();
+
+    /**
+     * @brief                   Log the statistics of the per-processor caches.
+     */
+    void dumpCacheStatistics();
+
+    /**
+     * @brief                   Log the free blocks of the buddy zone and its fragmentation.
+     */
+    void dumpFragmentation();
+
+private:
+    /**
+     * @brief                   Move a batch of pages from the bitmap to a cache.
+     *
+     * @param cache             The cache to refill
+     */
+    void _refillCache(k_page_cache *cache);
+
+    /**
+     * @brief                   Move a batch of pages from a cache back to the bitmap.
+     *
+     * @param cache             The cache to drain
+     */
+    void _drainCache(k_page_cache *cache);
+
+    /**
+     * @brief                       Allocate a single page straight from the zone,
+     *                              the lock must be held.
+     *
+     * @return physical_address_t   The address of the page, 0 if there is no free page.
+     */
+    physical_address_t _allocateBlock();
+
+    /**
+     * @brief                       Allocate a page from this processor's cache or the zone,
+     *                              without falling back to the zeroed pool.
+     *
+     * @return physical_address_t   The address of the page, 0 if there is no free page.
+     */
+    physical_address_t _allocateFreePage();
+
+    /**
+     * @brief                   Reset the entry of a page that is handed out, it has a single reference.
+     *
+     * @param blockAddr         The address of the page, page-aligned.
+     */
+    void _claimPage(physical_address_t blockAddr);
+
+    /**
+     * @brief                   Drop a reference of a page that is being freed.
+     *
+     * @param blockAddr         The address of the page, page-aligned.
+     * @return true             If the page has other references, it stays allocated
+     */
+    bool _dropShare(physical_address_t blockAddr);
 
     /**
      * @brief                   Lock a block, if the block is already locked,
@@ -47,19 +263,22 @@ private: /**
     void _lockBlock(physical_address_t blockAddr);
 
     /**
-     * @brief                   Free a block, if the block is already free,
-     *                          it won't do anything.
+     * @brief                   Free a range of pages in the bitmap, and return them to the zone.
+     *                          Pages that are already free are skipped.
      *
-     * @param blockAddr         The address of the block, page-aligned.
+     * @param firstPage         The index of the first page
+     * @param pages             How many pages to free
      */
-    void _freeBlock(physical_address_t blockAddr);
+    void _freeRange(uint64_t firstPage, uint64_t pages);
 
     /**
-     * @brief                   Get the address of the next free block.
+     * @brief                   Mark a range of pages as free, used while
+     *                          building the bitmap from the memory map.
      *
-     * @return physical_address The address of the block, page-aligned.
+     * @param firstPage         The index of the first page
+     * @param pages             How many pages to mark
      */
-    physical_address_t _nextBlock();
+    void _markFree(uint64_t firstPage, uint64_t pages);
 
     uint64_t _freeMemory;
     uint64_t _usedMemory;
@@ -67,7 +286,34 @@ private: /**
 
     bool _isInitialized;
 
-    Bitmap _memoryBitmap;
+    // A bit per page
+    uint64_t *_bitmap;
+
+    // An entry per page, indexed by the page frame number
+    k_page *_pages;
+
+    uint64_t _pageCount;
+    uint64_t _wordCount;
+
+    k_physical_zone _zone;
+
+    // Protects the bitmap, the zone and the memory counters
+    k_spinlock _lock;
+
+    k_page_cache _caches[PROCESSOR_MAX_CPUS];
+
+    // Free pages that are already filled with zeros, they are locked in the bitmap
+    physical_address_t _zeroedPages[BITMAP_ALLOCATOR_ZERO_POOL_SIZE];
+    uint64_t _zeroedCount;
+    // Protects the zeroed pool
+    k_spinlock _zeroedLock;
+
+    /**
+     * @brief                   Take a page from the zeroed pool.
+     *
+     * @return physical_address_t The address of the page, 0 if the pool is empty.
+     */
+    physical_address_t _takeZeroedPage();
 };
 
 /**
@@ -76,4 +322,29 @@ private: /**
  * @param memmapStruct      The memory map from stivale
  * @return uint64_t         The total memory present in the memmap
  */
-uint64_t countMemory(stivale2_struct_tag_memmap *memmapStruct);
\ No newline at end of file
+uint64_t countMemory(stivale2_struct_tag_memmap *memmapStruct);
+
+/**
+ * @brief                   Fill a page with zeros, a quadword at a time
+ *
+ * @param blockAddr         The address of the page, page-aligned
+ */
+void bitmapZeroPage(physical_address_t blockAddr);
+
+/**
+ * @brief                   Count the set bits of a word
+ *
+ * @param word              The word
+ * @return uint64_t         How many bits are set
+ */
+uint64_t bitmapPopcount(uint64_t word);
+
+#ifdef BENCHMARK_PHYSICAL_ALLOCATOR
+/**
+ * @brief                   Allocates and frees 1M pages in batches and logs the
+ *                          amount of cycles it took.
+ *
+ * @param allocator         The allocator to benchmark
+ */
+void bitmapAllocatorBenchmark(BitmapAllocator *allocator);
+#endif
@@ -2,23 +2,100 @@
 
 #include <types.hpp>
 
+// The default step of the heap's growth, and the least the heap grows by
 #define K_HEAP_EXPANSION_STEP 0x100000
 
+// Free memory at the end of the heap above this is returned to the physical allocator,
+// the heap keeps a growth step of it so it doesn't shrink and grow back right away
+#define K_HEAP_TRIM_THRESHOLD (4 * K_HEAP_EXPANSION_STEP)
+
+// Allocations of this size and above are served by pages of their own
+#define K_HEAP_LARGE_THRESHOLD 0x10000
+
+// How many call sites the statistics can tell apart, the rest are counted together
+#define K_HEAP_CALLSITE_COUNT 256
+// How many call sites a report lists, the ones holding the most memory
+#define K_HEAP_REPORT_CALLSITES 16
+// The free chunks histogram has a bucket per power of 2
+#define K_HEAP_HISTOGRAM_BUCKETS 32
+// The longest line of a report
+#define K_HEAP_REPORT_LINE 128
+
 extern bool heapVerbose;
 
+/**
+ * @brief The allocation statistics of a call site of the heap
+ */
+struct k_heap_callsite
+{
+    // The return address of the allocation, 0 for the sites that didn't fit the table
+    virtual_address_t site;
+
+    uint64_t bytes;       // Bytes currently allocated
+    uint64_t peakBytes;   // The most bytes that were allocated at once
+    uint64_t allocations; // Allocations that were made
+    uint64_t frees;       // Allocations that were freed
+};
+
+/**
+ * @brief Receives the lines of a heap report
+ *
+ * @param context The context that was given with the writer
+ * @param line    The line, without a newline
+ */
+typedef void (*k_heap_report_writer)(void *context, const char *line);
+
+/**
+ * @brief How the heap decides how much to grow by
+ */
+enum k_heap_growth_policy
+{
+    // Grow by the step
+    HEAP_GROWTH_FIXED,
+    // Grow by half the heap's size, but at least by the step
+    HEAP_GROWTH_GEOMETRIC
+};
+
 /**
  * @brief Initializes the kernel's heap at the given memory address'
  *
  * @param start The start of the heap
- * @param end   The end of the heap
+ * @param end   The end of the heap, the memory up to it must already be mapped.
+ *              The heap never shrinks below it.
  */
 void heapInitialize(virtual_address_t start, virtual_address_t end);
 
 /**
- * @brief Expands the heap (downwards)
+ * @brief Set how the heap grows
+ *
+ * @param policy The growth policy
+ * @param step   The least the heap grows by, a multiple of PAGE_SIZE
+ */
+void heapSetGrowthPolicy(k_heap_growth_policy policy, uint64_t step);
+
+/**
+ * @brief Expands the heap (upwards) by the growth policy, only the new pages are mapped.
+ * The heap's lock must be held.
  *
+ * @param size  The least amount of memory to add
+ * @return true If the heap has grown
+ */
+bool heapExpand(uint64_t size);
+
+/**
+ * @brief Take the free pages at the end of the heap off it, if there are more of them
+ * than K_HEAP_TRIM_THRESHOLD. The heap's lock must be held, and heapFinishTrim must be
+ * called once it is released.
+ *
+ * @return uint64_t How much memory was taken off, 0 if nothing was
+ */
+uint64_t heapTrim();
+
+/**
+ * @brief Unmap the pages the last heapTrim took off, and return them to the physical
+ * allocator. The heap's lock must not be held, as the unmap waits on the other processors.
  */
-bool heapExpand();
+void heapFinishTrim();
 
 /**
  * @brief Allocate some memory on the heap
@@ -28,9 +105,49 @@ bool heapExpand();
  */
 void *heapAllocate(uint64_t size);
 
+/**
+ * @brief Allocate some memory on the heap, at an aligned address
+ *
+ * @param size  How much memory to allocate
+ * @param alignment The alignment of the address, a power of 2
+ * @return      The allocated memory address
+ */
+void *heapAllocateAligned(uint64_t size, uint64_t alignment);
+
+/**
+ * @brief Change the size of an allocation, it grows in place if the memory after it
+ * is free, otherwise it is moved. A moved allocation keeps the default alignment only.
+ *
+ * @param mem   The pointer to the memory, NULL to allocate
+ * @param size  The new size, 0 to free
+ * @return      The address of the allocation
+ */
+void *heapReallocate(void *mem, uint64_t size);
+
 /**
  * @brief Free allocated memory on the heap
  *
  * @param mem   The pointer to the memory
  */
 void heapFree(void *mem);
+
+/**
+ * @brief Get the size of the biggest allocation the heap can serve without growing
+ *
+ * @return uint64_t The size in bytes
+ */
+uint64_t heapLargestFreeBlock();
+
+/**
+ * @brief Write a report of the heap: its usage, the histogram of the free chunks,
+ * and the call sites that hold the most memory
+ *
+ * @param writer  Receives the report line by line, it may allocate
+ * @param context Given to the writer
+ */
+void heapReport(k_heap_report_writer writer, void *context);
+
+/**
+ * @brief Log the heap's report
+ */
+void heapDumpStatistics();
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <types.hpp>
+
+// The page is never handed out (firmware, the kernel image, the page database itself)
+#define PAGE_FRAME_RESERVED 0x0001
+// The page holds a page table
+#define PAGE_FRAME_PAGETABLE 0x0002
+// The page is mapped to userspace, its owner is the address space
+#define PAGE_FRAME_USER 0x0004
+// The page is known to be filled with zeros
+#define PAGE_FRAME_ZEROED 0x0008
+// The page belongs to a page cache, its owner is the cached object and its index the offset in it
+#define PAGE_FRAME_CACHED 0x0010
+// The page can't be reclaimed
+#define PAGE_FRAME_LOCKED 0x0020
+
+/**
+ * @brief   The metadata of a single physical page, an entry of the page database.
+ *          The database is an array with an entry per page frame, indexed by the
+ *          page frame number, so the entry of a physical address is found in O(1).
+ *          An entry is 32 bytes, two entries share a cache line.
+ *
+ *          The buddy fields are used by the zone while the page is free, the rest
+ *          describe an allocated page.
+ */
+struct k_page
+{
+    // Next free block of the same order
+    uint32_t next;
+    // Previous free block of the same order
+    uint32_t prev;
+    // The order of the free block starting at this page
+    uint8_t order;
+    // Whether a free block starts at this page
+    uint8_t free;
+
+    // PAGE_FRAME_* flags
+    volatile uint16_t flags;
+
+    // How many mappings reference the allocated page, the page is freed when the last one lets go
+    volatile uint32_t refcount;
+
+    // The address space (PML4) of a user page, or the object of a cached page, 0 if none
+    uint64_t owner;
+    // The index of the page in its owner, e.g. its offset in the cached object
+    uint64_t index;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <types.hpp>
+#include <stddef.h>
 
 typedef uint64_t pagetable_entry_t;
 
@@ -9,6 +10,18 @@ typedef uint64_t page_flags_t;
 
 #define PAGETABLE_SIZE 512
 #define PAGE_SIZE 4096
+// A page mapped by a PD entry
+#define PAGE_LARGE_SIZE ((uint64_t)0x200000)
+// A page mapped by a PDPT entry
+#define PAGE_HUGE_SIZE ((uint64_t)0x40000000)
+// The memory mapped by a PML4 entry
+#define PAGING_PML4E_SIZE ((uint64_t)0x8000000000)
+
+// How many physical pages are allocated or freed at once by the range functions
+#define PAGING_BATCH_PAGES 64
+
+// CR0 write protect, the kernel's writes fault on read-only pages as well
+#define PAGING_CR0_WP ((uint64_t)1 << 16)
 
 const uint64_t HHDM = 0xffff800000000000;
 
@@ -19,6 +32,8 @@ const uint64_t HHDM = 0xffff800000000000;
 #define PD_INDEXER(add) ((add >> 21) & 0x01ff)
 #define PDPT_INDEXER(add) ((add >> 30) & 0x01ff)
 #define PML4_INDEXER(add) ((add >> 39) & 0x01ff)
+// The physical address of a large page entry, without the PAT bit
+#define PAGING_LARGE_ADDRESS(entry, size) ((entry) & 0x000ffffffffff000 & ~((uint64_t)(size) - 1))
 
 // #define VERBOSE_PAGING
 
@@ -55,6 +70,11 @@ const uint64_t PAGE_PAT = 1 << 7;
 const uint64_t PAGE_GLOBAL = (uint64_t)1 << 8;
 const uint64_t PAGE_ORDINARY = (uint64_t)1 << 11;
 const uint64_t PAGE_EXEC = (uint64_t)1 << 63;
+// The PAT bit of a large page, bit 7 is the size bit there
+const uint64_t PAGE_LARGE_PAT = (uint64_t)1 << 12;
+
+// The flags of a leaf entry, everything but the address
+#define PAGING_LEAF_FLAGS_MASK ((pagetable_entry_t)0xfff | PAGE_EXEC | PAGE_LARGE_PAT)
 
 #define PAGING_ALIGN_PAGE_DOWN(v) ((v) & ~(PAGE_SIZE - 1))
 #define PAGING_ALIGN_PAGE_UP(v) (((v) & (PAGE_SIZE - 1)) ? (PAGING_ALIGN_PAGE_DOWN(v) + PAGE_SIZE) : (v))
@@ -125,6 +145,106 @@ void pagingMapPageInSpace(virtual_address_t virt, physical_address_t phys,
                           k_paging_flags flags = PAGING_DEFAULT_FLAGS,
                           bool override = false);
 
+/**
+ * @brief Map a single 2MiB or 1GiB page in the given space.
+ *
+ * @param virt  The virtual address, aligned to the page size
+ * @param phys  The physical address, aligned to the page size
+ * @param pageSize  PAGE_LARGE_SIZE or PAGE_HUGE_SIZE
+ * @param pml4Addr The physical address for the pml4
+ * @param flags The flags, ptFlags are used for the large page entry
+ * @param override Whether or not to override if some of the range is already mapped.
+ * @return true If the page was mapped
+ * @return false If the page can't be mapped, because of the alignment, the processor's support,
+ * or because some of the range is already mapped and override is off
+ */
+bool pagingMapLargePageInSpace(virtual_address_t virt, physical_address_t phys, uint64_t pageSize,
+                               physical_address_t pml4Addr,
+                               k_paging_flags flags = PAGING_DEFAULT_FLAGS,
+                               bool override = false);
+
+/**
+ * @brief Split the large page that maps the virtual address into a table of smaller pages,
+ * down to 4KiB pages, the mapping itself doesn't change.
+ *
+ * @param virt  The virtual address
+ * @param pml4Addr The physical address for the pml4
+ * @return true If a large page was split
+ * @return false If the address isn't mapped by a large page
+ */
+bool pagingSplitLargePage(virtual_address_t virt, physical_address_t pml4Addr);
+
+/**
+ * @brief Map a range of virtual addresses to a range of physical addresses in the given space.
+ * 1GiB and 2MiB pages are used wherever the alignment and the size allow it.
+ *
+ * @param virt  The start of the virtual range, page-aligned
+ * @param phys  The start of the physical range, page-aligned
+ * @param size  The size of the range in bytes
+ * @param pml4Addr The physical address for the pml4
+ * @param flags The flags
+ * @param override Whether or not to override if the virtual address is already mapped.
+ */
+void pagingMapMemoryInTable(virtual_address_t virt, physical_address_t phys, uint64_t size,
+                            physical_address_t pml4Addr,
+                            k_paging_flags flags = PAGING_DEFAULT_FLAGS,
+                            bool override = false);
+
+/**
+ * @brief Map a range of virtual addresses to a range of physical addresses in the current space.
+ *
+ * @param virt  The start of the virtual range, page-aligned
+ * @param phys  The start of the physical range, page-aligned
+ * @param size  The size of the range in bytes
+ * @param flags The flags
+ * @param override Whether or not to override if the virtual address is already mapped.
+ */
+void pagingMapMemory(virtual_address_t virt, physical_address_t phys, uint64_t size,
+                     k_paging_flags flags = PAGING_DEFAULT_FLAGS,
+                     bool override = false);
+
+/**
+ * @brief Map a list of physical pages to consecutive virtual addresses in the given space,
+ * the tables are walked once per page table rather than once per page.
+ *
+ * @param virt  The start of the virtual range, page-aligned
+ * @param pages The physical pages, page-aligned
+ * @param count How many pages the list has
+ * @param pml4Addr The physical address for the pml4
+ * @param flags The flags
+ * @param override Whether or not to override if the virtual address is already mapped.
+ */
+void pagingMapPagesInTable(virtual_address_t virt, const physical_address_t *pages, uint64_t count,
+                           physical_address_t pml4Addr,
+                           k_paging_flags flags = PAGING_DEFAULT_FLAGS,
+                           bool override = false);
+
+/**
+ * @brief Allocate physical pages and map them to a range of virtual addresses in the given space.
+ * The pages are allocated and mapped in batches of PAGING_BATCH_PAGES. Addresses that are
+ * already mapped keep their pages, and the pages allocated for them are freed.
+ *
+ * @param virt  The start of the virtual range, page-aligned
+ * @param size  The size of the range in bytes
+ * @param pml4Addr The physical address for the pml4
+ * @param flags The flags
+ * @return true If the whole range was mapped
+ * @return false If there wasn't enough physical memory, nothing is left mapped
+ */
+bool pagingAllocateMemoryInTable(virtual_address_t virt, uint64_t size,
+                                 physical_address_t pml4Addr,
+                                 k_paging_flags flags = PAGING_DEFAULT_FLAGS);
+
+/**
+ * @brief Unmap a range of virtual addresses in the given space, and free the physical
+ * pages that were mapped there.
+ *
+ * @param virt  The start of the virtual range, page-aligned
+ * @param size  The size of the range in bytes
+ * @param pml4Addr The physical address for the pml4
+ */
+void pagingFreeMemoryInTable(virtual_address_t virt, uint64_t size, physical_address_t pml4Addr);
+
 /**
  * @brief Unmap the virtual address if it is mapped, otherwise does nothing.
  *
@@ -144,12 +264,73 @@ physical_address_t pagingUnmapPage(virtual_address_t virt);
  */
 physical_address_t pagingUnmapPageInSpace(virtual_address_t virt, physical_address_t pml4Addr);
 
+/**
+ * @brief Unmap a range of virtual addresses in the given space, large pages that are
+ * fully covered by the range are removed whole, others are split. The tables are walked
+ * once per page table. The mapped memory isn't freed.
+ *
+ * @param virt  The start of the range, page-aligned
+ * @param size  The size of the range in bytes
+ * @param pml4Addr  The address of the PML4
+ * @param pages Receives the physical address of every page in the range, 0 for pages
+ * that weren't mapped, may be NULL
+ */
+void pagingUnmapMemoryInTable(virtual_address_t virt, uint64_t size, physical_address_t pml4Addr,
+                              physical_address_t *pages = NULL);
+
+/**
+ * @brief Unmap a range of virtual addresses in the current space.
+ *
+ * @param virt  The start of the range, page-aligned
+ * @param size  The size of the range in bytes
+ */
+void pagingUnmapMemory(virtual_address_t virt, uint64_t size);
+
+/**
+ * @brief Share the mapped pages of a range with another space, for copy-on-write.
+ * The pages are made read-only in the source and mapped read-only at the same
+ * addresses in the target, each page gains a share in the physical allocator.
+ *
+ * @param virt  The start of the range, page-aligned
+ * @param size  The size of the range in bytes
+ * @param sourcePml4 The physical address of the pml4 the pages are mapped in
+ * @param targetPml4 The physical address of the pml4 to share the pages with
+ * @param flags The flags for the tables created in the target
+ * @return uint64_t How many pages were shared
+ */
+uint64_t pagingShareMemoryInTable(virtual_address_t virt, uint64_t size,
+                                  physical_address_t sourcePml4, physical_address_t targetPml4,
+                                  k_paging_flags flags);
+
+/**
+ * @brief Get the 4KiB page table entry that maps a virtual address.
+ *
+ * @param virt  The virtual address
+ * @param pml4Addr The physical address for the pml4
+ * @return pagetable_entry_t* The entry, NULL if there is no page table or the address is in a large page
+ */
+pagetable_entry_t *pagingGetPageEntryInSpace(virtual_address_t virt, physical_address_t pml4Addr);
+
 /**
  * @brief Initialize paging with some mappings.
  *
  */
 void pagingInitialize(physical_address_t kernelBase, virtual_address_t hhdm);
 
+/**
+ * @brief Move an application processor from the bootloader's tables to the kernel's,
+ *        and enable the paging features the bootstrap processor uses.
+ *
+ */
+void pagingInitializeProcessor();
+
+/**
+ * @brief Get the physical address of the kernel's PML4, created by pagingInitialize.
+ *
+ * @return physical_address_t The physical address of the PML4.
+ */
+physical_address_t pagingGetKernelSpace();
+
 /**
  * @brief Switch the address space, by replacing the PML4 with another one.
  *
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <types.hpp>
+#include <stdint.h>
+
+// How many PCIDs each processor hands out, PCID 0 is left for spaces without a slot
+#define PCID_SLOTS 64
+
+// CR3 bit that keeps the TLB entries of the loaded PCID
+#define PCID_CR3_NOFLUSH ((uint64_t)1 << 63)
+#define PCID_CR3_MASK ((uint64_t)0xFFF)
+
+// CR4 bit that enables PCIDs
+#define PCID_CR4_PCIDE ((uint64_t)1 << 17)
+
+/**
+ * @brief A PCID of a processor, and the space it is assigned to
+ */
+struct k_pcid_slot
+{
+    // The PML4 of the space, 0 if the slot is free
+    physical_address_t space;
+    // Whether the entries tagged with this PCID may be out of date
+    volatile uint64_t stale;
+    // The value of the processor's clock when the slot was last loaded
+    uint64_t lastUse;
+};
+
+/**
+ * @brief   The PCIDs of a single processor.
+ *          PCIDs are assigned per processor, so recycling one never requires
+ *          coordinating with the other processors. A space that is switched to
+ *          gets the slot it already has, or the least recently used one.
+ */
+struct k_pcid_processor
+{
+    k_pcid_slot slots[PCID_SLOTS];
+    uint64_t clock;
+
+    // Statistics
+    uint64_t hits;     // Switches that kept the TLB entries
+    uint64_t misses;   // Switches that had to flush
+    uint64_t recycles; // Slots taken from another space
+};
+
+/**
+ * @brief Enable PCIDs if the processor supports them, the current CR3 must use PCID 0.
+ */
+void pcidInitialize();
+
+/**
+ * @brief Enable PCIDs on an application processor, if they were enabled on the
+ *        bootstrap processor. The current CR3 must use PCID 0.
+ */
+void pcidInitializeProcessor();
+
+/**
+ * @brief Whether PCIDs are in use
+ */
+bool pcidEnabled();
+
+/**
+ * @brief Get the CR3 value to switch to a space on this processor, assigning it a PCID.
+ * The interrupts must be disabled.
+ *
+ * @param space The PML4 of the space
+ * @return uint64_t The value for CR3, with PCID_CR3_NOFLUSH if the cached entries are valid
+ */
+uint64_t pcidSelect(physical_address_t space);
+
+/**
+ * @brief Mark the entries of a space as out of date on every processor,
+ * they'll be flushed the next time the space is loaded.
+ *
+ * @param space The PML4 of the space
+ */
+void pcidInvalidateSpace(physical_address_t space);
+
+/**
+ * @brief Mark the entries of all the spaces as out of date on every processor,
+ * used when kernel mappings, which every PCID may hold, change.
+ */
+void pcidInvalidateAll();
+
+/**
+ * @brief Release the slots of a space that is destroyed, so its PML4 can be reused.
+ *
+ * @param space The PML4 of the space
+ */
+void pcidReleaseSpace(physical_address_t space);
+
+/**
+ * @brief Log the PCID statistics of every processor
+ */
+void pcidDumpStatistics();
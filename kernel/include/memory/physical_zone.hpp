@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <types.hpp>
+#include <memory/page.hpp>
+
+// The highest order of a block, 2^18 pages (1GiB)
+#define PHYSICAL_ZONE_MAX_ORDER 18
+
+// Marks the end of a free list
+#define PHYSICAL_ZONE_NO_FRAME ((uint32_t)-1)
+
+/**
+ * @brief   A zone of physical page frames, managed by a buddy allocator.
+ *          Free blocks of 2^order pages are kept in a free list per order,
+ *          blocks are always aligned to their size, so the buddy of a block is
+ *          found by flipping a single bit of its frame number.
+ *          The metadata is kept in the page database outside of the frames, so the
+ *          frames themselves don't need to be mapped.
+ */
+struct k_physical_zone
+{
+    // The page database, an entry per page in the zone
+    k_page *frames;
+    uint64_t frameCount;
+
+    // The head of the free list of each order
+    uint32_t freeLists[PHYSICAL_ZONE_MAX_ORDER + 1];
+    // How many free blocks each list has
+    uint64_t freeBlocks[PHYSICAL_ZONE_MAX_ORDER + 1];
+
+    // How many free pages the zone has
+    uint64_t freePages;
+
+    /**
+     * @brief Initialize an empty zone, all the frames are considered allocated.
+     *
+     * @param frames The page database, must hold frameCount entries
+     * @param frameCount How many frames the zone covers, starting at frame 0
+     */
+    void initialize(k_page *frames, uint64_t frameCount);
+
+    /**
+     * @brief Free a range of frames, the range is split into the largest aligned
+     * blocks possible, each of them is coalesced with its free buddies.
+     *
+     * @param firstFrame The first frame of the range
+     * @param frames How many frames to free
+     */
+    void freeRange(uint64_t firstFrame, uint64_t frames);
+
+    /**
+     * @brief Allocate a block of 2^order frames, aligned to its size.
+     *
+     * @param order The order of the block
+     * @return uint64_t The first frame of the block, PHYSICAL_ZONE_NO_FRAME if there is no such block
+     */
+    uint64_t allocate(uint8_t order);
+
+    /**
+     * @brief Free a block of 2^order frames, and coalesce it with its buddies.
+     *
+     * @param frame The first frame of the block, aligned to the block's size
+     * @param order The order of the block
+     */
+    void free(uint64_t frame, uint8_t order);
+
+    /**
+     * @brief Get the order of the largest free block.
+     *
+     * @return int The order, -1 if the zone has no free frames
+     */
+    int largestFreeOrder();
+
+    /**
+     * @brief Get the fragmentation index of an order, how much of the free
+     * memory can't be used to serve an allocation of that order.
+     *
+     * @param order The order
+     * @return uint64_t The index, in thousandths: 0 is no fragmentation, 1000 means
+     * no block of that order can be allocated
+     */
+    uint64_t fragmentationIndex(uint8_t order);
+
+    /**
+     * @brief Log the free blocks of every order and the fragmentation indices.
+     */
+    void dumpStatistics();
+
+private:
+    void _push(uint64_t frame, uint8_t order);
+    void _remove(uint64_t frame);
+};
+
+/**
+ * @brief Get the smallest order of a block that holds a number of frames.
+ *
+ * @param frames The number of frames
+ * @return uint8_t The order, ceil(log2(frames))
+ */
+uint8_t physicalZoneOrder(uint64_t frames);
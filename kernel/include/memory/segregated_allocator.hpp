@@ -0,0 +1,203 @@
+#pragma once
+
+#include <types.hpp>
+#include <stdint.h>
+#include <stddef.h>
+
+// Chunks and payloads are aligned to this
+#define HEAP_CHUNK_ALIGNMENT 16
+// The header of a chunk, the payload starts right after it
+#define HEAP_CHUNK_OVERHEAD 16
+// The smallest chunk, big enough to hold the free list links
+#define HEAP_CHUNK_MIN_SIZE 32
+
+// Chunk flags, kept in the low bits of the header
+#define HEAP_CHUNK_USED 1
+#define HEAP_CHUNK_PREV_USED 2
+#define HEAP_CHUNK_LARGE 4
+#define HEAP_CHUNK_FLAGS ((uint64_t)(HEAP_CHUNK_ALIGNMENT - 1))
+
+// The high bits of the header of a used chunk hold a tag of its owner's choice,
+// the allocator keeps it until the chunk is freed
+#define HEAP_CHUNK_TAG_SHIFT 48
+#define HEAP_CHUNK_TAG_MASK (~(uint64_t)0 << HEAP_CHUNK_TAG_SHIFT)
+
+// Chunks below this size have a bin per 16 bytes, bigger ones a bin per power of 2
+#define HEAP_SMALL_LIMIT 512
+#define HEAP_SMALL_BINS (HEAP_SMALL_LIMIT / HEAP_CHUNK_ALIGNMENT)
+#define HEAP_BIN_COUNT 64
+
+/**
+ * @brief   A chunk of the heap.
+ *          The header holds the size of the chunk (including the header) and its flags,
+ *          and whether the previous chunk is used. When a chunk is free its size is also
+ *          written to the prevSize field of the next chunk (the boundary tag), so both
+ *          neighbours of a chunk are found in O(1).
+ */
+struct k_heap_chunk
+{
+    // The size of the previous chunk, only valid if it is free
+    uint64_t prevSize;
+    // The size of the chunk and the flags
+    uint64_t header;
+
+    // Only valid in free chunks, the links in the chunk's bin
+    k_heap_chunk *nextFree;
+    k_heap_chunk *prevFree;
+};
+
+/**
+ * @brief   A segregated-fit allocator with boundary tags.
+ *          Free chunks are kept in bins by size, a bin per 16 bytes for small chunks
+ *          and a bin per power of 2 above, a bitmap of the non-empty bins finds the
+ *          first bin that can serve a request with a single bit scan.
+ *          Freeing coalesces with both neighbours through the boundary tags,
+ *          so allocate and free don't depend on how many chunks the heap has.
+ *          The last chunk of the area is a used sentinel, so it never coalesces past the end.
+ */
+struct k_segregated_allocator
+{
+    /**
+     * @brief Initialize the allocator over an area
+     *
+     * @param start The start of the area, aligned to HEAP_CHUNK_ALIGNMENT
+     * @param end   The end of the area
+     */
+    void init(virtual_address_t start, virtual_address_t end);
+
+    /**
+     * @brief Allocates memory
+     *
+     * @param size How much memory to allocate
+     * @return void* ptr to the allocated memory, 0 if no memory was allocated
+     */
+    void *allocate(uint64_t size);
+
+    /**
+     * @brief Allocates memory whose address is a multiple of the alignment
+     *
+     * @param size How much memory to allocate
+     * @param alignment A power of 2
+     * @return void* ptr to the allocated memory, 0 if no memory was allocated
+     */
+    void *allocateAligned(uint64_t size, uint64_t alignment);
+
+    /**
+     * @brief Resize an allocation in place, it grows into the next chunk if it is free
+     *
+     * @param mem ptr to the memory
+     * @param size The new size
+     * @return true If the allocation now holds size bytes, false if it has to move
+     */
+    bool resize(void *mem, uint64_t size);
+
+    /**
+     * @brief Free memory
+     *
+     * @param mem ptr to the memory
+     * @return uint64_t The size of the free'd memory
+     */
+    uint64_t free(void *mem);
+
+    /**
+     * @brief Expand the allocator's working area, the new memory must follow the area
+     *
+     * @param amount How much to expand
+     */
+    void expand(uint64_t amount);
+
+    /**
+     * @brief Get the size of the free chunk at the end of the area
+     *
+     * @return uint64_t The size of the chunk, 0 if the last chunk is used
+     */
+    uint64_t trailingFree();
+
+    /**
+     * @brief Shrink the allocator's working area, the memory is taken from the free
+     * chunk at the end of the area
+     *
+     * @param amount How much to shrink, at most trailingFree(), and either all of it
+     * or small enough to leave a chunk behind
+     */
+    void shrink(uint64_t amount);
+
+    /**
+     * @brief Get the size of the biggest free chunk
+     *
+     * @return uint64_t The size of the chunk, including its header
+     */
+    uint64_t largestFree();
+
+    /**
+     * @brief Count the free chunks by size, a bucket per power of 2
+     *
+     * @param chunks  Receives how many free chunks each bucket has
+     * @param bytes   Receives how many bytes the chunks of each bucket hold
+     * @param buckets The size of the arrays, bigger chunks are counted in the last bucket
+     */
+    void freeHistogram(uint64_t *chunks, uint64_t *bytes, uint64_t buckets);
+
+    /**
+     * @brief Get the usable size of an allocation
+     *
+     * @param mem ptr to the memory
+     * @return uint64_t How many bytes the allocation can hold
+     */
+    uint64_t usableSize(void *mem);
+
+private:
+    // The heads of the bins
+    k_heap_chunk *bins[HEAP_BIN_COUNT];
+    // A bit per bin that isn't empty
+    uint64_t binmap;
+
+    // The end sentinel
+    k_heap_chunk *sentinel;
+
+    /**
+     * @brief Get the bin a chunk size belongs to
+     */
+    uint64_t _binIndex(uint64_t size);
+
+    /**
+     * @brief Put a free chunk into its bin, and write its boundary tag
+     */
+    void _insert(k_heap_chunk *chunk);
+
+    /**
+     * @brief Remove a free chunk from its bin
+     */
+    void _unlink(k_heap_chunk *chunk);
+
+    /**
+     * @brief Find a free chunk of at least the given size and remove it from its bin
+     *
+     * @return k_heap_chunk* The chunk, NULL if there is none
+     */
+    k_heap_chunk *_take(uint64_t size);
+
+    /**
+     * @brief Get the size of the chunk that serves an allocation of the given size
+     */
+    uint64_t _chunkSize(uint64_t size);
+
+    /**
+     * @brief Mark a chunk as used, the tail after the given size is split off if it is
+     * big enough to be a chunk
+     */
+    void _use(k_heap_chunk *chunk, uint64_t size);
+
+    /**
+     * @brief Coalesce a chunk that is about to be freed with its free neighbours
+     *
+     * @return k_heap_chunk* The coalesced chunk
+     */
+    k_heap_chunk *_coalesce(k_heap_chunk *chunk);
+};
+
+#define HEAP_CHUNK_SIZE(chunk) ((chunk)->header & ~(HEAP_CHUNK_FLAGS | HEAP_CHUNK_TAG_MASK))
+#define HEAP_CHUNK_TAG(chunk) ((chunk)->header >> HEAP_CHUNK_TAG_SHIFT)
+#define HEAP_CHUNK_NEXT(chunk) ((k_heap_chunk *)((uint64_t)(chunk) + HEAP_CHUNK_SIZE(chunk)))
+#define HEAP_CHUNK_OF(mem) ((k_heap_chunk *)((uint64_t)(mem) - HEAP_CHUNK_OVERHEAD))
+#define HEAP_CHUNK_PAYLOAD(chunk) ((void *)((uint64_t)(chunk) + HEAP_CHUNK_OVERHEAD))
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <types.hpp>
+#include <stdint.h>
+#include <stddef.h>
+#include <system/processor/processor.hpp>
+#include <utils/spinlock.hpp>
+
+// How many objects a per-processor magazine can hold
+#define SLAB_MAGAZINE_SIZE 16
+// How many objects are moved between a magazine and the slabs at once
+#define SLAB_MAGAZINE_BATCH 8
+
+// The least amount of objects a slab should hold, bigger objects get bigger slabs
+#define SLAB_MIN_OBJECTS 8
+
+// The first object of a slab starts on a cache line of its own
+#define SLAB_CACHE_LINE_SIZE 64
+
+// How many free objects a pool keeps for its owner
+#define SLAB_POOL_SIZE 16
+
+// #define VERBOSE_SLAB
+
+struct k_slab_cache;
+
+/**
+ * @brief   The header of a slab, placed at the start of the slab's memory.
+ *          A slab is a naturally aligned run of pages, so the slab of an
+ *          object is found by aligning the object's address down.
+ */
+struct k_slab
+{
+    // The cache this slab belongs to
+    k_slab_cache *cache;
+
+    // The free objects of the slab, linked through the word after each object
+    void *freeList;
+
+    // How many objects of the slab are allocated (including the ones in magazines)
+    uint64_t used;
+
+    // The previous slab in the cache's list
+    k_slab *prev;
+    // The next slab in the cache's list
+    k_slab *next;
+};
+
+/**
+ * @brief   A per-processor stack of free objects, served without taking the cache's lock.
+ */
+struct k_slab_magazine
+{
+    void *objects[SLAB_MAGAZINE_SIZE];
+    uint64_t count;
+};
+
+/**
+ * @brief   A cache of objects of a single type (Bonwick's slab allocator).
+ *          Objects are carved out of slabs of physical pages, each slab keeps its
+ *          own free list, and the cache keeps its slabs in partial, full and empty lists.
+ *          Allocations and frees go through per-processor magazines first, so the
+ *          common case is a push or pop with the interrupts disabled.
+ *          The free list link is kept after the object, so a constructed object
+ *          keeps its state while it is free, and only one empty slab is kept around.
+ *
+ *          A cache is an aggregate, so it can be defined statically with
+ *          SLAB_CACHE_INITIALIZER and used before any initialization code runs,
+ *          its layout is computed when its first slab is created.
+ */
+struct k_slab_cache
+{
+    // The name of the cache, for the statistics
+    const char *name;
+
+    // The size of an object
+    uint64_t objectSize;
+
+    // Called on every object once, when its slab is created
+    void (*constructor)(void *object);
+
+    // The distance between objects, the object and the free list link
+    uint64_t objectStride;
+    // The size of a slab, a power of 2 pages
+    uint64_t slabSize;
+    // How many objects fit in a slab
+    uint64_t objectsPerSlab;
+
+    // Slabs with both free and allocated objects
+    k_slab *partial;
+    // Slabs without free objects
+    k_slab *full;
+    // A slab without allocated objects, kept for the next allocations
+    k_slab *empty;
+
+    // Protects the slab lists
+    k_spinlock lock;
+
+    k_slab_magazine magazines[PROCESSOR_MAX_CPUS];
+
+    // Statistics
+    uint64_t slabs;         // Slabs the cache holds
+    uint64_t activeObjects; // Objects that are allocated
+    uint64_t allocations;   // Objects that were allocated
+    uint64_t frees;         // Objects that were freed
+    uint64_t magazineHits;  // Allocations served by a magazine
+
+    // The next cache in the list of all caches
+    k_slab_cache *nextCache;
+
+    /**
+     * @brief Allocate an object, panics if there is no memory for a new slab
+     *
+     * @return void* The object
+     */
+    void *allocate();
+
+    /**
+     * @brief Free an object that was allocated from this cache
+     *
+     * @param object The object
+     */
+    void free(void *object);
+
+    /**
+     * @brief Log the statistics of the cache
+     */
+    void dumpStatistics();
+
+private:
+    /**
+     * @brief Take an object from the slabs, the lock must be held
+     *
+     * @return void* The object, NULL if there is no memory for a new slab
+     */
+    void *_allocateObject();
+
+    /**
+     * @brief Return an object to its slab, the lock must be held
+     *
+     * @param object The object
+     */
+    void _freeObject(void *object);
+
+    /**
+     * @brief Create a new slab, the lock must be held
+     *
+     * @return k_slab* The slab, NULL if there is no physical memory
+     */
+    k_slab *_grow();
+
+    /**
+     * @brief Give a slab back to the physical allocator, the lock must be held
+     *
+     * @param slab The slab, must have no allocated objects
+     */
+    void _release(k_slab *slab);
+
+    /**
+     * @brief Compute the layout of the slabs and register the cache, the lock must be held
+     */
+    void _setup();
+};
+
+/**
+ * @brief   A stash of free objects of a cache, kept by an owner (e.g. a process) for
+ *          the objects it allocates and frees often. Objects are taken from the
+ *          stash first, and return to it until it is full, so they stay warm and
+ *          don't go back and forth to the cache.
+ *
+ *          A pool is an aggregate, zeroed memory is an empty pool of no cache.
+ */
+struct k_slab_pool
+{
+    // The cache the objects come from
+    k_slab_cache *cache;
+
+    void *objects[SLAB_POOL_SIZE];
+    uint64_t count;
+
+    // Protects the stash, the owner may have a few threads
+    k_spinlock lock;
+
+    /**
+     * @brief Initialize an empty pool
+     *
+     * @param cache The cache the objects come from
+     */
+    void init(k_slab_cache *cache);
+
+    /**
+     * @brief Allocate an object, panics if the cache has no memory
+     *
+     * @return void* The object
+     */
+    void *allocate();
+
+    /**
+     * @brief Free an object that was allocated from the pool's cache
+     *
+     * @param object The object
+     */
+    void free(void *object);
+};
+
+/**
+ * @brief Define a cache statically
+ *
+ * @param name The name of the cache
+ * @param type The type of the objects
+ * @param constructor Called on every object once, NULL for none
+ */
+#define SLAB_CACHE_INITIALIZER(name, type, constructor)                \
+    {(name), sizeof(type), (constructor), 0, 0, 0, NULL, NULL, NULL, \
+     {0}, {}, 0, 0, 0, 0, 0, NULL}
+
+/**
+ * @brief Declare operator new and delete inside a type, so the type is served by a cache
+ */
+#define SLAB_DECLARE_OPERATORS()                 \
+    static void *operator new(size_t size);      \
+    static void operator delete(void *object)
+
+/**
+ * @brief Define operator new and delete of a type that declared them, to use the given cache
+ */
+#define SLAB_DEFINE_OPERATORS(type, cache)                  \
+    void *type::operator new(size_t size)                   \
+    {                                                       \
+        return (cache).allocate();                          \
+    }                                                       \
+    void type::operator delete(void *object)                \
+    {                                                       \
+        (cache).free(object);                               \
+    }
+
+/**
+ * @brief Log the statistics of all the caches
+ */
+void slabDumpStatistics();
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <types.hpp>
+#include <stdint.h>
+#include <memory/paging.hpp>
+#include <utils/spinlock.hpp>
+
+// Above this many pages a full flush is cheaper than invalidating each page
+#define TLB_FLUSH_THRESHOLD 32
+
+// The interrupt vector of a TLB shootdown IPI
+#define TLB_SHOOTDOWN_VECTOR 0xF0
+
+/**
+ * @brief   A batch of pages to invalidate in a single address space.
+ *          Pages are collected while the page tables are changed, and are all
+ *          invalidated at once by flush(), both locally and on the other processors
+ *          that may hold them. A batch that grows above TLB_FLUSH_THRESHOLD pages
+ *          turns into a full flush.
+ */
+struct k_tlb_batch
+{
+    // The PML4 of the space the pages belong to
+    physical_address_t space;
+
+    virtual_address_t pages[TLB_FLUSH_THRESHOLD];
+    uint64_t count;
+
+    // Whether the whole TLB should be flushed instead
+    bool full;
+
+    // Whether there are kernel pages, which are shared by every space and may be cached anywhere
+    bool kernel;
+    // Whether there are pages of the space's own half
+    bool user;
+
+    /**
+     * @brief Construct an empty batch
+     *
+     * @param space The PML4 of the space the pages belong to
+     */
+    k_tlb_batch(physical_address_t space);
+
+    /**
+     * @brief Add a page to the batch
+     *
+     * @param virt The virtual address of the page
+     */
+    void add(virtual_address_t virt);
+
+    /**
+     * @brief Add a range of pages to the batch
+     *
+     * @param virt The virtual address of the first page
+     * @param pages How many pages
+     */
+    void addRange(virtual_address_t virt, uint64_t pages);
+
+    /**
+     * @brief Invalidate the pages of the batch on every processor that may hold them,
+     * and empty the batch.
+     */
+    void flush();
+};
+
+/**
+ * @brief A shootdown request posted to a processor
+ */
+struct k_tlb_mailbox
+{
+    k_spinlock lock;
+
+    virtual_address_t pages[TLB_FLUSH_THRESHOLD];
+    uint64_t count;
+    bool full;
+
+    // Set by the sender, cleared by the target once it has invalidated
+    volatile uint64_t pending;
+};
+
+/**
+ * @brief Invalidate a single page on this processor
+ *
+ * @param virt The virtual address of the page
+ */
+void tlbInvalidatePage(virtual_address_t virt);
+
+/**
+ * @brief Flush the whole TLB on this processor, by reloading CR3
+ */
+void tlbFlush();
+
+/**
+ * @brief Record the space a processor is running, so shootdowns are only sent
+ * to the processors that may hold entries of a space.
+ *
+ * @param cpu The index of the processor
+ * @param space The PML4 of the space
+ */
+void tlbSetActiveSpace(uint64_t cpu, physical_address_t space);
+
+/**
+ * @brief Handle a shootdown request posted to this processor
+ */
+void tlbHandleShootdown(uint64_t);
@@ -3,6 +3,7 @@
 #include <types.hpp>
 #include <memory/virtual_address_range_allocator.hpp>
 #include <memory/paging.hpp>
+#include <utils/spinlock.hpp>
 
 #define USERSPACE_MEMORY_START          0x0000000000000000
 #define USERSPACE_MEMORY_END            0xFFFF800000000000
@@ -10,6 +11,10 @@
 #define USERSPACE_HEAP_EXPANSION        2 * MiB_unit
 #define USERSPACE_STACK_SIZE            10 * PAGE_SIZE
 #define INTERRUPT_STACK_SIZE            2 * PAGE_SIZE
+// How far a userspace stack can grow, it is only backed as far as it was touched
+#define USERSPACE_STACK_LIMIT           8 * MiB_unit
+// The unmapped pages under every stack
+#define STACK_GUARD_PAGES               1
 #define USERSPACE_STACK_MAX             0xFFFF400000000000
 
 struct k_userspace_allocator
@@ -33,8 +38,50 @@ struct k_userspace_allocator
      */
     void allocateUserspaceHeap();
 
+    /**
+     * @brief Reserve a specific range in the userspace, its pages are
+     *        allocated and zeroed on first touch
+     *
+     * @param start The start of the range
+     * @param size The size of the range
+     * @return true If the range was free and is now reserved
+     */
     bool allocateRange(virtual_address_t start, uint64_t size);
 
+    /**
+     * @brief Reserve a range anywhere in the userspace, its pages are
+     *        allocated and zeroed on first touch
+     *
+     * @param size The size of the range
+     * @return virtual_address_t The start of the range, NULL if there is no room
+     */
+    virtual_address_t reserveRange(uint64_t size);
+
+    /**
+     * @brief Free a range that was reserved by allocateRange or reserveRange,
+     *        along with the pages that were touched
+     *
+     * @param start The start of the range
+     */
+    void freeRange(virtual_address_t start);
+
+    /**
+     * @brief Back a page of a reserved range after a non-present page fault
+     *
+     * @param address The address the fault has occurred at
+     * @return true If the address is in a reserved range and is now mapped
+     */
+    bool handlePageFault(virtual_address_t address);
+
+    /**
+     * @brief Handle a write to a present read-only page, a copy-on-write page is
+     *        copied, or made writable if no other space shares it anymore
+     *
+     * @param address The address the fault has occurred at
+     * @return true If the address is in a writable range and the page is now writable
+     */
+    bool handleWriteFault(virtual_address_t address);
+
     /**
      * @brief Returns the address to the PML4 of this process space
      * 
@@ -42,7 +89,15 @@ struct k_userspace_allocator
      */
     physical_address_t getSpace();
 
-    void copyTo(k_userspace_allocator *);
+    /**
+     * @brief Copy the userspace of this allocator to another one, for fork.
+     *        The ranges are reserved in the target and the touched pages are
+     *        shared copy-on-write, so the cost follows the page tables rather
+     *        than the memory
+     *
+     * @param target The allocator of the new space
+     */
+    void copyTo(k_userspace_allocator *target);
 
     /**
      * @brief Frees all the allocated memory in this allocator
@@ -57,17 +112,19 @@ struct k_userspace_allocator
     void expandUserspaceHeap();
 
     /**
-     * @brief Allocated a new stack for a thread
+     * @brief Allocated a new stack for a thread, with guard pages under it.
+     *        Userspace stacks are only reserved, and grow downwards on faults
+     *        as they are touched, kernel stacks are backed right away
      *
-     * @param stackSize The size of the stack
+     * @param stackSize The size of the stack, for userspace stacks the limit of its growth
      * @param privilege Should the stack be located on the kernel?
      *
-     * @return virtual_address_t The start of the stack
+     * @return virtual_address_t The start of the stack, above the guard pages
      */
     virtual_address_t allocateStack(uint64_t stackSize, bool kernelStack);
 
     /**
-     * @brief Allocates an interrupt stack on the kernel space
+     * @brief Allocates an interrupt stack on the kernel space, with guard pages under it
      * 
      * @param stackSize The size of the stack
      * @return virtual_address_t The address to the stack start
@@ -75,7 +132,7 @@ struct k_userspace_allocator
     virtual_address_t allocateInterruptStack(uint64_t stackSize);
 
     /**
-     * @brief Frees an allocated stack
+     * @brief Frees an allocated userspace stack, and the pages it has grown into
      *
      * @param stackPtr The pointer to the stack start
      */
@@ -116,4 +173,30 @@ private:
     virtual_address_t pml4Virtual;
     k_virtual_address_range_allocator *memoryAllocator;
     k_address_range_header *kernelspaceRanges;
+
+    // Serializes the page faults of the space, so a page is backed once
+    k_spinlock faultLock;
+
+    /**
+     * @brief Allocate a kernel stack on physical memory, with unmapped guard pages under it
+     *
+     * @param pages How many pages the stack has
+     * @return virtual_address_t The start of the stack, above the guard pages
+     */
+    virtual_address_t _allocateKernelStack(uint64_t pages);
+
+    /**
+     * @brief Record in the page database that a page was mapped to this space
+     *
+     * @param phys The page
+     */
+    void _ownPage(physical_address_t phys);
+
+    /**
+     * @brief Mark a used range as reserved
+     *
+     * @param start The start of the range
+     * @param flags The flags its pages are mapped with
+     */
+    void reserve(virtual_address_t start, k_paging_flags flags);
 };
\ No newline at end of file
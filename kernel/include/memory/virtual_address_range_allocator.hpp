@@ -1,6 +1,9 @@
 #pragma once
 
 #include <memory/paging.hpp>
+#include <memory/slab_allocator.hpp>
+#include <utils/avl_tree.hpp>
+#include <utils/spinlock.hpp>
 
 /**
  * @brief The header of a address range
@@ -16,16 +19,41 @@ struct k_address_range_header
     // Is the address range in use?
     bool used;
 
+    // Is the range only reserved? Its pages are allocated and zeroed on first touch
+    bool lazy;
+
+    // The flags lazy pages are mapped with
+    k_paging_flags flags;
+
+    // The lowest page of a lazy range that was backed, the pages below it were never touched
+    virtual_address_t backedBase;
+
+    // How many pages at the bottom of the range are never backed, they catch stack overflows
+    uint64_t guardPages;
+
     char requestBy[4];
 
-    // The next address range in the list
+    // The next address range in the list, ordered by address
     k_address_range_header *next;
+    // The previous address range in the list
+    k_address_range_header *prev;
+
+    // The node in the allocator's tree of all the ranges, ordered by base
+    k_avl_node addressNode;
+    // The node in the allocator's tree of the free ranges, ordered by size
+    k_avl_node sizeNode;
+
+    SLAB_DECLARE_OPERATORS();
 };
 
 /**
  * @brief   Allocator for virtual address ranges.
  *          It can deliver virtual address ranges on-demand,
  *          with a specific number of pages.
+ *          All the ranges are kept in a tree by base, which finds the range of an
+ *          address, and the free ranges also in a tree by size, which finds the best
+ *          fit for an allocation. The ranges are also linked in address order, so a
+ *          freed range merges with its neighbours right away. Every operation is O(log n).
  */
 struct k_virtual_address_range_allocator
 {
@@ -41,7 +69,8 @@ struct k_virtual_address_range_allocator
     void addRange(virtual_address_t start, virtual_address_t end);
 
     /**
-     * @brief   Allocated a virtual range with how many pages requested
+     * @brief   Allocated a virtual range with how many pages requested,
+     *          from the smallest free range that fits (the lowest one between equals)
      *
      * @param pages How many pages shall the address range contain
      * @return virtual_address_t The start of the address range
@@ -53,8 +82,23 @@ struct k_virtual_address_range_allocator
      */
     void freeRange(virtual_address_t base);
 
+    /**
+     * @brief Mark a specific range as used
+     *
+     * @param start The start of the range, page-aligned
+     * @param size How many pages the range contains
+     * @return true If the whole range was free and is now used
+     */
     bool useRange(virtual_address_t start, uint64_t size);
 
+    /**
+     * @brief Find the used range that contains an address
+     *
+     * @param address The address
+     * @return k_address_range_header* The range, NULL if the address isn't in a used range
+     */
+    k_address_range_header *findRange(virtual_address_t address);
+
     /**
      * @brief Returns all the ranges of this allocator
      * 
@@ -65,10 +109,42 @@ struct k_virtual_address_range_allocator
 private:
     // The head of the address range linked-list
     k_address_range_header *head;
-    k_address_range_header *lastSplit;
+
+    // All the ranges by base
+    k_avl_tree addressTree;
+    // The free ranges by size
+    k_avl_tree sizeTree;
+
+    // The kernel's allocator is shared by all the processors
+    k_spinlock lock;
+
+    /**
+     * @brief Find the range with the highest base that is at most the address
+     *
+     * @return k_address_range_header* The range, NULL if all the ranges are above the address
+     */
+    k_address_range_header *floorRange(virtual_address_t address);
+
+    /**
+     * @brief Create a range and link it after another range
+     *
+     * @param after The range before the new one, NULL to make it the head
+     * @return k_address_range_header* The new range, free
+     */
+    k_address_range_header *insertRange(k_address_range_header *after, virtual_address_t base, uint64_t pages);
+
+    /**
+     * @brief Unlink a range and delete it
+     */
+    void removeRange(k_address_range_header *range);
+
+    /**
+     * @brief Split the pages after the given count off a range, the split off part is free
+     */
+    void splitRange(k_address_range_header *range, uint64_t pages);
 
     /**
-     * @brief Loop over the list and try to merge the address ranges
+     * @brief Merge a free range with its free neighbours, and put it in the size tree
      */
-    void mergeAll();
+    void mergeRange(k_address_range_header *range);
 };
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <system/pci/pci.hpp>
+#include <utils/spinlock.hpp>
 
 #define SATA_SIG_ATA 0x00000101   // SATA drive
 #define SATA_SIG_ATAPI 0xEB140101 // SATAPI drive
@@ -18,6 +19,7 @@
 #define HBA_PORT_DET_PRESENT 3
 
 #define	AHCI_BASE	0x400000	// 4M
+
  
 #define HBA_PxCMD_ST    0x0001
 #define HBA_PxCMD_FRE   0x0010
@@ -470,6 +472,8 @@ struct k_ahci_port
     virtual_address_t virtualFB;
     k_HBA_cmd_table *virtualCTBs[32];
 
+    // Held from finding a command slot until the command completes, any processor may use the port
+    k_spinlock lock;
 
     void startCMD();
     void stopCMD();
@@ -4,6 +4,9 @@
 
 #include <syscalls/syscalls_data.hpp>
 
+// The size of the int 0x80 instruction that makes a system call
+#define SYSCALL_INSTRUCTION_SIZE 2
+
 struct k_thread;
 
 namespace Syscall
@@ -39,4 +42,12 @@ namespace Syscall
      * @param data      The data for the system call
      */
     void runHandler(k_thread *thread, SyscallHandler_t syscall, void *data);
+
+    /**
+     * @brief Make the thread's system call again when it runs next, for a system call
+     *        that has to wait (e.g. for input)
+     *
+     * @param thread The thread that initiated the system call
+     */
+    void restart(k_thread *thread);
 }
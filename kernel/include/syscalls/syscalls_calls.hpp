@@ -41,6 +41,7 @@
 #define SYS_WRITE 35
 #define SYS_READDIR 36
 #define SYS_OPENDIR 37
+#define SYS_HEAP_STATISTICS 38
 
 #define SYS_DEBUG 255
 
@@ -57,6 +58,9 @@ namespace Syscall
         void 
         printSTDOUT(k_thread *thread, SyscallData *data); 
 
+        void
+        heapStatistics(k_thread *thread, SyscallData *data);
+
         void
         removeLastChar(k_thread *thread, SyscallData *data);
 
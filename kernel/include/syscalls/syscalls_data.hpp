@@ -2,6 +2,9 @@
 
 #include <stddef.h>
 
+// vm_map flags, the mapping must be placed at the hint
+#define VM_MAP_FIXED 0x04
+
 namespace Syscall
 {
     typedef long off_t;
@@ -3,6 +3,37 @@
 #include <cpuid.h>
 #include <stdint.h>
 
+// The maximum amount of processors the kernel keeps per-processor data for
+#define PROCESSOR_MAX_CPUS 32
+
+// The MSRs of the GS base, the kernel's is swapped in on entry from userspace
+#define PROCESSOR_MSR_GS_BASE 0xC0000101
+#define PROCESSOR_MSR_KERNEL_GS_BASE 0xC0000102
+
+// The MSR of the Local APIC timer's deadline in TSC-deadline mode
+#define PROCESSOR_MSR_TSC_DEADLINE 0x6E0
+
+/**
+ * @brief   The data of a single processor, the GS base of every processor
+ *          points to its own, so it is reached with a single GS-relative load.
+ *          While a processor runs userspace the kernel's GS base is kept in
+ *          KERNEL_GS_BASE, and the interrupt entry swaps it back in.
+ */
+struct k_processor_local
+{
+    // The address of this structure
+    k_processor_local *self;
+
+    // The index of the processor
+    uint64_t index;
+
+    // The ID of the processor's Local APIC
+    uint32_t apicId;
+
+    // The tasking structure of the processor (k_processor_tasking)
+    void *tasking;
+};
+
 /* Vendor strings from CPUs. */
 #define CPUID_VENDOR_OLDAMD        "AMDisbetter!" // Early engineering samples of AMD K5 processor
 #define CPUID_VENDOR_AMD           "AuthenticAMD"
@@ -101,6 +132,9 @@ enum CPUID_FEATURE{
     CPUID_FEAT_EDX_PBE          = 1 << 31
 };
 
+/* Extended features, CPUID leaf 0x80000001. */
+#define CPUID_FEAT_EXT_EDX_PDPE1GB (1 << 26)
+
 /**
  * @brief Enables the SSE functionality
  * 
@@ -131,8 +165,93 @@ bool processorHasAPIC();
  */
 bool processorHasSSE();
 
+/**
+ * @brief Checks if the processor supports 1GiB pages
+ * 
+ * @return true If PDPT entries can map 1GiB pages
+ * @return false If they can't
+ */
+bool processorHas1GiBPages();
+
+/**
+ * @brief Checks if the processor supports process-context identifiers
+ * 
+ * @return true If CR3 can be tagged with a PCID
+ * @return false If it can't
+ */
+bool processorHasPCID();
+
+/**
+ * @brief Checks if the Local APIC timer supports the TSC-deadline mode
+ *
+ * @return true If the timer can fire at a TSC value
+ * @return false If it can't
+ */
+bool processorHasTSCDeadline();
+
 typedef uint64_t msr_t;
 
 void processorSetMSR(msr_t msr, uint64_t value);
 
-uint64_t processorGetMSR(msr_t msr);
\ No newline at end of file
+uint64_t processorGetMSR(msr_t msr);
+
+/**
+ * @brief Reads the processor's time-stamp counter
+ * 
+ * @return uint64_t The value of the counter
+ */
+uint64_t processorReadTSC();
+
+/**
+ * @brief Point the GS base of this processor at its data, must be done
+ * before anything uses processorGetIndex()
+ * 
+ * @param index The index of the processor
+ */
+void processorInitializeLocal(uint64_t index);
+
+/**
+ * @brief Get the data of the processor the code is running on
+ * 
+ * @return k_processor_local* The processor's data
+ */
+k_processor_local *processorGetLocal();
+
+/**
+ * @brief Get the data of a processor
+ * 
+ * @param index The index of the processor
+ * @return k_processor_local* The processor's data
+ */
+k_processor_local *processorGetLocalOf(uint64_t index);
+
+/**
+ * @brief Get the index of the processor the code is running on, used to
+ * index per-processor data. Always below PROCESSOR_MAX_CPUS.
+ * 
+ * @return uint64_t The index of the current processor
+ */
+uint64_t processorGetIndex();
+
+/**
+ * @brief Get how many processors are running, processors are indexed from 0
+ * 
+ * @return uint64_t The amount of running processors
+ */
+uint64_t processorGetCount();
+
+/**
+ * @brief Register a running processor
+ * 
+ * @param index The index of the processor
+ * @param apicId The ID of the processor's Local APIC
+ */
+void processorRegister(uint64_t index, uint32_t apicId);
+
+/**
+ * @brief Get the Local APIC ID of a processor, used to send it IPIs
+ * 
+ * @param index The index of the processor
+ * @return uint32_t The ID of its Local APIC
+ */
+uint32_t processorGetApicId(uint64_t index);
\ No newline at end of file
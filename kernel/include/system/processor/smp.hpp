@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stivale2/stivale2.h>
+
+// The size of the stack an application processor boots on, it only runs until the first switch
+#define SMP_AP_STACK_SIZE (16 * KiB_unit)
+
+/**
+ * @brief Count the processors the kernel will run on
+ *
+ * @param stivaleInfo The stivale2 struct
+ * @return uint64_t How many processors there are, at most PROCESSOR_MAX_CPUS
+ */
+uint64_t smpCountProcessors(stivale2_struct *stivaleInfo);
+
+/**
+ * @brief   Start the application processors, one at a time. The bootloader has parked
+ *          them, each one is released into smpApEntry with a stack of its own.
+ *          Tasking must be initialized with smpCountProcessors() processors.
+ *
+ * @param stivaleInfo The stivale2 struct
+ */
+void smpInitialize(stivale2_struct *stivaleInfo);
+
+/**
+ * @brief The entry of an application processor, sets up the processor and waits for its first switch
+ *
+ * @param info The processor's stivale2 entry, extra_argument holds the processor's index
+ */
+extern "C" void smpApEntry(stivale2_smp_info *info);
@@ -1,11 +1,27 @@
 #pragma once
 
 #include <tasking/tasking.hpp>
+#include <system/processor/processor.hpp>
+#include <utils/spinlock.hpp>
 #include <stddef.h>
 
 /**
- * @brief An implementation of the MLFQ scheduler
+ * @brief   An implementation of the MLFQ scheduler.
+ *          Every processor has a run queue of its own, with its own MLFQ and lock.
+ *          A processor that has nothing to run steals from the busiest run queue,
+ *          and every processor periodically pulls jobs from the busiest run queue
+ *          to even the load. A job that ran recently is cache-hot on its processor,
+ *          the periodic balancing leaves it there.
  *
+ *          The queues only hold ready jobs, and a bitmap tells which of them aren't empty,
+ *          so the next job is a bit scan and a pop. A blocked job is off the queues, parked
+ *          on its thread, until schedulerWake puts it back.
+ *
+ *          There is no periodic tick, after every switch the processor's timer is armed
+ *          for when the scheduler next has something to do (the running job's time runs
+ *          out, a boost, a balance or a sleeping thread waking up). An idle processor only
+ *          wakes for its sleeping threads, or when another processor kicks it with
+ *          SCHEDULER_WAKE_VECTOR because a job became ready.
  */
 
 #define K_CONST_SCHEDULER_QUEUES 10
@@ -14,8 +30,18 @@
 #define K_CONST_MAXIMUM_TIMESLICE 100
 #define K_CONST_PRIORITY_BOOST 1000
 
+// How often a processor balances its run queue against the busiest one (ms)
+#define K_CONST_SCHEDULER_BALANCE 20
+// A job that ran within this time (ms) is cache-hot on its processor
+#define K_CONST_SCHEDULER_CACHE_HOT 5
+
+// The interrupt that kicks an idle processor to schedule
+#define SCHEDULER_WAKE_VECTOR 0xF1
+
 typedef uint8_t job_priority_t;
 
+struct k_run_queue;
+
 struct k_scheduler_job
 {
     // The thread that this job relates to
@@ -24,11 +50,22 @@ struct k_scheduler_job
     job_priority_t priority;
     // The time of the job in the current priority
     uint64_t timeInPriority;
+    // The clock of the job's run queue when it last ran, for the cache affinity
+    uint64_t lastRan;
+    // The boost of the run queue the job has seen, an older one means it was boosted since
+    uint64_t boostEpoch;
+
+    // The run queue the job belongs to
+    k_run_queue *runQueue;
+    // Whether the job is on a processor, from being picked until the processor leaves its stack
+    bool onProcessor;
 
     // The previous job in the double-linked list
     k_scheduler_job *prev;
     // The next job in the double-linked list
     k_scheduler_job *next;
+
+    SLAB_DECLARE_OPERATORS();
 };
 
 struct k_jobs_queue
@@ -39,10 +76,40 @@ struct k_jobs_queue
     k_scheduler_job *tail;
     // Time limit for a job in the queue
     uint64_t timeAllotment;
-    // Is the queue empty?
-    bool isEmpty;
 };
 
+/**
+ * @brief   The scheduler of a single processor. A run queue is only touched under its lock,
+ *          a processor that takes the locks of two run queues takes the lower one first.
+ */
+struct k_run_queue
+{
+    // The MLFQ, a queue per priority
+    k_jobs_queue queues[K_CONST_SCHEDULER_QUEUES];
+    // A bit per priority whose queue isn't empty
+    uint64_t readyMap;
+    // The job the processor runs
+    k_scheduler_job *runningJob;
+    // How many jobs wait in the queues, the run queue's load
+    volatile uint64_t jobCount;
+
+    // The time the run queue's time was last accounted (ms since boot)
+    uint64_t clock;
+    // The time since the last priority boost (ms)
+    uint64_t priorityBoostTime;
+    // The time since the last balancing (ms)
+    uint64_t balanceTime;
+    // Incremented on every priority boost
+    uint64_t boostEpoch;
+
+    // The threads sleeping on the processor, by the time they wake up
+    k_thread *sleepers;
+    // Whether the processor has nothing to run
+    volatile bool idle;
+
+    k_spinlock lock;
+} __attribute__((aligned(64)));
+
 /**
  * @brief Initialize the scheduler
  */
@@ -57,39 +124,89 @@ void schedulerInit();
 uint64_t schedulerGetTimeAllotment(job_priority_t priority);
 
 /**
- * @brief Adds the default timings to all the jobs
- * 
+ * @brief Account the time since the last call to this processor's jobs, and do the
+ *        boosting, balancing and waking up of sleeping threads that are due
  */
 void schedulerTime();
 
 /**
- * @brief Decide the next thread to run
+ * @brief Get when this processor needs the scheduler again
+ *
+ * @return uint64_t In how many milliseconds, 0 if nothing is due
+ */
+uint64_t schedulerNextDeadline();
+
+/**
+ * @brief Block the running thread for a while, must be called from an interrupt it serves
+ *        (e.g. a system call), the thread is switched out when the interrupt returns
+ *
+ * @param thread The running thread
+ * @param ms For how many milliseconds
+ */
+void schedulerSleep(k_thread *thread, uint64_t ms);
+
+/**
+ * @brief Decide the next thread for this processor to run
  *
- * @return k_thread The selected thread to run
+ * @return k_thread The selected thread to run, NULL if no thread is ready
  */
 k_thread *schedulerSchedule();
 
 /**
- * @brief Boost all the jobs to priority 0
+ * @brief Boost all the jobs of a run queue to priority 0, the run queue's lock must be held.
+ *        The queues are spliced onto priority 0, the jobs catch up with the boost when
+ *        they are next taken.
+ *
+ * @param runQueue The run queue
  */
-void schedulerPriorityBoost();
+void schedulerPriorityBoost(k_run_queue *runQueue);
 
 /**
- * @brief Add the job to the end of the queue with the priority
+ * @brief Add the job to the end of the queue with the priority, the run queue's lock must be held
  *
+ * @param runQueue The run queue
  * @param job The job to add
  * @param priority  The queue's priority
  */
-void schedulerAddJob(k_scheduler_job *job, job_priority_t priority);
+void schedulerAddJob(k_run_queue *runQueue, k_scheduler_job *job, job_priority_t priority);
 
 /**
- * @brief Removes the job from it's current priority
+ * @brief Removes the job from a queue, the run queue's lock must be held
  *
+ * @param runQueue The run queue
  * @param job The job to remove
+ * @param priority The queue the job is in
+ */
+void schedulerRemoveJob(k_run_queue *runQueue, k_scheduler_job *job, job_priority_t priority);
+
+/**
+ * @brief Hand a thread the processor has switched from back to the scheduler. A ready thread
+ *        goes back to its queue, a waiting one is parked and a dead one's job is dropped.
+ *
+ * @param thread The thread
+ */
+void schedulerRelease(k_thread *thread);
+
+/**
+ * @brief Make a waiting thread ready, and put its job back on the run queue it last ran on
+ *
+ * @param thread The thread
+ */
+void schedulerWake(k_thread *thread);
+
+/**
+ * @brief Steal a ready job from the busiest run queue, for a processor that has nothing to run
+ *
+ * @return true If a job was moved to this processor's run queue
+ */
+bool schedulerSteal();
+
+/**
+ * @brief Pull cold jobs from the busiest run queue if it has more jobs than this processor's
  */
-void schedulerRemoveJob(k_scheduler_job *job);
+void schedulerBalance();
 
 /**
- * @brief Adds a new job to the scheduler
+ * @brief Adds a new job to the scheduler, on the least loaded run queue
  */
 void schedulerNewJob(k_thread *thread);
\ No newline at end of file
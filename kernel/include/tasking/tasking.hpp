@@ -5,6 +5,9 @@
 #include <memory/userspace_allocator.hpp>
 #include <fatfs/ff.h>
 #include <utils/list.hpp>
+#include <memory/slab_allocator.hpp>
+#include <memory/arena.hpp>
+#include <tasking/wait_queue.hpp>
 
 #include <syscalls/syscalls.hpp>
 #include <syscalls/syscalls_data.hpp>
@@ -13,6 +16,7 @@
 
 struct k_process;
 struct k_thread;
+struct k_scheduler_job;
 
 typedef uint64_t register_t;
 
@@ -163,6 +167,19 @@ struct k_thread
         Syscall::SyscallData *data;
         k_thread *targetThread;
     } syscall;
+
+    // Transient buffers of the thread's system calls, reset when a system call returns
+    k_arena arena;
+
+    // The thread's scheduler job, NULL for threads that aren't scheduled
+    k_scheduler_job *job;
+
+    // The next thread in the wait queue the thread waits on, or in the sleeping threads
+    k_thread *waitNext;
+    // When a sleeping thread wakes up (ms since boot)
+    uint64_t wakeTime;
+
+    SLAB_DECLARE_OPERATORS();
 };
 
 /**
@@ -172,6 +189,8 @@ struct k_thread_entry
 {
     k_thread *thread;
     k_thread_entry *next;
+
+    SLAB_DECLARE_OPERATORS();
 };
 
 struct k_process
@@ -201,6 +220,8 @@ struct k_process
 
     FIL stdin;
     long stdinWritePtr;
+    // The threads waiting for input on stdin
+    k_wait_queue stdinWaiters;
 
     FIL stdout;
     long stdoutReadPtr;
@@ -209,6 +230,10 @@ struct k_process
 
     List<FIL *> *fileDescriptors;
     List<DIR *> *openDirectories;
+
+    // The pools of the process' open files and directories
+    k_slab_pool filePool;
+    k_slab_pool directoryPool;
 };
 
 /**
@@ -218,6 +243,8 @@ struct k_process_entry
 {
     k_process *process;
     k_process_entry *next;
+
+    SLAB_DECLARE_OPERATORS();
 };
 
 /**
@@ -237,22 +264,15 @@ struct k_processor_tasking
     k_thread *currentThread;
 
     /**
-     * @brief A list of all the processor's processes
+     * @brief The thread the processor runs when no other thread is ready, it isn't scheduled
      */
-    k_process_entry *processes;
+    k_thread *idleThread;
 
     /**
-     * @brief Returns the next PID for process
-     *
-     * @return uint64_t The PID
+     * @brief The thread the processor has just switched from, it is released once
+     *        the processor is off its stack
      */
-    uint64_t getNextID();
-
-private:
-    /**
-     * @brief The next process' id
-     */
-    uint64_t nextPID;
+    k_thread *switchedFrom;
 };
 
 void taskingDumpProcesses();
@@ -264,6 +284,11 @@ void taskingDumpProcesses();
  */
 void taskingInitialize(uint8_t numOfCPUs);
 
+/**
+ * @brief The loop of the idle threads, zeroes pages while there is nothing else to do
+ */
+void _idleThread();
+
 /**
  * @brief Use the scheduler to decide the next process to run and does a context switch
  *
@@ -282,9 +307,17 @@ void taskingSetFocusedProcess(k_process *);
 k_thread *taskingGetRunningThread();
 
 /**
- * @brief Add a CPU to the list
+ * @brief Returns the process that owns an address space
  *
- * @param id The id of the CPU
+ * @param space The physical address of the space's PML4
+ * @return k_process* The process, NULL if no process owns the space
+ */
+k_process *taskingGetProcessBySpace(physical_address_t space);
+
+/**
+ * @brief Add a CPU to the list, and create its idle thread
+ *
+ * @param id The id of the CPU, below the amount given to taskingInitialize
  */
 void taskingAddCPU(uint8_t id);
 
@@ -295,6 +328,23 @@ void taskingAddCPU(uint8_t id);
  */
 k_process *taskingCreateProcess();
 
+/**
+ * @brief Creates a process with a copy-on-write copy of the parent's memory
+ *
+ * @param parent The process to duplicate
+ * @return k_process* The new process, NULL if it couldn't be created
+ */
+k_process *taskingDuplicateProcess(k_process *parent);
+
+/**
+ * @brief Creates a thread in a duplicated process, it resumes from the same state as the thread
+ *
+ * @param thread The thread to duplicate
+ * @param process The duplicated process
+ * @return k_thread* The created thread
+ */
+k_thread *taskingDuplicateThread(k_thread *thread, k_process *process);
+
 /**
  * @brief Creates a thread
  *
@@ -305,6 +355,12 @@ k_process *taskingCreateProcess();
  */
 k_thread *taskingCreateThread(virtual_address_t entryPoint, k_process *process, THREAD_PRIVILEGE privilege = USER);
 
+/**
+ * @brief Release the thread the processor has switched from, so other processors can run it.
+ *        Called by the interrupt wrapper after it moved to the new thread's stack.
+ */
+extern "C" void taskingFinishSwitch();
+
 /**
  * @brief Returns the current processor
  *
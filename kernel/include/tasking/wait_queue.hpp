@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <utils/spinlock.hpp>
+
+struct k_thread;
+
+/**
+ * @brief   A queue of threads waiting for an event (e.g. a key press).
+ *          A waiting thread is off the run queues until it is woken, so it costs
+ *          nothing while it waits. The threads are linked through k_thread::waitNext,
+ *          so waiting doesn't allocate.
+ *
+ *          Threads only switch when an interrupt returns, so a thread waits from an
+ *          interrupt it serves (e.g. a system call), and is switched out when it returns.
+ *
+ *          A wait queue is an aggregate, zeroed memory is an empty queue.
+ */
+struct k_wait_queue
+{
+    // The first thread to wake
+    k_thread *head;
+    // The last thread to wake
+    k_thread *tail;
+
+    // Protects the queue, a waiter checks its condition under it so no wake up is lost
+    k_spinlock lock;
+
+    /**
+     * @brief Initialize an empty queue
+     */
+    void init();
+
+    /**
+     * @brief Block the running thread until the queue is woken
+     */
+    void wait();
+
+    /**
+     * @brief Block the running thread until the queue is woken, the queue's lock must be held
+     *        and the interrupts disabled, the lock is released once the thread is queued
+     */
+    void waitLocked();
+
+    /**
+     * @brief Wake the thread that waits the longest
+     *
+     * @return true If a thread was woken
+     */
+    bool wakeOne();
+
+    /**
+     * @brief Wake all the waiting threads
+     *
+     * @return uint64_t How many threads were woken
+     */
+    uint64_t wakeAll();
+};
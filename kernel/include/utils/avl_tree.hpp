@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief A node of an AVL tree, embedded in the structure it orders
+ */
+struct k_avl_node
+{
+    k_avl_node *left;
+    k_avl_node *right;
+    k_avl_node *parent;
+
+    // The height of the subtree of the node, a leaf is 1
+    int64_t height;
+};
+
+/**
+ * @brief Compares the keys of two nodes
+ *
+ * @return int Negative if a comes before b, positive if it comes after it, 0 if they are equal
+ */
+typedef int (*k_avl_compare)(const k_avl_node *a, const k_avl_node *b);
+
+/**
+ * @brief   An intrusive AVL tree.
+ *          The nodes are embedded in the structures they order, so the tree never
+ *          allocates, and a structure can be in a few trees at once. Insert and remove
+ *          are O(log n), searches walk the nodes directly from the root.
+ *
+ *          A tree is an aggregate, zeroed memory is an empty tree.
+ */
+struct k_avl_tree
+{
+    k_avl_node *root;
+
+    /**
+     * @brief Insert a node, equal nodes are placed after the existing ones
+     *
+     * @param node    The node, it must not be in a tree
+     * @param compare Orders the nodes, must be the same for every operation on the tree
+     */
+    void insert(k_avl_node *node, k_avl_compare compare);
+
+    /**
+     * @brief Remove a node
+     *
+     * @param node The node, it must be in this tree
+     */
+    void remove(k_avl_node *node);
+
+private:
+    /**
+     * @brief Put a node in the place of another, under the other node's parent
+     */
+    void _replaceChild(k_avl_node *parent, k_avl_node *oldChild, k_avl_node *newChild);
+
+    k_avl_node *_rotateLeft(k_avl_node *node);
+    k_avl_node *_rotateRight(k_avl_node *node);
+
+    /**
+     * @brief Update the heights from a node up to the root, and rotate the unbalanced nodes
+     */
+    void _rebalance(k_avl_node *node);
+};
+
+/**
+ * @brief Get the structure a node is embedded in
+ *
+ * @param node   The node
+ * @param type   The type of the structure
+ * @param member The name of the node in the structure
+ */
+#define AVL_ENTRY(node, type, member) ((type *)((uint64_t)(node) - offsetof(type, member)))
@@ -4,6 +4,9 @@
 #include <sys/queue.h>
 #include <stdbool.h>
 
+// The alignment of the buckets and the entries
+#define HASHMAP_ALIGNMENT 64
+
 struct MapEntry;
 struct HashMap;
 
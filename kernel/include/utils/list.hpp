@@ -17,7 +17,7 @@ struct List
         resize(initSize);
     }
 
-    ~List() { delete[] buffer; }
+    ~List() { heapFree(buffer); }
 
     void add(T t)
     {
@@ -31,24 +31,18 @@ struct List
 
     T get(int index) { return buffer[index]; }
 
+    void set(int index, T t) { buffer[index] = t; }
+
 private:
     T *buffer;
     int cnt;
     int totalSize;
 
+    // The buffer is grown in place when the heap has room after it, so T must be
+    // trivially copyable
     void resize(int newSize)
     {
-        T *temp = new T[newSize];
-
-        if (buffer)
-        {
-            for (int i = 0; i < cnt; i++)
-                temp[i] = buffer[i];
-
-            delete[] buffer;
-        }
-
-        buffer = temp;
+        buffer = (T *)heapReallocate(buffer, newSize * sizeof(T));
         totalSize = newSize;
     }
 };
\ No newline at end of file
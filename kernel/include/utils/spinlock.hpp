@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief   A simple test-and-set spinlock.
+ *          It doesn't touch the interrupts, a lock that may be taken from an
+ *          interrupt handler must be taken with the interrupts disabled.
+ */
+struct k_spinlock
+{
+    volatile uint64_t locked;
+
+    /**
+     * @brief Spin until the lock is acquired
+     */
+    void lock();
+
+    /**
+     * @brief Release the lock
+     */
+    void unlock();
+};
@@ -4,6 +4,9 @@
 #include <strings.hpp>
 #include <memory/memory.hpp>
 #include <memory/heap.hpp>
+#include <memory/arena.hpp>
+#include <filesystem.hpp>
+#include <interrupts/interrupts.hpp>
 
 bool elfCheckFile(Elf64_Ehdr *header)
 {
@@ -82,25 +85,40 @@ ELF_LOAD_STATUS elfLoad(char *fileName, const char * name, k_process **proc)
     FIL elfFile;
     FRESULT res;
 
+    uint64_t rflags = interruptsSave();
+    filesystemLock();
+
     if ((res = f_open(&elfFile, fileName, FA_READ)) != FR_OK)
     {
+        filesystemUnlock();
+        interruptsRestore(rflags);
         return FAILED_TO_OPEN;
     }
 
+    // The file and the headers are only needed while loading
+    k_arena loadArena;
+    loadArena.current = NULL;
+    loadArena.offset = 0;
+
     unsigned int readBytes;
     uint64_t fileSize = f_size(&elfFile);
-    char fileBuffer[fileSize];
+    char *fileBuffer = (char *)loadArena.allocate(fileSize);
     res = f_read(&elfFile, (void *)fileBuffer, fileSize, &readBytes);
 
+    // The whole file is in the buffer, creating the process takes the filesystem's lock again
+    f_close(&elfFile);
+    filesystemUnlock();
+    interruptsRestore(rflags);
+
     // Validate the file
     if (res != FR_OK)
     {
-        f_close(&elfFile);
+        loadArena.release();
         return FAILED_TO_READ;
     }
     if (readBytes != fileSize)
     {
-        f_close(&elfFile);
+        loadArena.release();
         return FAILED_TO_READ;
     }
 
@@ -109,12 +127,12 @@ ELF_LOAD_STATUS elfLoad(char *fileName, const char * name, k_process **proc)
 
     if (!elfCheckFile(&elfHeader))
     {
-        f_close(&elfFile);
+        loadArena.release();
         return INVALID_HEADER;
     }
     if (!elfCheckSupported(&elfHeader))
     {
-        f_close(&elfFile);
+        loadArena.release();
         return UNSUPPORTED_ELF;
     }
 
@@ -124,8 +142,8 @@ ELF_LOAD_STATUS elfLoad(char *fileName, const char * name, k_process **proc)
     uint64_t phdrOff = elfHeader.e_phoff;
 
     // Read all the program headers
-    Elf64_Phdr phdrs[phdrCout];
-    memcpy(phdrs, &fileBuffer[phdrOff], sizeof(phdrs));
+    Elf64_Phdr *phdrs = (Elf64_Phdr *)loadArena.allocate(phdrCout * sizeof(Elf64_Phdr));
+    memcpy(phdrs, &fileBuffer[phdrOff], phdrCout * sizeof(Elf64_Phdr));
     // if ((res = f_read(&elfFile, phdrs, phdrCout * phdrSize, &readBytes)) != SUCCESS)
     // {
     //     f_close(&elfFile);
@@ -141,7 +159,6 @@ ELF_LOAD_STATUS elfLoad(char *fileName, const char * name, k_process **proc)
     // Switch to the process' space to map everything
     physical_address_t prevSpace = pagingGetCurrentSpace();
     pagingSwitchSpace(process->addressSpace);
-    elfFile.fptr = 0;
     for (int phdrI = 0; phdrI < phdrCout; phdrI++)
     {
         // Load the segments
@@ -171,7 +188,7 @@ ELF_LOAD_STATUS elfLoad(char *fileName, const char * name, k_process **proc)
     }
     pagingSwitchSpace(prevSpace);
 
-    f_close(&elfFile);
+    loadArena.release();
 
     // Create the process' main thread
     k_thread *thread = taskingCreateThread(elfHeader.e_entry, process, USER);
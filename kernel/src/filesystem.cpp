@@ -9,9 +9,15 @@
 #include <strings.hpp>
 #include <logger/printf.hpp>
 #include <storage/ahci/ahci.hpp>
+#include <memory/heap.hpp>
+#include <memory/tlb.hpp>
+#include <interrupts/interrupts.hpp>
+#include <utils/spinlock.hpp>
 
 static FATFS fs;
 
+static k_spinlock fsLock;
+
 FRESULT scan_files(
     char *path /* Start node to be scanned (***also used as work area***) */
 )
@@ -66,6 +72,9 @@ void filesystemInitialize()
     uint64_t bw;
     uint8_t work[FF_MAX_SS];
 
+    uint64_t rflags = interruptsSave();
+    filesystemLock();
+
     res = f_mount(&fs, "", 1);
     if (res == FR_NO_FILESYSTEM)
     {
@@ -86,6 +95,68 @@ void filesystemInitialize()
     f_mkdir("root/apps");
     f_mkdir("root/docs");
     f_mkdir("root/dev");
+    f_mkdir("root/proc");
+
+    filesystemUnlock();
+    interruptsRestore(rflags);
     
     // scan_files("/root");
-}
\ No newline at end of file
+}
+
+void filesystemLock()
+{
+    // The holder may wait on a TLB shootdown, which this processor can't take with
+    // the interrupts disabled, so serve it while spinning
+    while (__sync_lock_test_and_set(&fsLock.locked, 1))
+    {
+        while (fsLock.locked)
+        {
+            tlbHandleShootdown(0);
+            asm volatile("pause");
+        }
+    }
+}
+
+bool filesystemTryLock()
+{
+    return !__sync_lock_test_and_set(&fsLock.locked, 1);
+}
+
+void filesystemUnlock()
+{
+    fsLock.unlock();
+}
+
+/**
+ * @brief Write a line of a report to a file
+ */
+static void filesystemWriteLine(void *context, const char *line)
+{
+    UINT bw;
+    f_write((FIL *)context, line, strlen(line), &bw);
+    f_write((FIL *)context, "\n", 1, &bw);
+}
+
+void filesystemRefreshProcFile(const char *path)
+{
+    if (strcmp(path, FILESYSTEM_PROC_HEAP) != 0)
+        return;
+
+    uint64_t rflags = interruptsSave();
+    filesystemLock();
+
+    FIL file;
+    if (f_open(&file, FILESYSTEM_PROC_HEAP, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+    {
+        filesystemUnlock();
+        interruptsRestore(rflags);
+        logWarnn("%! Couldn't write %s.", "[Filesystem]", FILESYSTEM_PROC_HEAP);
+        return;
+    }
+
+    heapReport(filesystemWriteLine, &file);
+    f_close(&file);
+
+    filesystemUnlock();
+    interruptsRestore(rflags);
+}
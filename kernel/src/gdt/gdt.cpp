@@ -3,13 +3,16 @@
 #include <logger/logger.hpp>
 #include <memory/memory.hpp>
 #include <kernel.hpp>
+#include <system/processor/processor.hpp>
 
-k_gdt_descriptor gdtDescriptor;
-k_gdt gdt;
-TSS tss;
+// Every processor has its own GDT, as the TSS descriptor is marked busy when it is loaded
+k_gdt_descriptor gdtDescriptors[PROCESSOR_MAX_CPUS];
+k_gdt gdts[PROCESSOR_MAX_CPUS];
+TSS tsses[PROCESSOR_MAX_CPUS];
 
-void gdtCreateEntry(uint8_t idx, uint32_t base, uint32_t limit, uint8_t accessByte, uint8_t flags)
+void gdtCreateEntry(uint64_t processor, uint8_t idx, uint32_t base, uint32_t limit, uint8_t accessByte, uint8_t flags)
 {
+    k_gdt &gdt = gdts[processor];
     gdt.entries[idx].limitLow = (uint16_t)(limit & 0xFFFF);     // first 16 bits of limit
     gdt.entries[idx].baseLow = (uint16_t)(base & 0xFFFF);       // first 16 bits of base
     gdt.entries[idx].baseMid = (uint16_t)((base >> 16) & 0xFF); // next 16 bits of base
@@ -18,9 +21,10 @@ void gdtCreateEntry(uint8_t idx, uint32_t base, uint32_t limit, uint8_t accessBy
     gdt.entries[idx].baseHigh = (uint8_t)((base >> 24) & 0xFF);                        // last 8 bits of base
 }
 
-void gdtCreateTSSEntry()
+void gdtCreateTSSEntry(uint64_t processor)
 {
-    uint64_t base = ((uint64_t)&tss);
+    k_gdt &gdt = gdts[processor];
+    uint64_t base = ((uint64_t)&tsses[processor]);
 
     gdt.tss.limitLow        = (uint16_t) (sizeof(TSS)) - 1;
     gdt.tss.baseLow         = (uint16_t) (base & 0xFFFF);
@@ -32,26 +36,29 @@ void gdtCreateTSSEntry()
     gdt.tss.reserved        = 0;
 }
 
-void gdtInitialize()
+void gdtInitialize(uint64_t processor)
 {
+    k_gdt &gdt = gdts[processor];
+    k_gdt_descriptor &gdtDescriptor = gdtDescriptors[processor];
+
     // Create the table entries
-    gdtCreateEntry(0, (uint32_t)0x0, 0x00000, 0x00, 0x0); // null
-    gdtCreateEntry(1, (uint32_t)0x0, 0xFFFFF, 0x9A, 0xA); // kernel code
-    gdtCreateEntry(2, (uint32_t)0x0, 0xFFFFF, 0x92, 0xC); // kernel data
-    gdtCreateEntry(3, (uint32_t)0x0, 0xFFFFF, 0xFA, 0xA); // user code
-    gdtCreateEntry(4, (uint32_t)0x0, 0xFFFFF, 0xF2, 0xC); // user data
+    gdtCreateEntry(processor, 0, (uint32_t)0x0, 0x00000, 0x00, 0x0); // null
+    gdtCreateEntry(processor, 1, (uint32_t)0x0, 0xFFFFF, 0x9A, 0xA); // kernel code
+    gdtCreateEntry(processor, 2, (uint32_t)0x0, 0xFFFFF, 0x92, 0xC); // kernel data
+    gdtCreateEntry(processor, 3, (uint32_t)0x0, 0xFFFFF, 0xFA, 0xA); // user code
+    gdtCreateEntry(processor, 4, (uint32_t)0x0, 0xFFFFF, 0xF2, 0xC); // user data
 
-    gdtCreateEntry(5, (uint32_t)0x0, 0xFFFFF, 0xF2, 0xC); // TLS
+    gdtCreateEntry(processor, 5, (uint32_t)0x0, 0xFFFFF, 0xF2, 0xC); // TLS
 
     // TSS
-    gdt.tss.set((uint64_t)&tss, sizeof(TSS) - 1, 0x0, DPL_KERNEL_ACCESS);
+    gdt.tss.set((uint64_t)&tsses[processor], sizeof(TSS) - 1, 0x0, DPL_KERNEL_ACCESS);
         
     // Set the descriptor
     gdtDescriptor.size = sizeof(gdt) - 1;
     gdtDescriptor.offset = (uint64_t)&gdt;
 
     // Inform everything and load with assembly
-    logDebugn("%! GDT has been created at 0x%64x.", "[GDT]", (uint64_t)&gdt);
+    logDebugn("%! GDT of processor %d has been created at 0x%64x.", "[GDT]", processor, (uint64_t)&gdt);
     logDebugn("\t- Size %d \n\t- Offset 0x%64x \n\t- Created at 0x%64x", gdtDescriptor.size, gdtDescriptor.offset, &gdtDescriptor);
 
     _loadGDT(&gdtDescriptor);
@@ -62,10 +69,11 @@ void gdtInitialize()
 
 
 void gdtSetActiveStack(virtual_address_t stackPtr) {
+    TSS &tss = tsses[processorGetIndex()];
     tss.rsp0Low = stackPtr & 0xFFFFFFFF;
     tss.rsp0High = (stackPtr >> 32) & 0xFFFFFFFF;
 }
 
 void gdtSetTLSBase(virtual_address_t base) {
-    gdtCreateEntry(5, (uint32_t)0x0, 0xFFFFF, 0xF2, 0xC); // TLS
+    gdtCreateEntry(processorGetIndex(), 5, (uint32_t)0x0, 0xFFFFF, 0xF2, 0xC); // TLS
 }
\ No newline at end of file
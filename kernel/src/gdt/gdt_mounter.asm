@@ -11,8 +11,8 @@ _loadGDT:
     mov ax, 0x10
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
+    ; fs and gs are left alone, loading them would reset their bases,
+    ; and gs holds the processor's data
     mov ss, ax
 
     pop rdi
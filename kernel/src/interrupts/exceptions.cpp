@@ -2,6 +2,9 @@
 
 #include <kernel.hpp>
 #include <logger/logger.hpp>
+#include <memory/paging.hpp>
+#include <memory/userspace_allocator.hpp>
+#include <tasking/tasking.hpp>
 
 void (*exceptionHandlers[32])(uint64_t);
 
@@ -57,6 +60,19 @@ void exceptionPageFault(uint64_t code)
     // The address the page fault has occurred at is in CR2
     asm volatile ("mov %[aRelevantAddress], cr2" : [aRelevantAddress]"=r"(relevantAddress));
 
+    // A non-present page of a reserved range is backed on first touch.
+    // The fault may come from the kernel writing into a space it switched to,
+    // so the range is looked up in the current space rather than the running thread's.
+    // A write to a present read-only page may be a copy-on-write page.
+    if (!P || WR)
+    {
+        k_process *process = taskingGetProcessBySpace(pagingGetCurrentSpace());
+        if (process && !P && process->processAllocator->handlePageFault(relevantAddress))
+            return;
+        if (process && P && process->processAllocator->handleWriteFault(relevantAddress))
+            return;
+    }
+
     // TraceStackTrace(5);
 
     kernelPanic("%! A page fault has occurred with code %d on address 0x%64x!\
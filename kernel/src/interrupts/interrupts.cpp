@@ -13,6 +13,8 @@
 #include <stddef.h>
 #include <system/processor/processor.hpp>
 #include <ps2/ps2.hpp>
+#include <memory/tlb.hpp>
+#include <tasking/scheduler.hpp>
 
 void interruptsInitialize()
 {
@@ -38,6 +40,22 @@ void interruptsDisable()
     asm("cli");
 }
 
+uint64_t interruptsSave()
+{
+    uint64_t rflags;
+    asm volatile("pushfq\n\tpop %0\n\tcli"
+                 : "=r"(rflags)
+                 :
+                 : "memory");
+    return rflags;
+}
+
+void interruptsRestore(uint64_t rflags)
+{
+    if (rflags & RFLAGS_IF)
+        interruptsEnable();
+}
+
 void interruptsInstallRoutines()
 {
     idtCreateEntry(0x08, (uint64_t)_iExc8, exceptionDoubleFault, 0x08, 0x00, K_IDT_TA_INTERRUPT);
@@ -46,12 +64,22 @@ void interruptsInstallRoutines()
     idtCreateEntry(0x20, (uint64_t)_iReq32, requestTimer, 0x08, 0x00, K_IDT_TA_INTERRUPT);
     idtCreateEntry(0x21, (uint64_t)_iReq33, PS2::keyboardHandler, 0x08, 0x00, K_IDT_TA_INTERRUPT);
     idtCreateEntry(0x80, (uint64_t)_iReq128, requestTimer, 0x08, 0x00, K_IDT_TA_INTERRUPT_USER);
+    idtCreateEntry(TLB_SHOOTDOWN_VECTOR, (uint64_t)_iReq240, tlbHandleShootdown, 0x08, 0x00, K_IDT_TA_INTERRUPT);
+    idtCreateEntry(SCHEDULER_WAKE_VECTOR, (uint64_t)_iReq241, requestTimer, 0x08, 0x00, K_IDT_TA_INTERRUPT);
 }
 
 k_thread_state *interruptHandler(k_thread_state *rsp)
 {
     k_thread *thread = taskingGetRunningThread();
 
+    // A fault taken while the kernel serves a user thread (e.g. a system call touching a
+    // copy-on-write page) nests in the thread's interrupt, the outer context must be kept
+    if (thread && thread->privilege == USER && rsp->interruptCode < 0x20 && !(rsp->cs & 3))
+    {
+        exceptionHandlers[rsp->interruptCode](rsp->errorCode);
+        return rsp;
+    }
+
     if (thread)
     {
         // If there was a thread running before, store its context
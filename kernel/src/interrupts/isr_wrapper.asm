@@ -1,7 +1,14 @@
 extern interruptHandler
+extern taskingFinishSwitch
 
 global isr_wrapper
 isr_wrapper:
+    ; Coming from userspace, swap in the kernel's gs base (the processor's data)
+    test qword [rsp + 24], 3
+    jz .fromKernel
+    swapgs
+.fromKernel:
+
     ; Save context
     push rbp
     push r15
@@ -34,7 +41,6 @@ isr_wrapper:
     mov ds, eax
     mov es, eax
     mov fs, eax
-    mov gs, eax
     mov ss, eax
 
     ; Return rsp
@@ -42,14 +48,16 @@ isr_wrapper:
     call interruptHandler
     mov rsp, rax
 
+    ; Off the previous thread's stack, it may run on another processor now
+    call taskingFinishSwitch
+
     pop rax
     mov ds, ax
     mov es, ax
     ;mov fs, ax
-    mov gs, ax
 
-    ; Retrieve Segments
-    pop gs
+    ; Retrieve Segments, gs is skipped as loading it resets its base
+    add rsp, 8
     pop fs
 
     pop rax
@@ -77,6 +85,12 @@ isr_wrapper:
     pop rbp
 
     add rsp, 16 ; Skiping error code and interrupt number (each 8bytes)
+
+    ; Going back to userspace, swap the processor's gs base out
+    test qword [rsp + 8], 3
+    jz .toKernel
+    swapgs
+.toKernel:
     sti ; enable interrupts again
     iretq
 
@@ -14,6 +14,13 @@
 virtual_address_t lapicGlobalAddress = NULL;
 bool isPrepared = false;
 
+// How many times the timer ticks in 10ms, the timers of all the processors tick at the same rate
+static uint32_t lapicTicksIn10ms = 0;
+// How many times the TSC ticks in 1ms
+static uint64_t lapicTscPerMs = 0;
+// Whether the timers fire at a TSC value rather than count down
+static bool lapicTscDeadline = false;
+
 void lapicPrepare(physical_address_t lapicAddress)
 {
     if (lapicAddress != K_LAPIC_EXPECTED_ADDRESS)
@@ -52,6 +59,7 @@ void lapicInitialize()
     lapicWrite(APIC_REGISTER_TASK_PRIO, 0);
 
     lapicWrite(APIC_REGISTER_SPURIOUS_IVT, 0xFF | APIC_SPURIOUS_IVT_SOFTWARE_ENABLE);
+    processorRegister(processorGetIndex(), lapicGetId());
     logDebugn("%! Local APIC has been initialized and enabled.", "[LAPIC]");
 }
 
@@ -68,8 +76,11 @@ uint32_t lapicRead(uint32_t reg)
     return *((volatile uint32_t *)(lapicGlobalAddress + reg));
 }
 
-void lapicStartTimer()
+void lapicCalibrateTimer()
 {
+    if (lapicTicksIn10ms)
+        return;
+
     // Tell APIC timer to use divider 16
     lapicWrite(APIC_REGISTER_TIMER_DIV, 0x3);
 
@@ -78,10 +89,13 @@ void lapicStartTimer()
 
     // Set APIC init counter to -1
     lapicWrite(APIC_REGISTER_TIMER_INITCNT, 0xFFFFFFFF);
+    uint64_t tscStart = processorReadTSC();
 
     // Perform PIT-supported sleep
     pitPerformSleep();
 
+    uint64_t tscEnd = processorReadTSC();
+
     // Stop the APIC timer
     lapicWrite(APIC_REGISTER_LVT_TIMER, APIC_LVT_INT_MASKED);
 
@@ -94,19 +108,72 @@ void lapicStartTimer()
     }
 
     logDebugn("%! Detected %d ticks in 10ms of APIC Timer", "[LAPIC]", ticksIn10ms);
+    lapicTscPerMs = (tscEnd - tscStart) / 10;
+    lapicTscDeadline = processorHasTSCDeadline();
+    lapicTicksIn10ms = ticksIn10ms;
+}
+
+void lapicStartTimer()
+{
+    lapicCalibrateTimer();
+    uint32_t ticksIn10ms = lapicTicksIn10ms;
 
     interruptsDisable();
 
-    // Start timer as periodic on IRQ 0, divider 16, with the number of ticks we counted
-    lapicWrite(APIC_REGISTER_LVT_TIMER, 32 | APIC_LVT_TIMER_MODE_PERIODIC);
+    // Start timer as one-shot on IRQ 0, divider 16, every interrupt arms the next deadline
+    lapicWrite(APIC_REGISTER_LVT_TIMER, 32 | (lapicTscDeadline ? APIC_LVT_TIMER_MODE_TSC_DEADLINE
+                                                                : APIC_LVT_TIMER_MODE_ONESHOT));
     lapicWrite(APIC_REGISTER_TIMER_DIV, 0x3);
-    lapicWrite(APIC_REGISTER_TIMER_INITCNT, ticksIn10ms / 10 * APIC_TIMER_TIMESLOT_MS);
 
-    logDebugn("%! APIC Timer has started with freqency %dkhz (tick every %dms)", "[LAPIC]", 1000 / APIC_TIMER_TIMESLOT_MS, APIC_TIMER_TIMESLOT_MS);
+    // The mode must be set before the deadline MSR is written
+    asm volatile("mfence" ::: "memory");
+    lapicArmTimer(APIC_TIMER_TIMESLOT_MS);
+
+    logDebugn("%! APIC Timer has started in %s mode (%d ticks in 10ms)", "[LAPIC]",
+              lapicTscDeadline ? "TSC-deadline" : "one-shot", ticksIn10ms);
     interruptsEnable();
 }
 
+void lapicArmTimer(uint64_t ms)
+{
+    if (lapicTscDeadline)
+    {
+        processorSetMSR(PROCESSOR_MSR_TSC_DEADLINE, ms ? processorReadTSC() + ms * lapicTscPerMs : 0);
+        return;
+    }
+
+    // The count is 32 bits, a longer deadline comes early and is armed again
+    uint64_t ticks = ms * lapicTicksIn10ms / 10;
+    if (ticks > 0xFFFFFFFF)
+        ticks = 0xFFFFFFFF;
+    lapicWrite(APIC_REGISTER_TIMER_INITCNT, (uint32_t)ticks);
+}
+
+uint64_t lapicGetTime()
+{
+    if (!lapicTscPerMs)
+        return 0;
+
+    return processorReadTSC() / lapicTscPerMs;
+}
+
 void lapicSendEOI()
 {
     lapicWrite(APIC_REGISTER_EOI, 0);
+}
+
+void lapicSendIPI(uint32_t apicId, uint8_t vector)
+{
+    // Wait for the previous IPI to be delivered
+    while (lapicRead(APIC_REGISTER_INT_COMMAND_LOW) & APIC_ICR_DELIVERY_STATUS)
+        asm volatile("pause");
+
+    // Writing the low register sends the IPI, so the destination goes first
+    lapicWrite(APIC_REGISTER_INT_COMMAND_HIGH, apicId << 24);
+    lapicWrite(APIC_REGISTER_INT_COMMAND_LOW, vector | APIC_LVT_DELIVERY_MODE_FIXED | APIC_ICR_LEVEL_ASSERT);
+}
+
+uint32_t lapicGetId()
+{
+    return lapicRead(APIC_REGISTER_ID) >> 24;
 }
\ No newline at end of file
@@ -27,6 +27,7 @@
 #include <system/acpi/madt.hpp>
 
 #include <system/processor/processor.hpp>
+#include <system/processor/smp.hpp>
 
 #include <tasking/tasking.hpp>
 #include <tasking/scheduler.hpp>
@@ -119,6 +120,9 @@ k_ahci_driver *mainDriver;
 
 void kernelInitialize(stivale2_struct *stivaleInfo)
 {
+    // The bootstrap processor's data, everything per-processor is reached through it
+    processorInitializeLocal(0);
+
     loggerInitialize(stivaleInfo);
     logDebugn("Logger has been initialized.");
 
@@ -148,11 +152,13 @@ void kernelInitialize(stivale2_struct *stivaleInfo)
 
     schedulerInit();
 
-    taskingInitialize(1);
+    taskingInitialize(smpCountProcessors(stivaleInfo));
     taskingAddCPU(0);
 
     Syscall::initialize();
 
+    smpInitialize(stivaleInfo);
+
     ELF_LOAD_STATUS status;
     k_process *proc;
     if ((status = elfLoad("root/apps/shell.elf", (const char*)"heyo", &proc)) == SUCCESS)
@@ -3,10 +3,15 @@
 #include <Renderer.hpp>
 #include <PSF.hpp>
 #include <stivale2/stivale2_tools.hpp>
+#include <interrupts/interrupts.hpp>
+#include <utils/spinlock.hpp>
 
 static PSF_Font font;
 static Renderer renderer;
 
+// The renderer's cursor is shared by all the processors, a message is printed as a whole
+static k_spinlock loggerLock;
+
 void loggerInitialize(stivale2_struct *stivaleInfo)
 {
     stivale2_struct_tag_framebuffer *framebuffer = (stivale2_struct_tag_framebuffer *)stivale2_get_tag(stivaleInfo, STIVALE2_STRUCT_TAG_FRAMEBUFFER_ID);
@@ -20,14 +25,22 @@ void loggerInitialize(stivale2_struct *stivaleInfo)
 
 void loggerPrintDirect(const char *msg, va_list valist)
 {
+    uint64_t rflags = interruptsSave();
+    loggerLock.lock();
     renderer.printf(msg, valist);
+    loggerLock.unlock();
+    interruptsRestore(rflags);
 }
 
 void loggerPrint(const char *msg, ...)
 {
     va_list valist;
     va_start(valist, msg);
+    uint64_t rflags = interruptsSave();
+    loggerLock.lock();
     renderer.printf(msg, valist);
+    loggerLock.unlock();
+    interruptsRestore(rflags);
     va_end(valist);
 }
 
@@ -35,7 +48,11 @@ void loggerPrintln(const char *msg, ...)
 {
     va_list valist;
     va_start(valist, msg);
+    uint64_t rflags = interruptsSave();
+    loggerLock.lock();
     renderer.printf(msg, valist);
     renderer.putchar('\n');
+    loggerLock.unlock();
+    interruptsRestore(rflags);
     va_end(valist);
 }
\ No newline at end of file
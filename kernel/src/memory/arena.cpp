@@ -0,0 +1,84 @@
+#include <memory/arena.hpp>
+
+#include <memory/memory.hpp>
+#include <memory/paging.hpp>
+#include <kernel.hpp>
+
+void *k_arena::allocate(uint64_t size, uint64_t alignment)
+{
+    if (!this->current || ALIGN_UP(this->offset, alignment) + size > this->current->size)
+        this->_grow(size, alignment);
+
+    uint64_t start = ALIGN_UP(this->offset, alignment);
+    this->offset = start + size;
+
+    return (void *)((uint64_t)this->current + start);
+}
+
+k_arena::mark k_arena::save()
+{
+    mark position;
+    position.block = this->current;
+    position.offset = this->offset;
+    return position;
+}
+
+void k_arena::rewind(mark position)
+{
+    while (this->current != position.block)
+        this->_pop();
+
+    this->offset = position.offset;
+}
+
+void k_arena::reset()
+{
+    if (!this->current)
+        return;
+
+    while (this->current->prev)
+        this->_pop();
+
+    this->offset = sizeof(k_arena_block);
+}
+
+void k_arena::release()
+{
+    while (this->current)
+        this->_pop();
+
+    this->offset = 0;
+}
+
+void k_arena::_grow(uint64_t size, uint64_t alignment)
+{
+    uint64_t blockSize = ALIGN_UP(sizeof(k_arena_block), alignment) + size;
+    blockSize = blockSize < ARENA_BLOCK_SIZE ? ARENA_BLOCK_SIZE : PAGING_ALIGN_PAGE_UP(blockSize);
+
+    uint64_t pages = blockSize / PAGE_SIZE;
+    physical_address_t phys = pages == 1 ? memoryPhysicalAllocator.allocatePage()
+                                         : memoryPhysicalAllocator.allocatePages(pages);
+    if (!phys)
+        kernelPanic("%! Couldn't allocate a block of %d pages.", "[Arena]", pages);
+
+    k_arena_block *block = (k_arena_block *)PAGING_APPLY_DIRECTMAP(phys);
+    block->prev = this->current;
+    block->size = blockSize;
+
+    this->current = block;
+    this->offset = sizeof(k_arena_block);
+}
+
+void k_arena::_pop()
+{
+    k_arena_block *block = this->current;
+    this->current = block->prev;
+    this->offset = this->current ? this->current->size : 0;
+
+    uint64_t pages = block->size / PAGE_SIZE;
+    physical_address_t phys = PAGING_REMOVE_DIRECTMAP(block);
+    if (pages == 1)
+        memoryPhysicalAllocator.freePage(phys);
+    else
+        memoryPhysicalAllocator.freePages(phys, pages);
+}
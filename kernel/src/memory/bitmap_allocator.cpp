@@ -1,97 +1,154 @@
 #include <memory/bitmap_allocator.hpp>
 
 #include <memory/paging.hpp>
+#include <memory/memory.hpp>
+#include <kernel.hpp>
+#include <logger/logger.hpp>
+#include <system/processor/processor.hpp>
+#include <interrupts/interrupts.hpp>
 
 BitmapAllocator::BitmapAllocator()
 {
     this->_freeMemory = 0;
     this->_usedMemory = 0;
     this->_reservedMemory = 0;
+    this->_isInitialized = false;
+    this->_bitmap = NULL;
+    this->_pages = NULL;
+    this->_pageCount = 0;
+    this->_wordCount = 0;
+    this->_lock.locked = 0;
+    this->_zeroedCount = 0;
+    this->_zeroedLock.locked = 0;
+    memset((char *)this->_caches, 0, sizeof(this->_caches));
 }
 
 void BitmapAllocator::initialize(stivale2_struct_tag_memmap *memmapStruct)
 {
     if (this->_isInitialized)
         return;
-    this->_isInitialized = true;
 
-    // Before we start mapping the memory we have to calculate the memory size
-    uint64_t memorySize = countMemory(memmapStruct);
+    // Only usable memory can ever be allocated, so the bitmap has to cover
+    // memory up to the end of the highest usable entry
+    uint64_t highestUsable = 0;
+    for (uint64_t entryIdx = 0; entryIdx < memmapStruct->entries; entryIdx++)
+    {
+        stivale2_mmap_entry entry = memmapStruct->memmap[entryIdx];
+        if (entry.type == STIVALE2_MMAP_USABLE && entry.base + entry.length > highestUsable)
+            highestUsable = entry.base + entry.length;
+    }
+
+    this->_pageCount = highestUsable / PAGE_SIZE;
+    this->_wordCount = (this->_pageCount + BITMAP_ALLOCATOR_WORD_PAGES - 1) / BITMAP_ALLOCATOR_WORD_PAGES;
+
+    // The page database is placed right after the bitmap, on a cache line of its own
+    uint64_t databaseOffset = ALIGN_UP(this->_wordCount * sizeof(uint64_t), PAGE_DATABASE_ALIGNMENT);
+    uint64_t bitmapSize = databaseOffset + this->_pageCount * sizeof(k_page);
+
+    // Find the first usable entry with enough space for the bitmap and the page database
+    bool found = false;
+    physical_address_t bitmapPhys = 0;
+    for (uint64_t entryIdx = 0; entryIdx < memmapStruct->entries; entryIdx++)
+    {
+        stivale2_mmap_entry entry = memmapStruct->memmap[entryIdx];
+        if (entry.type == STIVALE2_MMAP_USABLE && entry.length >= PAGING_ALIGN_PAGE_UP(bitmapSize))
+        {
+            bitmapPhys = entry.base;
+            found = true;
+            break;
+        }
+    }
 
-    uint64_t bitmapSize = ((memorySize) / PAGE_SIZE + 1) / BYTE_SIZE;
-    uint8_t tempArr[bitmapSize]; // Create a temporary array for the bitmap,
-                                 // we will change it late
+    if (!found)
+        kernelPanic("%! Couldn't find a place for the physical memory bitmap.", "[Memory]");
 
-    memset((char *)tempArr, 0, bitmapSize);
+    this->_bitmap = (uint64_t *)PAGING_APPLY_DIRECTMAP(bitmapPhys);
+    memset((char *)this->_bitmap, 0, this->_wordCount * sizeof(uint64_t));
+    this->_pages = (k_page *)((uint64_t)this->_bitmap + databaseOffset);
+    this->_zone.initialize(this->_pages, this->_pageCount);
 
-    this->_memoryBitmap.setBuffer(tempArr, bitmapSize);
+    this->_isInitialized = true;
 
-    // Map the memory to the temporary array
+    // Mark the usable memory as free, everything else stays locked
     for (uint64_t entryIdx = 0; entryIdx < memmapStruct->entries; entryIdx++)
     {
         stivale2_mmap_entry entry = memmapStruct->memmap[entryIdx];
 
         bool memStatus = (entry.type == STIVALE2_MMAP_USABLE);
 
-        this->_freeMemory += memStatus ? entry.length : 0;
         this->_reservedMemory += !memStatus ? entry.length : 0;
 
-        for (uint64_t pageAddr = 0; pageAddr < entry.length; pageAddr += PAGE_SIZE)
-        {
-            // Calculate the absolute address of the page, get the page index
-            // (in bytes) and divide by the bit size
-            uint64_t pageBit = (entry.base + pageAddr) / PAGE_SIZE;
-
-            this->_memoryBitmap.set(pageBit, memStatus);
-        }
+        if (memStatus)
+            this->_markFree(entry.base / PAGE_SIZE, entry.length / PAGE_SIZE);
     }
 
-    uint64_t bitmapPage;
-    // Find the first place to put the bit map in
-    for (uint64_t pageIndex = 0; pageIndex < bitmapSize; pageIndex++)
+    // Count the free memory from the bitmap itself, so partial pages at the
+    // edges of the entries aren't counted
+    for (uint64_t word = 0; word < this->_wordCount; word++)
+        this->_freeMemory += bitmapPopcount(this->_bitmap[word]) * PAGE_SIZE;
+
+    // Lock the pages of the bitmap
+    for (uint64_t i = 0; i < PAGING_ALIGN_PAGE_UP(bitmapSize) / PAGE_SIZE; i++)
+        this->_lockBlock(bitmapPhys + i * PAGE_SIZE);
+
+    // Page 0 is never handed out, 0 is the "no page" result of allocatePage()
+    this->_lockBlock(0);
+
+    // Seed the zone with the runs of free pages
+    uint64_t page = 0;
+    while (page < this->_pageCount)
     {
-        if (this->_memoryBitmap[pageIndex])
+        uint64_t word = page / BITMAP_ALLOCATOR_WORD_PAGES;
+        uint64_t mask = (uint64_t)1 << (page % BITMAP_ALLOCATOR_WORD_PAGES);
+        if (!(this->_bitmap[word] & mask))
         {
-            // Found an empty page, check if this section has enough space for
-            // the bitmap
-            bool found = true;
-            for (uint64_t i = 0; i < bitmapSize / PAGE_SIZE + 1; i++)
-            {
-                if (!this->_memoryBitmap[pageIndex + i])
-                {
-                    found = false;
-                    break;
-                }
-            }
-
-            if (found)
-            {
-                bitmapPage = pageIndex;
-                break;
-            }
+            // Whatever isn't free now is never handed out
+            this->_pages[page].flags = PAGE_FRAME_RESERVED;
+            page++;
+            continue;
         }
+
+        uint64_t runEnd = page + 1;
+        while (runEnd < this->_pageCount &&
+               (this->_bitmap[runEnd / BITMAP_ALLOCATOR_WORD_PAGES] & ((uint64_t)1 << (runEnd % BITMAP_ALLOCATOR_WORD_PAGES))))
+            runEnd++;
+
+        this->_zone.freeRange(page, runEnd - page);
+        page = runEnd;
     }
+}
+
+void BitmapAllocator::freePage(physical_address_t blockAddr)
+{
+    // Pages outside the bitmap are never allocated, don't let them into the cache
+    if (!this->_isInitialized || blockAddr / PAGE_SIZE >= this->_pageCount)
+        return;
 
-    // TODO: Do something in case there's no place for the bitmap
+    // The bitmap only catches a page that isn't allocated when the cache is drained, by
+    // then the cache would have handed it out twice
+    uint64_t frame = blockAddr / PAGE_SIZE;
+    k_page *page = &this->_pages[frame];
+    bool inBitmap = this->_bitmap[frame / BITMAP_ALLOCATOR_WORD_PAGES] & ((uint64_t)1 << (frame % BITMAP_ALLOCATOR_WORD_PAGES));
+    if (!page->refcount || (page->flags & PAGE_FRAME_RESERVED) || inBitmap)
+    {
+        logWarnn("%! Tried to free page 0x%64x, which isn't allocated.", "[Memory]", blockAddr);
+        return;
+    }
 
-    // Calculate the address
-    virtual_address_t bitmapAddress = PAGING_APPLY_DIRECTMAP(bitmapPage * PAGE_SIZE);
-    memset((char *)bitmapAddress, 0, bitmapSize);
+    // A shared page stays with its other mappings
+    if (this->_dropShare(blockAddr))
+        return;
 
-    // Copy the temp array to the location
-    memcpy((void *)bitmapAddress, (void *)tempArr, bitmapSize);
+    uint64_t rflags = interruptsSave();
+    k_page_cache *cache = &this->_caches[processorGetIndex()];
 
-    // Change the buffer of the bitmap
-    this->_memoryBitmap.setBuffer((uint8_t *)bitmapAddress, bitmapSize);
+    if (cache->count == BITMAP_ALLOCATOR_CACHE_SIZE)
+        this->_drainCache(cache);
 
-    // TODO: Lock the pages of the bitmap
-    for (uint64_t i = 0; i < PAGING_ALIGN_PAGE_UP(bitmapSize) / PAGE_SIZE + 1; i++)
-        this->_lockBlock(PAGING_REMOVE_DIRECTMAP(bitmapAddress) + i * PAGE_SIZE);
-}
+    cache->pages[cache->count++] = blockAddr;
+    cache->frees++;
 
-void BitmapAllocator::freePage(physical_address_t blockAddr)
-{
-    this->_freeBlock(blockAddr);
+    interruptsRestore(rflags);
 }
 
 uint64_t BitmapAllocator::totalMemory()
@@ -101,12 +158,12 @@ uint64_t BitmapAllocator::totalMemory()
 
 uint64_t BitmapAllocator::freeMemory()
 {
-    return this->_freeMemory;
+    return this->_freeMemory + this->cachedMemory();
 }
 
 uint64_t BitmapAllocator::usedMemory()
 {
-    return this->_usedMemory;
+    return this->_usedMemory - this->cachedMemory();
 }
 
 uint64_t BitmapAllocator::reservedMemory()
@@ -114,14 +171,346 @@ uint64_t BitmapAllocator::reservedMemory()
     return this->_reservedMemory;
 }
 
+uint64_t BitmapAllocator::cachedMemory()
+{
+    uint64_t pages = this->_zeroedCount;
+    for (uint64_t cpu = 0; cpu < PROCESSOR_MAX_CPUS; cpu++)
+        pages += this->_caches[cpu].count;
+
+    return pages * PAGE_SIZE;
+}
+
+void BitmapAllocator::dumpCacheStatistics()
+{
+    for (uint64_t cpu = 0; cpu < PROCESSOR_MAX_CPUS; cpu++)
+    {
+        k_page_cache *cache = &this->_caches[cpu];
+        if (!cache->allocations && !cache->frees)
+            continue;
+
+        // Rates are per 1000 operations, so they don't round down to 0
+        logDebugn("%! CPU %d: %d pages cached \
+                \n\t- %d allocations, %d refills (%d per 1000) \
+                \n\t- %d frees, %d drains (%d per 1000)",
+                  "[Physical Allocator]",
+                  cpu,
+                  cache->count,
+                  cache->allocations,
+                  cache->refills,
+                  cache->allocations ? cache->refills * 1000 / cache->allocations : 0,
+                  cache->frees,
+                  cache->drains,
+                  cache->frees ? cache->drains * 1000 / cache->frees : 0);
+    }
+}
+
 physical_address_t BitmapAllocator::allocatePage()
 {
-    // TODO: do something if no free block
-    physical_address_t blockAddr = this->_nextBlock();
-    this->_lockBlock(blockAddr);
+    physical_address_t blockAddr = this->_allocateFreePage();
+
+    // The zeroed pool is the last free memory there is
+    if (!blockAddr)
+        blockAddr = this->_takeZeroedPage();
+
     return blockAddr;
 }
 
+physical_address_t BitmapAllocator::_allocateFreePage()
+{
+    uint64_t rflags = interruptsSave();
+    k_page_cache *cache = &this->_caches[processorGetIndex()];
+
+    if (cache->count == 0)
+        this->_refillCache(cache);
+
+    physical_address_t blockAddr = 0;
+    if (cache->count > 0)
+    {
+        blockAddr = cache->pages[--cache->count];
+        cache->allocations++;
+        this->_claimPage(blockAddr);
+    }
+
+    interruptsRestore(rflags);
+
+    return blockAddr;
+}
+
+physical_address_t BitmapAllocator::allocateZeroedPage()
+{
+    physical_address_t blockAddr = this->_takeZeroedPage();
+    if (blockAddr)
+        return blockAddr;
+
+    blockAddr = this->allocatePage();
+    if (!blockAddr)
+        return 0;
+
+    bitmapZeroPage(blockAddr);
+    return blockAddr;
+}
+
+uint64_t BitmapAllocator::fillZeroedPool(uint64_t pages)
+{
+    if (!this->_isInitialized || this->_zeroedCount >= BITMAP_ALLOCATOR_ZERO_POOL_SIZE)
+        return 0;
+
+    uint64_t added = 0;
+    while (added < pages)
+    {
+        physical_address_t blockAddr = this->_allocateFreePage();
+        if (!blockAddr)
+            break;
+
+        // Zeroing is the slow part, it is done without holding the lock
+        bitmapZeroPage(blockAddr);
+        this->_pages[blockAddr / PAGE_SIZE].flags = PAGE_FRAME_ZEROED;
+
+        bool kept = false;
+        uint64_t rflags = interruptsSave();
+        this->_zeroedLock.lock();
+        if (this->_zeroedCount < BITMAP_ALLOCATOR_ZERO_POOL_SIZE)
+        {
+            this->_zeroedPages[this->_zeroedCount++] = blockAddr;
+            kept = true;
+        }
+        this->_zeroedLock.unlock();
+        interruptsRestore(rflags);
+
+        if (!kept)
+        {
+            this->freePage(blockAddr);
+            break;
+        }
+        added++;
+    }
+
+    return added;
+}
+
+physical_address_t BitmapAllocator::_takeZeroedPage()
+{
+    physical_address_t blockAddr = 0;
+
+    uint64_t rflags = interruptsSave();
+    this->_zeroedLock.lock();
+    if (this->_zeroedCount > 0)
+        blockAddr = this->_zeroedPages[--this->_zeroedCount];
+    this->_zeroedLock.unlock();
+    interruptsRestore(rflags);
+
+    if (blockAddr)
+        this->_claimPage(blockAddr);
+
+    return blockAddr;
+}
+
+void BitmapAllocator::_refillCache(k_page_cache *cache)
+{
+    this->_lock.lock();
+    while (cache->count < BITMAP_ALLOCATOR_CACHE_BATCH)
+    {
+        physical_address_t blockAddr = this->_allocateBlock();
+        if (!blockAddr)
+            break;
+        cache->pages[cache->count++] = blockAddr;
+    }
+    this->_lock.unlock();
+
+    cache->refills++;
+}
+
+void BitmapAllocator::_drainCache(k_page_cache *cache)
+{
+    // Return the oldest pages, the most recently freed ones are the most likely to be in the cache
+    this->_lock.lock();
+    for (uint64_t i = 0; i < BITMAP_ALLOCATOR_CACHE_BATCH; i++)
+        this->_freeRange(cache->pages[i] / PAGE_SIZE, 1);
+    this->_lock.unlock();
+
+    cache->count -= BITMAP_ALLOCATOR_CACHE_BATCH;
+    memcpy((char *)cache->pages,
+           (char *)&cache->pages[BITMAP_ALLOCATOR_CACHE_BATCH],
+           cache->count * sizeof(physical_address_t));
+
+    cache->drains++;
+}
+
+void BitmapAllocator::dumpFragmentation()
+{
+    uint64_t rflags = interruptsSave();
+    this->_lock.lock();
+    this->_zone.dumpStatistics();
+    this->_lock.unlock();
+    interruptsRestore(rflags);
+}
+
+physical_address_t BitmapAllocator::_allocateBlock()
+{
+    if (!this->_isInitialized)
+        return 0;
+
+    uint64_t frame = this->_zone.allocate(0);
+    if (frame == PHYSICAL_ZONE_NO_FRAME)
+        return 0;
+
+    this->_lockBlock(frame * PAGE_SIZE);
+    return frame * PAGE_SIZE;
+}
+
+physical_address_t BitmapAllocator::allocatePages(uint64_t pages, uint64_t alignment)
+{
+    if (!this->_isInitialized || pages == 0)
+        return 0;
+
+    if (alignment < PAGE_SIZE)
+        alignment = PAGE_SIZE;
+
+    // Buddy blocks are aligned to their size, so a block that is both large
+    // enough and as large as the alignment satisfies both
+    uint8_t order = physicalZoneOrder(pages);
+    uint8_t alignmentOrder = physicalZoneOrder(alignment / PAGE_SIZE);
+    if (alignmentOrder > order)
+        order = alignmentOrder;
+
+    // The lock is also taken by the caches with the interrupts disabled, so
+    // it can't be held while this processor may be preempted
+    uint64_t rflags = interruptsSave();
+    this->_lock.lock();
+
+    physical_address_t blockAddr = 0;
+    uint64_t frame = this->_zone.allocate(order);
+    if (frame != PHYSICAL_ZONE_NO_FRAME)
+    {
+        for (uint64_t i = 0; i < pages; i++)
+        {
+            this->_lockBlock((frame + i) * PAGE_SIZE);
+            this->_claimPage((frame + i) * PAGE_SIZE);
+        }
+
+        // Give back the rest of the block, it is still free in the bitmap
+        this->_zone.freeRange(frame + pages, ((uint64_t)1 << order) - pages);
+        blockAddr = frame * PAGE_SIZE;
+    }
+
+    this->_lock.unlock();
+    interruptsRestore(rflags);
+    return blockAddr;
+}
+
+void BitmapAllocator::freePages(physical_address_t blockAddr, uint64_t pages)
+{
+    uint64_t rflags = interruptsSave();
+    this->_lock.lock();
+    this->_freeRange(blockAddr / PAGE_SIZE, pages);
+    this->_lock.unlock();
+    interruptsRestore(rflags);
+}
+
+uint64_t BitmapAllocator::allocatePageList(physical_address_t *pages, uint64_t count)
+{
+    uint64_t rflags = interruptsSave();
+    k_page_cache *cache = &this->_caches[processorGetIndex()];
+
+    uint64_t allocated = 0;
+    while (allocated < count && cache->count > 0)
+        pages[allocated++] = cache->pages[--cache->count];
+    cache->allocations += allocated;
+
+    if (allocated < count)
+    {
+        this->_lock.lock();
+        while (allocated < count)
+        {
+            physical_address_t blockAddr = this->_allocateBlock();
+            if (!blockAddr)
+                break;
+            pages[allocated++] = blockAddr;
+        }
+        this->_lock.unlock();
+    }
+
+    for (uint64_t i = 0; i < allocated; i++)
+        this->_claimPage(pages[i]);
+
+    interruptsRestore(rflags);
+    return allocated;
+}
+
+void BitmapAllocator::freePageList(const physical_address_t *pages, uint64_t count)
+{
+    uint64_t rflags = interruptsSave();
+    this->_lock.lock();
+    for (uint64_t i = 0; i < count; i++)
+        if (pages[i] && !this->_dropShare(pages[i]))
+            this->_freeRange(pages[i] / PAGE_SIZE, 1);
+    this->_lock.unlock();
+    interruptsRestore(rflags);
+}
+
+void BitmapAllocator::sharePage(physical_address_t blockAddr)
+{
+    k_page *page = this->getPage(blockAddr);
+    if (!page)
+        return;
+
+    __sync_fetch_and_add(&page->refcount, 1);
+}
+
+uint64_t BitmapAllocator::pageShares(physical_address_t blockAddr)
+{
+    k_page *page = this->getPage(blockAddr);
+    if (!page || page->refcount <= 1)
+        return 0;
+
+    return page->refcount - 1;
+}
+
+k_page *BitmapAllocator::getPage(physical_address_t blockAddr)
+{
+    uint64_t page = blockAddr / PAGE_SIZE;
+    if (!this->_isInitialized || page >= this->_pageCount)
+        return NULL;
+
+    return &this->_pages[page];
+}
+
+physical_address_t BitmapAllocator::getPageAddress(k_page *page)
+{
+    return (physical_address_t)(page - this->_pages) * PAGE_SIZE;
+}
+
+void BitmapAllocator::_claimPage(physical_address_t blockAddr)
+{
+    k_page *page = &this->_pages[blockAddr / PAGE_SIZE];
+    page->flags = 0;
+    page->refcount = 1;
+    page->owner = 0;
+    page->index = 0;
+}
+
+bool BitmapAllocator::_dropShare(physical_address_t blockAddr)
+{
+    uint64_t page = blockAddr / PAGE_SIZE;
+    if (page >= this->_pageCount)
+        return false;
+
+    // Pages that were never claimed (e.g. the boot time mappings) have no references
+    volatile uint32_t *refcount = &this->_pages[page].refcount;
+    uint32_t current;
+    do
+    {
+        current = *refcount;
+        if (current <= 1)
+        {
+            *refcount = 0;
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(refcount, current, current - 1));
+
+    return true;
+}
+
 void BitmapAllocator::_lockBlock(physical_address_t blockAddr)
 {
     // TODO: check that blockAddr is page aligned and do something
@@ -131,43 +520,81 @@ void BitmapAllocator::_lockBlock(physical_address_t blockAddr)
     if (!this->_isInitialized)
         return;
 
-    if (this->_memoryBitmap[blockAddr / PAGE_SIZE])
+    uint64_t page = blockAddr / PAGE_SIZE;
+    if (page >= this->_pageCount)
+        return;
+
+    uint64_t word = page / BITMAP_ALLOCATOR_WORD_PAGES;
+    uint64_t mask = (uint64_t)1 << (page % BITMAP_ALLOCATOR_WORD_PAGES);
+
+    if (this->_bitmap[word] & mask)
     {
         this->_freeMemory -= PAGE_SIZE;
         this->_usedMemory += PAGE_SIZE;
 
-        this->_memoryBitmap.set(blockAddr / PAGE_SIZE, 0);
+        this->_bitmap[word] &= ~mask;
     }
 }
 
-void BitmapAllocator::_freeBlock(physical_address_t blockAddr)
+void BitmapAllocator::_freeRange(uint64_t firstPage, uint64_t pages)
 {
-    // TODO: check that blockAddr is page aligned and do something
-    // if its not
-
     // TODO: something if not initiallized
     if (!this->_isInitialized)
         return;
 
-    if (!this->_memoryBitmap[blockAddr / PAGE_SIZE])
+    uint64_t end = firstPage + pages;
+    if (end > this->_pageCount)
+        end = this->_pageCount;
+
+    // Runs of pages that were allocated are returned to the zone together
+    uint64_t runStart = firstPage;
+    for (uint64_t page = firstPage; page < end; page++)
     {
+        uint64_t word = page / BITMAP_ALLOCATOR_WORD_PAGES;
+        uint64_t mask = (uint64_t)1 << (page % BITMAP_ALLOCATOR_WORD_PAGES);
+
+        if (this->_bitmap[word] & mask)
+        {
+            // Already free, don't hand it to the zone twice
+            if (page > runStart)
+                this->_zone.freeRange(runStart, page - runStart);
+            runStart = page + 1;
+            continue;
+        }
+
         this->_freeMemory += PAGE_SIZE;
         this->_usedMemory -= PAGE_SIZE;
-
-        this->_memoryBitmap.set(blockAddr / PAGE_SIZE, 1);
+        this->_bitmap[word] |= mask;
     }
+
+    if (end > runStart)
+        this->_zone.freeRange(runStart, end - runStart);
 }
 
-physical_address_t BitmapAllocator::_nextBlock()
+void BitmapAllocator::_markFree(uint64_t firstPage, uint64_t pages)
 {
-    // TODO: something if not initiallized
-    if (!this->_isInitialized)
-        return 0;
+    uint64_t page = firstPage;
+    uint64_t end = firstPage + pages;
+    if (end > this->_pageCount)
+        end = this->_pageCount;
 
-    for (uint64_t i = 0; i < this->_memoryBitmap.getSize(); i++)
-        if (this->_memoryBitmap[i])
-            return i * PAGE_SIZE;
-    return 0;
+    while (page < end)
+    {
+        uint64_t word = page / BITMAP_ALLOCATOR_WORD_PAGES;
+        uint64_t bit = page % BITMAP_ALLOCATOR_WORD_PAGES;
+
+        // Fill whole words at once when possible
+        if (bit == 0 && end - page >= BITMAP_ALLOCATOR_WORD_PAGES)
+        {
+            this->_bitmap[word] = ~(uint64_t)0;
+            page += BITMAP_ALLOCATOR_WORD_PAGES;
+        }
+        else
+        {
+            this->_bitmap[word] |= (uint64_t)1 << bit;
+            page++;
+        }
+    }
 }
 
 uint64_t countMemory(stivale2_struct_tag_memmap *memmapStruct)
@@ -182,4 +609,62 @@ uint64_t countMemory(stivale2_struct_tag_memmap *memmapStruct)
     }
 
     return memorySize;
-}
\ No newline at end of file
+}
+
+void bitmapZeroPage(physical_address_t blockAddr)
+{
+    uint64_t *page = (uint64_t *)PAGING_APPLY_DIRECTMAP(blockAddr);
+    uint64_t count = PAGE_SIZE / sizeof(uint64_t);
+
+    asm volatile("rep stosq"
+                 : "+D"(page), "+c"(count)
+                 : "a"((uint64_t)0)
+                 : "memory");
+}
+
+uint64_t bitmapPopcount(uint64_t word)
+{
+    // Branchless bit counting, we don't rely on the popcnt instruction being available
+    word = word - ((word >> 1) & 0x5555555555555555);
+    word = (word & 0x3333333333333333) + ((word >> 2) & 0x3333333333333333);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0F;
+    return (word * 0x0101010101010101) >> 56;
+}
+
+#ifdef BENCHMARK_PHYSICAL_ALLOCATOR
+#define BENCHMARK_PAGES (1024 * 1024)
+#define BENCHMARK_BATCH 4096
+
+static physical_address_t benchmarkBatch[BENCHMARK_BATCH];
+
+void bitmapAllocatorBenchmark(BitmapAllocator *allocator)
+{
+    uint64_t allocateCycles = 0;
+    uint64_t freeCycles = 0;
+
+    for (uint64_t round = 0; round < BENCHMARK_PAGES / BENCHMARK_BATCH; round++)
+    {
+        uint64_t start = processorReadTSC();
+        for (uint64_t i = 0; i < BENCHMARK_BATCH; i++)
+            benchmarkBatch[i] = allocator->allocatePage();
+        uint64_t middle = processorReadTSC();
+        for (uint64_t i = 0; i < BENCHMARK_BATCH; i++)
+            allocator->freePage(benchmarkBatch[i]);
+        uint64_t end = processorReadTSC();
+
+        allocateCycles += middle - start;
+        freeCycles += end - middle;
+    }
+
+    logDebugn("%! Allocated and freed %d pages: \
+            \n\t- allocatePage: %d cycles per page \
+            \n\t- freePage: %d cycles per page",
+              "[Physical Allocator]",
+              BENCHMARK_PAGES,
+              allocateCycles / BENCHMARK_PAGES,
+              freeCycles / BENCHMARK_PAGES);
+
+    allocator->dumpCacheStatistics();
+    allocator->dumpFragmentation();
+}
+#endif
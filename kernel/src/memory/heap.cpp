@@ -1,16 +1,37 @@
 #include <memory/heap.hpp>
 
-#include <memory/freelist_allocator.hpp>
+#include <memory/segregated_allocator.hpp>
 #include <memory/memory.hpp>
 #include <memory/paging.hpp>
+#include <memory/tlb.hpp>
+#include <interrupts/interrupts.hpp>
+#include <utils/spinlock.hpp>
 #include <kernel.hpp>
 #include <logger/logger.hpp>
+#include <strings.hpp>
+#include <logger/printf.hpp>
 
 virtual_address_t heapStart;
 virtual_address_t heapEnd;
+// The heap is never trimmed below its initial end
+virtual_address_t heapMinimumEnd;
+k_heap_growth_policy heapGrowthPolicy = HEAP_GROWTH_GEOMETRIC;
+uint64_t heapGrowthStep = K_HEAP_EXPANSION_STEP;
 bool heapInitialized = false;
-k_freelist_allocator heapAllocator;
+k_segregated_allocator heapAllocator;
 uint64_t heapUsed;
+uint64_t heapPeakUsed;
+
+// The statistics of the call sites, the chunks are tagged with their site's index
+k_heap_callsite heapCallsites[K_HEAP_CALLSITE_COUNT];
+
+// Protects the allocator and the heap's bounds
+k_spinlock heapLock;
+
+// The pages a trim took off the end of the heap, unmapped after the lock is released.
+// The heap doesn't grow or trim again until they are, cleared without the lock
+static virtual_address_t heapTrimBase;
+static volatile uint64_t heapTrimSize = 0;
 
 bool heapVerbose = false;
 
@@ -19,18 +40,11 @@ void heapInitialize(virtual_address_t start, virtual_address_t end)
     heapAllocator.init(start, end);
     heapStart = start;
     heapEnd = end;
+    heapMinimumEnd = end;
 
     heapInitialized = true;
     heapUsed = 0;
 
-    // Lock the pages in the heap
-    uint64_t pageCount = ((uint64_t)(end - start)) / PAGE_SIZE + 1;
-    for (uint64_t page = 0; page < pageCount; page++)
-    {
-        physical_address_t pAddr = memoryPhysicalAllocator.allocatePage();
-        pagingMapPage(start + PAGE_SIZE * page, pAddr);
-    }
-
     #ifdef VERBOSE_HEAP
         logDebugn("%! Heap has been initialized. \
                 \n\t- Starting at: 0x%64x, \
@@ -39,7 +53,122 @@ void heapInitialize(virtual_address_t start, virtual_address_t end)
     #endif
 }
 
-void *heapAllocate(uint64_t size)
+/**
+ * @brief Get how many bytes an allocation of heapAllocateLarge can hold
+ */
+static uint64_t heapLargeUsableSize(k_heap_chunk *chunk)
+{
+    virtual_address_t base = PAGING_ALIGN_PAGE_DOWN((virtual_address_t)chunk);
+    return base + HEAP_CHUNK_SIZE(chunk) - (virtual_address_t)HEAP_CHUNK_PAYLOAD(chunk);
+}
+
+/**
+ * @brief Allocate memory on pages of its own, outside of the heap's area
+ *
+ * @param alignment A power of 2, up to PAGE_SIZE
+ * @return void* The memory, NULL if the virtual ranges aren't available or there is no memory
+ */
+static void *heapAllocateLarge(uint64_t size, uint64_t alignment)
+{
+    // The header sits right before the aligned payload
+    uint64_t offset = alignment > HEAP_CHUNK_OVERHEAD ? alignment - HEAP_CHUNK_OVERHEAD : 0;
+    uint64_t total = PAGING_ALIGN_PAGE_UP(offset + size + HEAP_CHUNK_OVERHEAD);
+
+    virtual_address_t base = virtualAddressRangeAllocator.allocateRange(total / PAGE_SIZE, "heap");
+    if (!base)
+        return NULL;
+
+    if (!pagingAllocateMemoryInTable(base, total, pagingGetCurrentSpace()))
+    {
+        virtualAddressRangeAllocator.freeRange(base);
+        return NULL;
+    }
+
+    k_heap_chunk *chunk = (k_heap_chunk *)(base + offset);
+    chunk->header = total | HEAP_CHUNK_USED | HEAP_CHUNK_LARGE;
+    return HEAP_CHUNK_PAYLOAD(chunk);
+}
+
+/**
+ * @brief Free memory that was allocated by heapAllocateLarge
+ */
+static void heapFreeLarge(k_heap_chunk *chunk)
+{
+    uint64_t total = HEAP_CHUNK_SIZE(chunk);
+    virtual_address_t base = PAGING_ALIGN_PAGE_DOWN((virtual_address_t)chunk);
+
+    pagingFreeMemoryInTable(base, total, pagingGetCurrentSpace());
+    virtualAddressRangeAllocator.freeRange(base);
+}
+
+/**
+ * @brief Find the statistics entry of a call site, a new entry is taken for a new site.
+ * The heap's lock must be held.
+ *
+ * @return uint64_t The index of the entry, 0 (shared by the sites that didn't fit) if the table is full
+ */
+static uint64_t heapCallsiteIndex(virtual_address_t site)
+{
+    // Entry 0 is reserved, so probe the others
+    uint64_t slots = K_HEAP_CALLSITE_COUNT - 1;
+    uint64_t start = ((site >> 2) * 0x9E3779B97F4A7C15) % slots;
+
+    for (uint64_t i = 0; i < slots; i++)
+    {
+        k_heap_callsite *entry = &heapCallsites[1 + (start + i) % slots];
+        if (entry->site == site)
+            return entry - heapCallsites;
+
+        if (!entry->site)
+        {
+            entry->site = site;
+            return entry - heapCallsites;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Count a change in the size of a call site's memory. The heap's lock must be held.
+ */
+static void heapAccountBytes(k_heap_callsite *entry, uint64_t oldBytes, uint64_t newBytes)
+{
+    entry->bytes += newBytes - oldBytes;
+    if (entry->bytes > entry->peakBytes)
+        entry->peakBytes = entry->bytes;
+
+    heapUsed += newBytes - oldBytes;
+    if (heapUsed > heapPeakUsed)
+        heapPeakUsed = heapUsed;
+}
+
+/**
+ * @brief Count an allocation, and tag its chunk with the call site. The heap's lock must be held.
+ */
+static void heapAccountAllocation(k_heap_chunk *chunk, uint64_t bytes, virtual_address_t site)
+{
+    uint64_t index = heapCallsiteIndex(site);
+    chunk->header |= index << HEAP_CHUNK_TAG_SHIFT;
+
+    heapCallsites[index].allocations++;
+    heapAccountBytes(&heapCallsites[index], 0, bytes);
+}
+
+/**
+ * @brief Count a free of an allocation, before its chunk is freed. The heap's lock must be held.
+ */
+static void heapAccountFree(k_heap_chunk *chunk, uint64_t bytes)
+{
+    k_heap_callsite *entry = &heapCallsites[HEAP_CHUNK_TAG(chunk)];
+    entry->frees++;
+    heapAccountBytes(entry, bytes, 0);
+}
+
+/**
+ * @brief Allocate memory on the heap on behalf of a call site
+ */
+static void *heapAllocateFrom(uint64_t size, uint64_t alignment, virtual_address_t site)
 {
     if (size == 0)
         return NULL;
@@ -47,17 +176,49 @@ void *heapAllocate(uint64_t size)
     if (!heapInitialized)
         kernelPanic("%! An attempt to allocate memory with uninitialized heap has occurred.", "[Kernel Heap]");
 
-    // Allocate memory
-    void *ptr = heapAllocator.allocate(size);
+    if (alignment & (alignment - 1))
+        kernelPanic("%! An allocation was requested with an alignment of %d, which isn't a power of 2.", "[Kernel Heap]", alignment);
 
-    // Handle the case where heap has ran out of memory
-    if (!ptr)
+    // Big allocations get pages of their own, so they don't fragment the heap
+    void *ptr = NULL;
+    if (size >= K_HEAP_LARGE_THRESHOLD && alignment <= PAGE_SIZE)
+        ptr = heapAllocateLarge(size, alignment);
+
+    uint64_t rflags = interruptsSave();
+    heapLock.lock();
+
+    if (ptr)
+        heapAccountAllocation(HEAP_CHUNK_OF(ptr), heapLargeUsableSize(HEAP_CHUNK_OF(ptr)), site);
+    else
     {
-        if (heapExpand())
+        // Allocate memory
+        ptr = heapAllocator.allocateAligned(size, alignment);
+
+        // The end of the heap is still being unmapped, wait for it before growing. The
+        // trimming processor may wait on this one for a TLB shootdown meanwhile
+        while (!ptr && heapTrimSize)
         {
-            return heapAllocate(size);
+            heapLock.unlock();
+            tlbHandleShootdown(0);
+            asm volatile("pause");
+            heapLock.lock();
+            ptr = heapAllocator.allocateAligned(size, alignment);
         }
 
+        // Handle the case where heap has ran out of memory, the new memory must be able
+        // to hold the chunk even if the alignment is off
+        if (!ptr && heapExpand(size + alignment + HEAP_CHUNK_MIN_SIZE + HEAP_CHUNK_OVERHEAD))
+            ptr = heapAllocator.allocateAligned(size, alignment);
+
+        if (ptr)
+            heapAccountAllocation(HEAP_CHUNK_OF(ptr), heapAllocator.usableSize(ptr), site);
+    }
+
+    heapLock.unlock();
+    interruptsRestore(rflags);
+
+    if (!ptr)
+    {
         kernelPanic("%! failed to allocate kernel memory.", "[Kernel Heap]");
         return 0;
     }
@@ -65,41 +226,126 @@ void *heapAllocate(uint64_t size)
     #ifdef VERBOSE_HEAP
         logDebugn("%! Successfully allocated %d %s.", "[Kernel Heap]", K_MEMORY_SIZE(size), K_MEMORY_UNIT(size));
     #endif
-    heapUsed += size;
     return ptr;
 }
 
-bool heapExpand()
+void *heapAllocateAligned(uint64_t size, uint64_t alignment)
+{
+    return heapAllocateFrom(size, alignment, (virtual_address_t)__builtin_return_address(0));
+}
+
+void *heapAllocate(uint64_t size)
+{
+    return heapAllocateFrom(size, HEAP_CHUNK_ALIGNMENT, (virtual_address_t)__builtin_return_address(0));
+}
+
+void *heapReallocate(void *mem, uint64_t size)
+{
+    virtual_address_t site = (virtual_address_t)__builtin_return_address(0);
+
+    if (!mem)
+        return heapAllocateFrom(size, HEAP_CHUNK_ALIGNMENT, site);
+
+    if (size == 0)
+    {
+        heapFree(mem);
+        return NULL;
+    }
+
+    k_heap_chunk *chunk = HEAP_CHUNK_OF(mem);
+    uint64_t oldSize;
+    if (chunk->header & HEAP_CHUNK_LARGE)
+    {
+        // The pages of a large allocation may already have room
+        oldSize = heapLargeUsableSize(chunk);
+        if (size <= oldSize)
+            return mem;
+    }
+    else
+    {
+        uint64_t rflags = interruptsSave();
+        heapLock.lock();
+
+        // The chunk keeps its tag, so the change is counted to the site that allocated it
+        oldSize = heapAllocator.usableSize(mem);
+        bool resized = heapAllocator.resize(mem, size);
+        if (resized)
+            heapAccountBytes(&heapCallsites[HEAP_CHUNK_TAG(chunk)], oldSize, heapAllocator.usableSize(mem));
+
+        heapLock.unlock();
+        interruptsRestore(rflags);
+
+        if (resized)
+            return mem;
+    }
+
+    // Move the allocation
+    void *moved = heapAllocateFrom(size, HEAP_CHUNK_ALIGNMENT, site);
+    memcpy(moved, mem, oldSize < size ? oldSize : size);
+    heapFree(mem);
+
+    return moved;
+}
+
+void heapSetGrowthPolicy(k_heap_growth_policy policy, uint64_t step)
+{
+    uint64_t rflags = interruptsSave();
+    heapLock.lock();
+    heapGrowthPolicy = policy;
+    heapGrowthStep = step < PAGE_SIZE ? PAGE_SIZE : PAGING_ALIGN_PAGE_UP(step);
+    heapLock.unlock();
+    interruptsRestore(rflags);
+}
+
+/**
+ * @brief How much the heap grows by at its current size, trimming leaves as much
+ * free at its end so a trim isn't undone by the next expansion.
+ */
+static uint64_t heapGrowthAmount()
+{
+    uint64_t amount = heapGrowthStep;
+    if (heapGrowthPolicy == HEAP_GROWTH_GEOMETRIC && (heapEnd - heapStart) / 2 > amount)
+        amount = PAGING_ALIGN_PAGE_UP((heapEnd - heapStart) / 2);
+    return amount;
+}
+
+bool heapExpand(uint64_t size)
 {
     if (!heapInitialized)
         kernelPanic("%! An attempt to expand an uninitialized heap has occurred.", "[Kernel Heap]");
 
-    if (heapEnd + K_HEAP_EXPANSION_STEP > K_CONST_HEAP_MAX_EXPANSION)
+    // The pages above the end may still be mapped
+    if (heapTrimSize)
+        return false;
+
+    uint64_t amount = heapGrowthAmount();
+    if (amount < size)
+        amount = PAGING_ALIGN_PAGE_UP(size);
+
+    // Near the limit, settle for what is left as long as the request fits
+    if (heapEnd + amount > K_CONST_HEAP_MAX_EXPANSION)
+        amount = K_CONST_HEAP_MAX_EXPANSION - heapEnd;
+    if (amount < size)
     {
         logWarnn("%! Kernel heap has ran out of memory", "[Kernel Heap]");
         return false;
     }
 
-    for (virtual_address_t virt = heapStart; virt < heapEnd + K_HEAP_EXPANSION_STEP; virt += PAGE_SIZE)
+    // Only the new window needs memory, the rest of the heap is already mapped
+    if (!pagingAllocateMemoryInTable(heapEnd, amount, pagingGetCurrentSpace()))
     {
-        physical_address_t phys = memoryPhysicalAllocator.allocatePage();
-        if (phys == 0)
-        {
-            logWarnn("%! Failed to expand heap, out of physical memory.", "[Kernel Heap]");
-            return false;
-        }
-
-        pagingMapPage(virt, phys);
+        logWarnn("%! Failed to expand heap, out of physical memory.", "[Kernel Heap]");
+        return false;
     }
 
-    heapAllocator.expand(K_HEAP_EXPANSION_STEP);
-    heapEnd += K_HEAP_EXPANSION_STEP;
+    heapAllocator.expand(amount);
+    heapEnd += amount;
 
     #ifdef VERBOSE_HEAP
         logDebugn("%! Heap has expanded by %d %s, up to 0x%64x (%d %s in use)",
                   "[Kernel Heap]",
-                  K_MEMORY_SIZE(K_HEAP_EXPANSION_STEP),
-                  K_MEMORY_UNIT(K_HEAP_EXPANSION_STEP),
+                  K_MEMORY_SIZE(amount),
+                  K_MEMORY_UNIT(amount),
                   heapEnd,
                   K_MEMORY_SIZE(heapUsed),
                   K_MEMORY_UNIT(heapUsed));
@@ -107,22 +353,182 @@ bool heapExpand()
     return true;
 }
 
+uint64_t heapTrim()
+{
+    if (heapTrimSize)
+        return 0;
+
+    uint64_t trailing = heapAllocator.trailingFree();
+    uint64_t keep = heapGrowthAmount();
+    if (trailing <= K_HEAP_TRIM_THRESHOLD || trailing <= keep)
+        return 0;
+
+    // Keep what the next expansion would add, and whole pages only
+    uint64_t amount = PAGING_ALIGN_PAGE_DOWN(trailing - keep);
+    if (heapEnd - amount < heapMinimumEnd)
+        amount = heapEnd - heapMinimumEnd;
+    if (!amount)
+        return 0;
+
+    heapAllocator.shrink(amount);
+    heapEnd -= amount;
+    heapTrimBase = heapEnd;
+    heapTrimSize = amount;
+
+    #ifdef VERBOSE_HEAP
+        logDebugn("%! Heap has shrunk by %d %s, down to 0x%64x",
+                  "[Kernel Heap]",
+                  K_MEMORY_SIZE(amount),
+                  K_MEMORY_UNIT(amount),
+                  heapEnd);
+    #endif
+    return amount;
+}
+
+void heapFinishTrim()
+{
+    // The unmap ends with a TLB shootdown, the other processors answer it once they aren't
+    // spinning on the heap's lock
+    pagingFreeMemoryInTable(heapTrimBase, heapTrimSize, pagingGetCurrentSpace());
+
+    __sync_synchronize();
+    heapTrimSize = 0;
+}
+
 void heapFree(void *mem)
 {
     if (!heapInitialized)
         kernelPanic("%! An attempt to free memory with uninitialized heap has occurred.", "[Kernel Heap]");
 
-    heapUsed -= heapAllocator.free(mem);
+    if (!mem)
+        return;
+
+    k_heap_chunk *chunk = HEAP_CHUNK_OF(mem);
+    if ((chunk->header & HEAP_CHUNK_LARGE) && (chunk->header & HEAP_CHUNK_USED))
+    {
+        uint64_t rflags = interruptsSave();
+        heapLock.lock();
+        heapAccountFree(chunk, heapLargeUsableSize(chunk));
+        heapLock.unlock();
+        interruptsRestore(rflags);
+
+        heapFreeLarge(chunk);
+        return;
+    }
+
+    uint64_t rflags = interruptsSave();
+    heapLock.lock();
+    uint64_t trimmed = 0;
+    if (chunk->header & HEAP_CHUNK_USED)
+    {
+        heapAccountFree(chunk, heapAllocator.usableSize(mem));
+        heapAllocator.free(mem);
+        trimmed = heapTrim();
+    }
+    heapLock.unlock();
+    interruptsRestore(rflags);
+
+    if (trimmed)
+        heapFinishTrim();
+}
+
+uint64_t heapLargestFreeBlock()
+{
+    uint64_t rflags = interruptsSave();
+    heapLock.lock();
+    uint64_t largest = heapAllocator.largestFree();
+    heapLock.unlock();
+    interruptsRestore(rflags);
+
+    return largest > HEAP_CHUNK_OVERHEAD ? largest - HEAP_CHUNK_OVERHEAD : 0;
+}
+
+void heapReport(k_heap_report_writer writer, void *context)
+{
+    uint64_t chunks[K_HEAP_HISTOGRAM_BUCKETS];
+    uint64_t bytes[K_HEAP_HISTOGRAM_BUCKETS];
+    k_heap_callsite top[K_HEAP_REPORT_CALLSITES];
+    uint64_t topCount = 0;
+
+    // Take a snapshot, the writer may allocate
+    uint64_t rflags = interruptsSave();
+    heapLock.lock();
+
+    uint64_t size = heapEnd - heapStart;
+    uint64_t used = heapUsed;
+    uint64_t peak = heapPeakUsed;
+    uint64_t largest = heapAllocator.largestFree();
+    heapAllocator.freeHistogram(chunks, bytes, K_HEAP_HISTOGRAM_BUCKETS);
+
+    // Select the sites that hold the most memory, in order
+    bool taken[K_HEAP_CALLSITE_COUNT];
+    memset(taken, 0, sizeof(taken));
+    while (topCount < K_HEAP_REPORT_CALLSITES)
+    {
+        uint64_t best = K_HEAP_CALLSITE_COUNT;
+        for (uint64_t i = 0; i < K_HEAP_CALLSITE_COUNT; i++)
+            if (!taken[i] && heapCallsites[i].allocations &&
+                (best == K_HEAP_CALLSITE_COUNT || heapCallsites[i].bytes > heapCallsites[best].bytes))
+                best = i;
+
+        if (best == K_HEAP_CALLSITE_COUNT)
+            break;
+        taken[best] = true;
+        top[topCount++] = heapCallsites[best];
+    }
+
+    heapLock.unlock();
+    interruptsRestore(rflags);
+
+    char line[K_HEAP_REPORT_LINE];
+    snprintf(line, sizeof(line), "heap: %lu bytes, %lu used (peak %lu), largest free block %lu",
+             size, used, peak, largest > HEAP_CHUNK_OVERHEAD ? largest - HEAP_CHUNK_OVERHEAD : 0);
+    writer(context, line);
+
+    writer(context, "free chunks:");
+    for (uint64_t i = 0; i < K_HEAP_HISTOGRAM_BUCKETS; i++)
+    {
+        if (!chunks[i])
+            continue;
+        snprintf(line, sizeof(line), "  %lu-%lu: %lu chunks, %lu bytes",
+                 (uint64_t)1 << i, ((uint64_t)2 << i) - 1, chunks[i], bytes[i]);
+        writer(context, line);
+    }
+
+    writer(context, "call sites:");
+    for (uint64_t i = 0; i < topCount; i++)
+    {
+        if (top[i].site)
+            snprintf(line, sizeof(line), "  0x%016lx: %lu bytes (peak %lu), %lu allocations, %lu frees",
+                     top[i].site, top[i].bytes, top[i].peakBytes, top[i].allocations, top[i].frees);
+        else
+            snprintf(line, sizeof(line), "  other: %lu bytes (peak %lu), %lu allocations, %lu frees",
+                     top[i].bytes, top[i].peakBytes, top[i].allocations, top[i].frees);
+        writer(context, line);
+    }
+}
+
+/**
+ * @brief Log a line of the heap's report
+ */
+static void heapLogLine(void *context, const char *line)
+{
+    logInfon("%! %s", "[Kernel Heap]", line);
+}
+
+void heapDumpStatistics()
+{
+    heapReport(heapLogLine, NULL);
 }
 
 void *operator new(size_t count)
 {
-    return heapAllocate(count);
+    return heapAllocateFrom(count, HEAP_CHUNK_ALIGNMENT, (virtual_address_t)__builtin_return_address(0));
 }
 
 void *operator new[](size_t count)
 {
-    return heapAllocate(count);
+    return heapAllocateFrom(count, HEAP_CHUNK_ALIGNMENT, (virtual_address_t)__builtin_return_address(0));
 }
 
 void operator delete(void *ptr)
@@ -133,4 +539,4 @@ void operator delete(void *ptr)
 void operator delete[](void *ptr)
 {
     heapFree(ptr);
-}
\ No newline at end of file
+}
@@ -44,12 +44,12 @@ void memoryInitialize(stivale2_struct *stivale2Info)
 
     logDebugn("%! Done initializing paging", "[Memory]");
 
-    // Map the heap's memory
-    for (virtual_address_t virt = K_CONST_HEAP_DEFAULT_START; virt < K_CONST_HEAP_DEFAULT_END; virt += PAGE_SIZE)
-    {
-        physical_address_t phys = memoryPhysicalAllocator.allocatePage();
-        pagingMapPage(virt, phys);
-    }
+    // Map the heap's memory, as a single physically contiguous run
+    uint64_t heapSize = K_CONST_HEAP_DEFAULT_END - K_CONST_HEAP_DEFAULT_START;
+    physical_address_t heapPhys = memoryPhysicalAllocator.allocatePages(heapSize / PAGE_SIZE);
+    if (!heapPhys)
+        kernelPanic("%! Couldn't allocate physical memory for the kernel's heap.", "[Memory]");
+    pagingMapMemory(K_CONST_HEAP_DEFAULT_START, heapPhys, heapSize);
 
     // Initialize the kernel's heap
     heapInitialize(K_CONST_HEAP_DEFAULT_START, K_CONST_HEAP_DEFAULT_END);
@@ -57,5 +57,9 @@ void memoryInitialize(stivale2_struct *stivale2Info)
     // Initialize the kernel's virtual address ranges allocator
     virtualAddressRangeAllocator.addRange(K_CONST_KERNEL_VIRTUAL_RANGES_START, K_CONST_KERNEL_VIRTUAL_RANGES_END);
 
+#ifdef BENCHMARK_PHYSICAL_ALLOCATOR
+    bitmapAllocatorBenchmark(&memoryPhysicalAllocator);
+#endif
+
     logDebugn("%! Kernel memory has been initialized successfully.", "[Memory]");
 }
@@ -4,9 +4,134 @@
 #include <kernel.hpp>
 #include <strings.hpp>
 #include <types.hpp>
+#include <constants.hpp>
 #include <logger/logger.hpp>
+#include <system/processor/processor.hpp>
+#include <memory/tlb.hpp>
+#include <memory/pcid.hpp>
+#include <interrupts/interrupts.hpp>
+
+// Whether the processor supports 1GiB pages, checked by pagingInitialize
+static bool pagingHas1GiBPages = false;
+
+// The PML4 created by pagingInitialize
+static physical_address_t pagingKernelSpace = 0;
+
+/**
+ * @brief Replace a large page entry with a table of smaller pages that maps the same memory.
+ *
+ * @param entry The large page entry
+ * @param entrySize The size of the memory the entry maps
+ * @return pagetable_entry_t* The new table
+ */
+static pagetable_entry_t *pagingSplitEntry(pagetable_entry_t *entry, uint64_t entrySize)
+{
+    physical_address_t tablePhys = memoryPhysicalAllocator.allocatePage();
+    if (!tablePhys)
+        kernelPanic("%! Couldn't allocate a page table to split a large page.", "[Paging]");
+    memoryPhysicalAllocator.getPage(tablePhys)->flags |= PAGE_FRAME_PAGETABLE;
+    pagetable_entry_t *table = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(tablePhys);
+
+    uint64_t childSize = entrySize / PAGETABLE_SIZE;
+    physical_address_t base = PAGING_LARGE_ADDRESS(*entry, entrySize);
+    pagetable_entry_t childFlags = *entry & PAGING_LEAF_FLAGS_MASK;
+
+    // 4KiB entries have no size bit, and their PAT bit takes its place
+    if (childSize == PAGE_SIZE)
+    {
+        bool pat = CHECK_FLAG(childFlags, PAGE_LARGE_PAT);
+        UNSET_FLAG(childFlags, (PAGETABLE_PAGE_SIZE | PAGE_LARGE_PAT));
+        if (pat)
+            SET_FLAG(childFlags, PAGE_PAT);
+    }
+
+    for (uint64_t i = 0; i < PAGETABLE_SIZE; i++)
+        table[i] = (base + i * childSize) | childFlags;
+
+    // The table keeps the access rights of the large page
+    *entry = tablePhys | (*entry & (PAGETABLE_PRESENT | PAGETABLE_READWRITE | PAGETABLE_USERSUPER | PAGETABLE_EXEC));
+
+#ifdef VERBOSE_PAGING
+    logDebugn("\t- Split a large page of %m at 0x%64x", entrySize, base);
+#endif
+
+    return table;
+}
+
+/**
+ * @brief Get the table an entry points to, create it if the entry isn't present,
+ * and split it if the entry maps a large page.
+ *
+ * @param table The table that holds the entry
+ * @param index The index of the entry
+ * @param entrySize The size of the memory the entry maps
+ * @param flags The flags for the entry
+ * @param override Whether or not to override the flags of an existing entry
+ * @return pagetable_entry_t* The next table
+ */
+static pagetable_entry_t *pagingGetNextTable(pagetable_entry_t *table, uint64_t index, uint64_t entrySize,
+                                             pagetable_flags_t flags, bool override)
+{
+    pagetable_entry_t entry = table[index];
+    pagetable_entry_t *next;
+
+    if (!(entry & PAGETABLE_PRESENT))
+    {
+        physical_address_t nextPhys = memoryPhysicalAllocator.allocateZeroedPage();
+        if (!nextPhys)
+            kernelPanic("%! Couldn't allocate a page table.", "[Paging]");
+        next = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(nextPhys);
+
+        // The kernel's tables are shared by every core, so install the table only
+        // if no other core installed one for this entry in the meantime
+        if (__sync_bool_compare_and_swap(&table[index], entry, nextPhys | flags))
+        {
+            memoryPhysicalAllocator.getPage(nextPhys)->flags |= PAGE_FRAME_PAGETABLE;
+#ifdef VERBOSE_PAGING
+            logDebugn("\t- Table was created at 0x%64x", next);
+#endif
+            return next;
+        }
+
+        memoryPhysicalAllocator.freePage(nextPhys);
+        entry = table[index];
+    }
+
+    if (entry & PAGETABLE_PAGE_SIZE)
+        next = pagingSplitEntry(&table[index], entrySize);
+    else
+        next = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(entry));
+
+    // If override is on we will override the flags of the table
+    if (override)
+    {
+        table[index] = ADDRESS_EXCLUDE(table[index]) | flags;
+#ifdef VERBOSE_PAGING
+        logDebugn("\t- Table was overriden at 0x%64x", next);
+#endif
+    }
+
+    return next;
+}
+
+/**
+ * @brief Free a page table and all of the tables under it, the mapped pages aren't freed.
+ *
+ * @param tablePhys The physical address of the table
+ * @param entrySize The size of the memory each entry of the table maps
+ */
+static void pagingFreeTable(physical_address_t tablePhys, uint64_t entrySize)
+{
+    pagetable_entry_t *table = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(tablePhys);
+
+    if (entrySize > PAGE_SIZE)
+        for (uint64_t i = 0; i < PAGETABLE_SIZE; i++)
+            if (CHECK_FLAG(table[i], PAGETABLE_PRESENT) && !CHECK_FLAG(table[i], PAGETABLE_PAGE_SIZE))
+                pagingFreeTable(ADDRESS_EXCLUDE(table[i]), entrySize / PAGETABLE_SIZE);
+
+    memoryPhysicalAllocator.freePage(tablePhys);
+}
 
-// TODO: checking that the allocateBlock() returned a valid address
 // TODO: checking addresses alignment
 void pagingMapPageInSpace(virtual_address_t virt, physical_address_t phys,
                           physical_address_t pml4Addr,
@@ -20,144 +145,120 @@ void pagingMapPageInSpace(virtual_address_t virt, physical_address_t phys,
                   "[Paging]", virt, phys, pml4Addr);
                   #endif
 
-    // Creating PDPT
     pagetable_entry_t *pml4 = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(pml4Addr);
-    pagetable_entry_t pml4e = pml4[PML4_INDEXER(virt)];
+    pagetable_entry_t *pdpt = pagingGetNextTable(pml4, PML4_INDEXER(virt), PAGING_PML4E_SIZE, flags.pml4Flags, override);
+    pagetable_entry_t *pd = pagingGetNextTable(pdpt, PDPT_INDEXER(virt), PAGE_HUGE_SIZE, flags.pdptFlags, override);
+    pagetable_entry_t *pt = pagingGetNextTable(pd, PD_INDEXER(virt), PAGE_LARGE_SIZE, flags.pdFlags, override);
+
+    // Creating the page
+    pagetable_entry_t pte = pt[PT_INDEXER(virt)];
     #ifdef VERBOSE_PAGING
-        logDebugn("\t- PML4 entry indexed %d", PML4_INDEXER(virt));
+        logDebugn("\t- PT entry indexed %d", PT_INDEXER(virt));
         #endif
-    pagetable_entry_t *pdpt;
 
-    if (!(pml4e & PAGETABLE_PRESENT))
-    {
-        pml4e |= flags.pml4Flags;
-        pdpt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(memoryPhysicalAllocator.allocatePage());
-        memset((char *)pdpt, 0, PAGE_SIZE);
-        pml4e |= (uint64_t)PAGING_REMOVE_DIRECTMAP(pdpt);
-        pml4[PML4_INDEXER(virt)] = pml4e;
-        #ifdef VERBOSE_PAGING
-            logDebugn("\t- PDPT was created at 0x%64x", pdpt);
-            #endif
-    }
-    else
+    // Whether if override is on or the page isn't present, set the flags and the address.
+    if (!(pte & PAGE_PRESENT) || override)
     {
-        // Page directory pointer table is present, retrieve the address
-        pdpt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pml4e));
-        // If override is on we will override the flags of the table
-        if (override)
-        {
-            pml4e &= (~((pagetable_entry_t)0)) << 12;
-            pml4e |= flags.pml4Flags;
-            pml4[PML4_INDEXER(virt)] = pml4e;
-            #ifdef VERBOSE_PAGING
-                logDebugn("\t- PDPT was overriden at 0x%64x", pdpt);
-                #endif
-        }
-        else
+        pt[PT_INDEXER(virt)] = flags.ptFlags | phys;
+
+        // The old translation may still be cached
+        if (pte & PAGE_PRESENT)
         {
-            #ifdef VERBOSE_PAGING
-                logDebugn("\t- PDPT was already at 0x%64x", pdpt);
-                #endif
+            k_tlb_batch batch(pml4Addr);
+            batch.add(virt);
+            batch.flush();
         }
+        #ifdef VERBOSE_PAGING
+            logDebugn("\t- PT was created/overriden at 0x%64x", phys);
+            #endif
     }
+}
 
-    // Creating PD
-    pagetable_entry_t pdpte = pdpt[PDPT_INDEXER(virt)];
-    #ifdef VERBOSE_PAGING
-        logDebugn("\t- PDPT entry indexed %d", PDPT_INDEXER(virt));
-        #endif
-    pagetable_entry_t *pd;
+bool pagingMapLargePageInSpace(virtual_address_t virt, physical_address_t phys, uint64_t pageSize,
+                               physical_address_t pml4Addr,
+                               k_paging_flags flags,
+                               bool override)
+{
+    if (pageSize != PAGE_LARGE_SIZE && pageSize != PAGE_HUGE_SIZE)
+        return false;
+    if (pageSize == PAGE_HUGE_SIZE && !pagingHas1GiBPages)
+        return false;
+    if ((virt | phys) & (pageSize - 1))
+        return false;
 
-    if (!(pdpte & PAGETABLE_PRESENT))
+    pagetable_entry_t *pml4 = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(pml4Addr);
+    pagetable_entry_t *pdpt = pagingGetNextTable(pml4, PML4_INDEXER(virt), PAGING_PML4E_SIZE, flags.pml4Flags, override);
+
+    pagetable_entry_t *table = pdpt;
+    uint64_t index = PDPT_INDEXER(virt);
+    if (pageSize == PAGE_LARGE_SIZE)
     {
-        pdpte |= flags.pdptFlags;
-        pd = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(memoryPhysicalAllocator.allocatePage());
-        memset((char *)pd, 0, PAGE_SIZE);
-        pdpte |= (uint64_t)PAGING_REMOVE_DIRECTMAP(pd);
-        pdpt[PDPT_INDEXER(virt)] = pdpte;
-        #ifdef VERBOSE_PAGING
-            logDebugn("\t- PD was created at 0x%64x", pd);
-            #endif
+        table = pagingGetNextTable(pdpt, PDPT_INDEXER(virt), PAGE_HUGE_SIZE, flags.pdptFlags, override);
+        index = PD_INDEXER(virt);
     }
-    else
+
+    pagetable_entry_t entry = table[index];
+    if (entry & PAGETABLE_PRESENT)
     {
-        // Page directory is present, retrieve the address
-        pd = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pdpte));
-        // If override is on we will override the flags of the table
-        if (override)
-        {
-            pdpte &= (~((pagetable_entry_t)0)) << 12;
-            pdpte |= flags.pdptFlags;
-            pdpt[PDPT_INDEXER(virt)] = pdpte;
-            #ifdef VERBOSE_PAGING
-                logDebugn("\t- PD was overriden at 0x%64x", pd);
-                #endif
-        }
-        else
-        {
-            #ifdef VERBOSE_PAGING
-                logDebugn("\t- PDPT was already at 0x%64x", pd);
-                #endif
-        }
+        // Some of the range is already mapped, it has to be mapped with smaller pages
+        if (!override)
+            return false;
+
+        // The smaller pages are replaced, their tables aren't needed anymore
+        if (!(entry & PAGETABLE_PAGE_SIZE))
+            pagingFreeTable(ADDRESS_EXCLUDE(entry), pageSize / PAGETABLE_SIZE);
     }
 
-    // Creating PT
-    pagetable_entry_t pde = pd[PD_INDEXER(virt)];
-    #ifdef VERBOSE_PAGING
-        logDebugn("\t- PD entry indexed %d", PD_INDEXER(virt));
-        #endif
-    pagetable_entry_t *pt;
+    // In large pages the PAT bit is moved to make room for the size bit
+    pagetable_entry_t leafFlags = flags.ptFlags | PAGETABLE_PAGE_SIZE;
+    if (CHECK_FLAG(flags.ptFlags, PAGE_PAT))
+        SET_FLAG(leafFlags, PAGE_LARGE_PAT);
 
-    if (!(pde & PAGETABLE_PRESENT))
+    table[index] = phys | leafFlags;
+
+    // The old translations may still be cached
+    if (entry & PAGETABLE_PRESENT)
     {
-        pde |= flags.pdFlags;
-        pt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(memoryPhysicalAllocator.allocatePage());
-        memset((char *)pt, 0, PAGE_SIZE);
-        pde |= (uint64_t)PAGING_REMOVE_DIRECTMAP(pt);
-        pd[PD_INDEXER(virt)] = pde;
-        #ifdef VERBOSE_PAGING
-            logDebugn("\t- PT was created at 0x%64x", pt);
-            #endif
+        k_tlb_batch batch(pml4Addr);
+        batch.addRange(virt, pageSize / PAGE_SIZE);
+        batch.flush();
     }
-    else
+
+#ifdef VERBOSE_PAGING
+    logDebugn("%! Mapped a large page of %m from 0x%64x to 0x%64x", "[Paging]", pageSize, virt, phys);
+#endif
+
+    return true;
+}
+
+bool pagingSplitLargePage(virtual_address_t virt, physical_address_t pml4Addr)
+{
+    pagetable_entry_t *pml4 = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(pml4Addr);
+
+    pagetable_entry_t pml4e = pml4[PML4_INDEXER(virt)];
+    if (!(pml4e & PAGETABLE_PRESENT))
+        return false;
+    pagetable_entry_t *pdpt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pml4e));
+
+    bool split = false;
+    pagetable_entry_t *pd;
+    if (!(pdpt[PDPT_INDEXER(virt)] & PAGETABLE_PRESENT))
+        return false;
+    if (pdpt[PDPT_INDEXER(virt)] & PAGETABLE_PAGE_SIZE)
     {
-        // Page table is present, retrieve the address
-        pt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pde));
-        // If override is on we will override the flags of the table
-        if (override)
-        {
-            pde &= (~((pagetable_entry_t)0)) << 12;
-            pde |= flags.pdFlags;
-            pd[PD_INDEXER(virt)] = pde;
-            #ifdef VERBOSE_PAGING
-                logDebugn("\t- PT was overriden at 0x%64x", pt);
-                #endif
-        }
-        else
-        {
-            #ifdef VERBOSE_PAGING
-                logDebugn("\t- PT was already at 0x%64x", pt);
-                #endif
-        }
+        pd = pagingSplitEntry(&pdpt[PDPT_INDEXER(virt)], PAGE_HUGE_SIZE);
+        split = true;
     }
+    else
+        pd = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pdpt[PDPT_INDEXER(virt)]));
 
-    // Creating the page
-    pagetable_entry_t pte = pt[PT_INDEXER(virt)];
-    #ifdef VERBOSE_PAGING
-        logDebugn("\t- PT entry indexed %d", PT_INDEXER(virt));
-        #endif
-
-    // Whether if override is on or the page isn't present, set the flags and the address.
-    if (!(pte & PAGE_PRESENT) || override)
+    if ((pd[PD_INDEXER(virt)] & PAGETABLE_PRESENT) && (pd[PD_INDEXER(virt)] & PAGETABLE_PAGE_SIZE))
     {
-        memset(&pte, 0, sizeof(pagetable_entry_t));
-        pte |= flags.ptFlags;
-        pte |= phys;
-        pt[PT_INDEXER(virt)] = pte;
-        #ifdef VERBOSE_PAGING
-            logDebugn("\t- PT was created/overriden at 0x%64x", ADDRESS_EXCLUDE(pte));
-            #endif
+        pagingSplitEntry(&pd[PD_INDEXER(virt)], PAGE_LARGE_SIZE);
+        split = true;
     }
+
+    return split;
 }
 
 void pagingMapPage(virtual_address_t virt, physical_address_t phys,
@@ -167,16 +268,88 @@ void pagingMapPage(virtual_address_t virt, physical_address_t phys,
     pagingMapPageInSpace(virt, phys, (physical_address_t)pagingGetCurrentSpace(), flags, override);
 }
 
+/**
+ * @brief Map consecutive 4KiB pages, up to the end of the page table that holds the
+ * first one, the tables are walked once for the whole run.
+ *
+ * @param virt The first virtual address
+ * @param phys The first physical address, used if pages is NULL
+ * @param pages The physical pages to map, NULL to map consecutive physical memory
+ * @param count How many pages are left to map
+ * @param batch Receives the pages whose old translation has to be invalidated
+ * @param skipped If not NULL, receives for each page the physical page that wasn't mapped
+ * because the slot was already present, and 0 for the pages that were mapped
+ * @return uint64_t How many pages were mapped
+ */
+static uint64_t pagingMapTableRun(virtual_address_t virt, physical_address_t phys, const physical_address_t *pages,
+                                  uint64_t count, physical_address_t pml4Addr,
+                                  k_paging_flags flags, bool override, k_tlb_batch *batch,
+                                  physical_address_t *skipped = NULL)
+{
+    pagetable_entry_t *pml4 = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(pml4Addr);
+    pagetable_entry_t *pdpt = pagingGetNextTable(pml4, PML4_INDEXER(virt), PAGING_PML4E_SIZE, flags.pml4Flags, override);
+    pagetable_entry_t *pd = pagingGetNextTable(pdpt, PDPT_INDEXER(virt), PAGE_HUGE_SIZE, flags.pdptFlags, override);
+    pagetable_entry_t *pt = pagingGetNextTable(pd, PD_INDEXER(virt), PAGE_LARGE_SIZE, flags.pdFlags, override);
+
+    uint64_t index = PT_INDEXER(virt);
+    uint64_t run = PAGETABLE_SIZE - index;
+    if (run > count)
+        run = count;
+
+    for (uint64_t i = 0; i < run; i++)
+    {
+        // Whether if override is on or the page isn't present, set the flags and the address.
+        pagetable_entry_t pte = pt[index + i];
+        physical_address_t page = pages ? pages[i] : phys + i * PAGE_SIZE;
+        if (!(pte & PAGE_PRESENT) || override)
+        {
+            pt[index + i] = flags.ptFlags | page;
+            if (pte & PAGE_PRESENT)
+                batch->add(virt + i * PAGE_SIZE);
+            page = 0;
+        }
+
+        if (skipped)
+            skipped[i] = page;
+    }
+
+#ifdef VERBOSE_PAGING
+    logDebugn("%! Mapped %d pages from 0x%64x", "[Paging]", run, virt);
+#endif
+
+    return run;
+}
+
 void pagingMapMemoryInTable(virtual_address_t virt, physical_address_t phys, uint64_t size,
                             physical_address_t pml4Addr,
                             k_paging_flags flags,
                             bool override)
 {
     // TODO: check alignment
-    for (uint64_t offset = 0; offset < size; offset += PAGE_SIZE)
+    k_tlb_batch batch(pml4Addr);
+    uint64_t offset = 0;
+    while (offset < size)
     {
-        pagingMapPageInSpace(virt + offset, phys + offset, pml4Addr, flags, override);
+        // Use the largest page that the alignment and the remaining size allow
+        uint64_t pageSize = PAGE_HUGE_SIZE;
+        while (pageSize > PAGE_SIZE)
+        {
+            if (size - offset >= pageSize &&
+                pagingMapLargePageInSpace(virt + offset, phys + offset, pageSize, pml4Addr, flags, override))
+                break;
+            pageSize /= PAGETABLE_SIZE;
+        }
+
+        // Otherwise fill 4KiB pages up to the end of the page table, where a large page may fit again
+        if (pageSize == PAGE_SIZE)
+            offset += PAGE_SIZE * pagingMapTableRun(virt + offset, phys + offset, NULL,
+                                                    PAGING_ALIGN_PAGE_UP(size - offset) / PAGE_SIZE,
+                                                    pml4Addr, flags, override, &batch);
+        else
+            offset += pageSize;
     }
+
+    batch.flush();
 }
 
 void pagingMapMemory(virtual_address_t virt, physical_address_t phys, uint64_t size,
@@ -186,100 +359,384 @@ void pagingMapMemory(virtual_address_t virt, physical_address_t phys, uint64_t s
     pagingMapMemoryInTable(virt, phys, size, pagingGetCurrentSpace(), flags, override);
 }
 
+void pagingMapPagesInTable(virtual_address_t virt, const physical_address_t *pages, uint64_t count,
+                           physical_address_t pml4Addr,
+                           k_paging_flags flags,
+                           bool override)
+{
+    k_tlb_batch batch(pml4Addr);
+    uint64_t mapped = 0;
+    while (mapped < count)
+        mapped += pagingMapTableRun(virt + mapped * PAGE_SIZE, 0, &pages[mapped], count - mapped,
+                                    pml4Addr, flags, override, &batch);
+    batch.flush();
+}
+
+bool pagingAllocateMemoryInTable(virtual_address_t virt, uint64_t size,
+                                 physical_address_t pml4Addr,
+                                 k_paging_flags flags)
+{
+    physical_address_t pages[PAGING_BATCH_PAGES];
+
+    uint64_t count = PAGING_ALIGN_PAGE_UP(size) / PAGE_SIZE;
+    for (uint64_t done = 0; done < count; done += PAGING_BATCH_PAGES)
+    {
+        uint64_t batch = count - done;
+        if (batch > PAGING_BATCH_PAGES)
+            batch = PAGING_BATCH_PAGES;
+
+        uint64_t allocated = memoryPhysicalAllocator.allocatePageList(pages, batch);
+        if (allocated != batch)
+        {
+            // Out of physical memory, undo everything
+            memoryPhysicalAllocator.freePageList(pages, allocated);
+            pagingFreeMemoryInTable(virt, done * PAGE_SIZE, pml4Addr);
+            return false;
+        }
+
+        // The slots that are already mapped keep their pages, the new pages for them are
+        // left in the list and go back to the physical allocator
+        k_tlb_batch tlbBatch(pml4Addr);
+        uint64_t mapped = 0;
+        while (mapped < batch)
+            mapped += pagingMapTableRun(virt + (done + mapped) * PAGE_SIZE, 0, &pages[mapped], batch - mapped,
+                                        pml4Addr, flags, false, &tlbBatch, &pages[mapped]);
+        tlbBatch.flush();
+
+        for (uint64_t i = 0; i < batch; i++)
+        {
+            if (pages[i])
+            {
+                memoryPhysicalAllocator.freePageList(pages, batch);
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+void pagingFreeMemoryInTable(virtual_address_t virt, uint64_t size, physical_address_t pml4Addr)
+{
+    physical_address_t pages[PAGING_BATCH_PAGES];
+
+    uint64_t count = PAGING_ALIGN_PAGE_UP(size) / PAGE_SIZE;
+    for (uint64_t done = 0; done < count; done += PAGING_BATCH_PAGES)
+    {
+        uint64_t batch = count - done;
+        if (batch > PAGING_BATCH_PAGES)
+            batch = PAGING_BATCH_PAGES;
+
+        pagingUnmapMemoryInTable(virt + done * PAGE_SIZE, batch * PAGE_SIZE, pml4Addr, pages);
+        memoryPhysicalAllocator.freePageList(pages, batch);
+    }
+}
+
 bool pagingIsPagetableEmpty(pagetable_entry_t *pagetable)
 {
-    for (int i; i < PAGETABLE_SIZE; i++)
+    for (int i = 0; i < PAGETABLE_SIZE; i++)
         if (CHECK_FLAG(pagetable[i], PAGETABLE_PRESENT))
             return false;
     return true;
 }
 
-physical_address_t pagingUnmapPageInSpace(virtual_address_t virt, physical_address_t pml4Addr) {
+/**
+ * @brief Free the tables on the way to a virtual address that became empty,
+ * from the page table up to the PDPT.
+ */
+static void pagingReleaseEmptyTables(virtual_address_t virt, pagetable_entry_t *pml4,
+                                     pagetable_entry_t *pdpt, pagetable_entry_t *pd, pagetable_entry_t *pt)
+{
+    if (!pagingIsPagetableEmpty(pt))
+        return;
+
+    // Free the PT space, and unset the PD entry
+    memoryPhysicalAllocator.freePage(ADDRESS_EXCLUDE(pd[PD_INDEXER(virt)]));
+    pd[PD_INDEXER(virt)] = 0;
+
+    if (!pagingIsPagetableEmpty(pd))
+        return;
+
+    // Free the PD space, and unset the PDPT entry
+    memoryPhysicalAllocator.freePage(ADDRESS_EXCLUDE(pdpt[PDPT_INDEXER(virt)]));
+    pdpt[PDPT_INDEXER(virt)] = 0;
+
+    // The kernel's PDPTs are shared by all of the spaces, so they are never freed
+    if (PML4_INDEXER(virt) >= PAGETABLE_SIZE / 2 || !pagingIsPagetableEmpty(pdpt))
+        return;
+
+    // Free the PDPT space, and unset the PML4 entry
+    memoryPhysicalAllocator.freePage(ADDRESS_EXCLUDE(pml4[PML4_INDEXER(virt)]));
+    pml4[PML4_INDEXER(virt)] = 0;
+}
+
+/**
+ * @brief Skip the pages up to the end of the memory a missing entry would map.
+ *
+ * @param entrySize The size of the memory the missing entry maps
+ * @return uint64_t How many pages were skipped
+ */
+static uint64_t pagingSkipRun(virtual_address_t virt, uint64_t entrySize, uint64_t count, physical_address_t *pages)
+{
+    uint64_t run = (entrySize - (virt & (entrySize - 1))) / PAGE_SIZE;
+    if (run > count)
+        run = count;
+    if (pages)
+        memset((char *)pages, 0, run * sizeof(physical_address_t));
+    return run;
+}
+
+/**
+ * @brief Unmap consecutive 4KiB pages, up to the end of the table that holds the first one,
+ * the tables are walked once for the whole run. A large page that holds the first page is split.
+ *
+ * @param pages Receives the physical address of each page, 0 for pages that weren't mapped, may be NULL
+ * @param batch Receives the pages that have to be invalidated
+ * @return uint64_t How many pages were handled, mapped or not
+ */
+static uint64_t pagingUnmapTableRun(virtual_address_t virt, uint64_t count, physical_address_t pml4Addr,
+                                    physical_address_t *pages, k_tlb_batch *batch)
+{
     pagetable_entry_t *pml4 = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(pml4Addr);
+
+    // Nothing is mapped up to the end of a missing table
+    pagetable_entry_t pml4e = pml4[PML4_INDEXER(virt)];
+    if (!(pml4e & PAGETABLE_PRESENT))
+        return pagingSkipRun(virt, PAGING_PML4E_SIZE, count, pages);
+    pagetable_entry_t *pdpt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pml4e));
+
+    if (!(pdpt[PDPT_INDEXER(virt)] & PAGETABLE_PRESENT))
+        return pagingSkipRun(virt, PAGE_HUGE_SIZE, count, pages);
+    if (pdpt[PDPT_INDEXER(virt)] & PAGETABLE_PAGE_SIZE)
+        pagingSplitEntry(&pdpt[PDPT_INDEXER(virt)], PAGE_HUGE_SIZE);
+    pagetable_entry_t *pd = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pdpt[PDPT_INDEXER(virt)]));
+
+    if (!(pd[PD_INDEXER(virt)] & PAGETABLE_PRESENT))
+        return pagingSkipRun(virt, PAGE_LARGE_SIZE, count, pages);
+    if (pd[PD_INDEXER(virt)] & PAGETABLE_PAGE_SIZE)
+        pagingSplitEntry(&pd[PD_INDEXER(virt)], PAGE_LARGE_SIZE);
+
+    pagetable_entry_t *pt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pd[PD_INDEXER(virt)]));
+    uint64_t index = PT_INDEXER(virt);
+    uint64_t run = PAGETABLE_SIZE - index;
+    if (run > count)
+        run = count;
+
+    for (uint64_t i = 0; i < run; i++)
+    {
+        pagetable_entry_t pte = pt[index + i];
+        if (pages)
+            pages[i] = (pte & PAGE_PRESENT) ? ADDRESS_EXCLUDE(pte) : 0;
+        pt[index + i] = 0;
+
+        if (pte & PAGE_PRESENT)
+            batch->add(virt + i * PAGE_SIZE);
+    }
+
+    pagingReleaseEmptyTables(virt, pml4, pdpt, pd, pt);
+    return run;
+}
+
+physical_address_t pagingUnmapPageInSpace(virtual_address_t virt, physical_address_t pml4Addr)
+{
     physical_address_t mappedPage = NULL;
+    k_tlb_batch batch(pml4Addr);
+    pagingUnmapTableRun(PAGING_ALIGN_PAGE_DOWN(virt), 1, pml4Addr, &mappedPage, &batch);
+    batch.flush();
+    return mappedPage;
+}
+
+physical_address_t pagingUnmapPage(virtual_address_t virt)
+{
+    return pagingUnmapPageInSpace(virt, pagingGetCurrentSpace());
+}
 
+/**
+ * @brief Unmap a large page entry if it is fully covered by the range.
+ *
+ * @param phys Receives the physical address of the large page
+ * @return uint64_t The size of the large page that was unmapped, 0 if there was none
+ */
+static uint64_t pagingUnmapLargePage(virtual_address_t virt, uint64_t remaining, physical_address_t pml4Addr,
+                                     physical_address_t *phys)
+{
+    pagetable_entry_t *pml4 = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(pml4Addr);
     pagetable_entry_t pml4e = pml4[PML4_INDEXER(virt)];
-    if (pml4e & PAGETABLE_PRESENT)
+    if (!(pml4e & PAGETABLE_PRESENT))
+        return 0;
+
+    pagetable_entry_t *pdpt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pml4e));
+    pagetable_entry_t pdpte = pdpt[PDPT_INDEXER(virt)];
+    if (!(pdpte & PAGETABLE_PRESENT))
+        return 0;
+    if (pdpte & PAGETABLE_PAGE_SIZE)
     {
-        pagetable_entry_t *pdpt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pml4e));
+        if ((virt & (PAGE_HUGE_SIZE - 1)) || remaining < PAGE_HUGE_SIZE)
+            return 0;
+        *phys = PAGING_LARGE_ADDRESS(pdpte, PAGE_HUGE_SIZE);
+        pdpt[PDPT_INDEXER(virt)] = 0;
+        return PAGE_HUGE_SIZE;
+    }
+
+    pagetable_entry_t *pd = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pdpte));
+    pagetable_entry_t pde = pd[PD_INDEXER(virt)];
+    if (!(pde & PAGETABLE_PRESENT) || !(pde & PAGETABLE_PAGE_SIZE))
+        return 0;
+    if ((virt & (PAGE_LARGE_SIZE - 1)) || remaining < PAGE_LARGE_SIZE)
+        return 0;
+    *phys = PAGING_LARGE_ADDRESS(pde, PAGE_LARGE_SIZE);
+    pd[PD_INDEXER(virt)] = 0;
+    return PAGE_LARGE_SIZE;
+}
 
-        pagetable_entry_t pdpte = pdpt[PDPT_INDEXER(virt)];
-        if (pdpte & PAGETABLE_PRESENT)
+void pagingUnmapMemoryInTable(virtual_address_t virt, uint64_t size, physical_address_t pml4Addr,
+                              physical_address_t *pages)
+{
+    k_tlb_batch batch(pml4Addr);
+    uint64_t count = PAGING_ALIGN_PAGE_UP(size) / PAGE_SIZE;
+    uint64_t done = 0;
+    while (done < count)
+    {
+        virtual_address_t current = virt + done * PAGE_SIZE;
+
+        // Large pages that are fully covered are removed whole, others are split by the run
+        physical_address_t largePhys;
+        uint64_t unmapped = pagingUnmapLargePage(current, (count - done) * PAGE_SIZE, pml4Addr, &largePhys) / PAGE_SIZE;
+        if (unmapped)
         {
-            pagetable_entry_t *pd = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pdpte));
+            batch.addRange(current, unmapped);
+            if (pages)
+                for (uint64_t i = 0; i < unmapped; i++)
+                    pages[done + i] = largePhys + i * PAGE_SIZE;
+        }
+        else
+            unmapped = pagingUnmapTableRun(current, count - done, pml4Addr, pages ? &pages[done] : NULL, &batch);
 
-            pagetable_entry_t pde = pd[PD_INDEXER(virt)];
-            if (pde & PAGETABLE_PRESENT)
-            {
-                pagetable_entry_t *pt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pde));
-
-                pagetable_entry_t pte = pt[PT_INDEXER(virt)];
-                if (pte & PAGE_PRESENT)
-                {
-                    // Get the physical address for the page
-                    mappedPage = ADDRESS_EXCLUDE(pte);
-
-                    UNSET_FLAG(pte, PAGE_PRESENT);
-                    pt[PT_INDEXER(virt)] = pte;
-
-                    // memset(&pt[PT_INDEXER(virt)], 0, sizeof(pagetable_entry_t));
-
-                    // Check if PT is empty now
-                    if (pagingIsPagetableEmpty(pt))
-                    {
-                        // Free the PT space
-                        // memset((void *)pt, 0, PAGE_SIZE);
-                        memoryPhysicalAllocator.freePage(ADDRESS_EXCLUDE(pde));
-
-                        // Unset the PRESENT bit in the PD entry
-                        UNSET_FLAG(pde, PAGETABLE_PRESENT);
-                        pd[PD_INDEXER(virt)] = pde;
-
-                        // memset(&pd[PD_INDEXER(virt)], 0, sizeof(pagetable_entry_t));
-
-                        // Check if PD is empty now
-                        if (pagingIsPagetableEmpty(pd))
-                        {
-                            // Free the PD space
-                            // memset((void *)pd, 0, PAGE_SIZE);
-                            memoryPhysicalAllocator.freePage(ADDRESS_EXCLUDE(pdpte));
-
-                            // Unset the PRESENT bit in the PDPT entry
-                            UNSET_FLAG(pdpte, PAGETABLE_PRESENT);
-                            pdpt[PDPT_INDEXER(virt)] = pdpte;
-
-                            // memset(&pdpt[PD_INDEXER(virt)], 0, sizeof(pagetable_entry_t));
-
-                            // Check if PDPT is empty now
-                            if (pagingIsPagetableEmpty(pdpt))
-                            {
-                                // Free the PDPT space
-                                // memset((void *)pdpt, 0, PAGE_SIZE);
-                                memoryPhysicalAllocator.freePage(ADDRESS_EXCLUDE(pml4e));
-
-                                // Unset the PRESENT bit in the PML4 entry
-                                UNSET_FLAG(pml4e, PAGETABLE_PRESENT);
-                                pml4[PML4_INDEXER(virt)] = pml4e;
-                                // memset(&pml4[PML4_INDEXER(virt)], 0, sizeof(pagetable_entry_t));
-                            }
-                        }
-                    }
-                }
-            }
+        done += unmapped;
+    }
+
+    // The pages must not be reused before every processor stopped using them
+    batch.flush();
+}
+
+void pagingUnmapMemory(virtual_address_t virt, uint64_t size)
+{
+    pagingUnmapMemoryInTable(virt, size, pagingGetCurrentSpace());
+}
+
+/**
+ * @brief Share consecutive 4KiB pages, up to the end of the source table that holds
+ * the first one. A large page that holds the first page is split.
+ *
+ * @param shared Counts the pages that were shared
+ * @param batch Receives the source pages that were made read-only
+ * @return uint64_t How many pages were handled, mapped or not
+ */
+static uint64_t pagingShareTableRun(virtual_address_t virt, uint64_t count,
+                                    physical_address_t sourcePml4, physical_address_t targetPml4,
+                                    k_paging_flags flags, uint64_t *shared, k_tlb_batch *batch)
+{
+    pagetable_entry_t *pml4 = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(sourcePml4);
+
+    // Nothing is mapped up to the end of a missing table
+    pagetable_entry_t pml4e = pml4[PML4_INDEXER(virt)];
+    if (!(pml4e & PAGETABLE_PRESENT))
+        return pagingSkipRun(virt, PAGING_PML4E_SIZE, count, NULL);
+    pagetable_entry_t *pdpt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pml4e));
+
+    if (!(pdpt[PDPT_INDEXER(virt)] & PAGETABLE_PRESENT))
+        return pagingSkipRun(virt, PAGE_HUGE_SIZE, count, NULL);
+    if (pdpt[PDPT_INDEXER(virt)] & PAGETABLE_PAGE_SIZE)
+        pagingSplitEntry(&pdpt[PDPT_INDEXER(virt)], PAGE_HUGE_SIZE);
+    pagetable_entry_t *pd = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pdpt[PDPT_INDEXER(virt)]));
+
+    if (!(pd[PD_INDEXER(virt)] & PAGETABLE_PRESENT))
+        return pagingSkipRun(virt, PAGE_LARGE_SIZE, count, NULL);
+    if (pd[PD_INDEXER(virt)] & PAGETABLE_PAGE_SIZE)
+        pagingSplitEntry(&pd[PD_INDEXER(virt)], PAGE_LARGE_SIZE);
+    pagetable_entry_t *pt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pd[PD_INDEXER(virt)]));
+
+    uint64_t index = PT_INDEXER(virt);
+    uint64_t run = PAGETABLE_SIZE - index;
+    if (run > count)
+        run = count;
+
+    // The target table is only created if something is mapped in the run
+    pagetable_entry_t *targetPt = NULL;
+    for (uint64_t i = 0; i < run; i++)
+    {
+        pagetable_entry_t pte = pt[index + i];
+        if (!(pte & PAGE_PRESENT))
+            continue;
+
+        if (!targetPt)
+        {
+            pagetable_entry_t *targetPml4Table = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(targetPml4);
+            pagetable_entry_t *targetPdpt = pagingGetNextTable(targetPml4Table, PML4_INDEXER(virt), PAGING_PML4E_SIZE, flags.pml4Flags, false);
+            pagetable_entry_t *targetPd = pagingGetNextTable(targetPdpt, PDPT_INDEXER(virt), PAGE_HUGE_SIZE, flags.pdptFlags, false);
+            targetPt = pagingGetNextTable(targetPd, PD_INDEXER(virt), PAGE_LARGE_SIZE, flags.pdFlags, false);
+        }
+
+        // Both spaces get a read-only mapping, the first write copies the page
+        if (pte & PAGE_READWRITE)
+        {
+            pt[index + i] = pte & ~PAGE_READWRITE;
+            batch->add(virt + i * PAGE_SIZE);
         }
+        targetPt[index + i] = pte & ~(PAGE_READWRITE | PAGE_ACCESSED | PAGE_DIRTY);
+
+        memoryPhysicalAllocator.sharePage(ADDRESS_EXCLUDE(pte));
+        (*shared)++;
     }
 
-    return mappedPage;
+    return run;
 }
 
-physical_address_t pagingUnmapPage(virtual_address_t virt)
+uint64_t pagingShareMemoryInTable(virtual_address_t virt, uint64_t size,
+                                  physical_address_t sourcePml4, physical_address_t targetPml4,
+                                  k_paging_flags flags)
 {
-    return pagingUnmapPageInSpace(virt, pagingGetCurrentSpace());
+    k_tlb_batch batch(sourcePml4);
+    uint64_t count = PAGING_ALIGN_PAGE_UP(size) / PAGE_SIZE;
+    uint64_t shared = 0;
+    uint64_t done = 0;
+    while (done < count)
+        done += pagingShareTableRun(virt + done * PAGE_SIZE, count - done, sourcePml4, targetPml4,
+                                    flags, &shared, &batch);
+
+    // The source must not keep writing through stale writable translations
+    batch.flush();
+    return shared;
+}
+
+pagetable_entry_t *pagingGetPageEntryInSpace(virtual_address_t virt, physical_address_t pml4Addr)
+{
+    pagetable_entry_t *pml4 = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(pml4Addr);
+
+    pagetable_entry_t pml4e = pml4[PML4_INDEXER(virt)];
+    if (!(pml4e & PAGETABLE_PRESENT))
+        return NULL;
+    pagetable_entry_t *pdpt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pml4e));
+
+    pagetable_entry_t pdpte = pdpt[PDPT_INDEXER(virt)];
+    if (!(pdpte & PAGETABLE_PRESENT) || (pdpte & PAGETABLE_PAGE_SIZE))
+        return NULL;
+    pagetable_entry_t *pd = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pdpte));
+
+    pagetable_entry_t pde = pd[PD_INDEXER(virt)];
+    if (!(pde & PAGETABLE_PRESENT) || (pde & PAGETABLE_PAGE_SIZE))
+        return NULL;
+    pagetable_entry_t *pt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pde));
+
+    return &pt[PT_INDEXER(virt)];
 }
 
 void pagingInitialize(physical_address_t kernelBase, virtual_address_t hhdm)
 {
-    physical_address_t pml4Addr = memoryPhysicalAllocator.allocatePage();
+    physical_address_t pml4Addr = memoryPhysicalAllocator.allocateZeroedPage();
+
+    pagingHas1GiBPages = processorHas1GiBPages();
+    logDebugn("%! Mapping with 2MiB%s pages", "[Memory]", pagingHas1GiBPages ? " and 1GiB" : "");
 
     logDebugn("%! Mapping first 4GiB", "[Memory]");
     // Identity map first 4GiB of memory
@@ -296,23 +753,76 @@ void pagingInitialize(physical_address_t kernelBase, virtual_address_t hhdm)
     pagingMapMemoryInTable(0xffffffff80000000, kernelBase, 0x80000000, pml4Addr, PAGING_DEFAULT_FLAGS, true);
     logDebugn("%! Done mapping higherhalf", "[Memory]");
 
+    pagingKernelSpace = pml4Addr;
     pagingSwitchSpace(pml4Addr);
+
+    // Copy-on-write pages must fault when the kernel writes to them too
+    uint64_t cr0;
+    asm volatile("mov %0, cr0"
+                 : "=r"(cr0));
+    cr0 |= PAGING_CR0_WP;
+    asm volatile("mov cr0, %0"
+                 :
+                 : "r"(cr0)
+                 : "memory");
+
+    // CR3 is loaded with PCID 0 at this point, as enabling PCIDs requires
+    pcidInitialize();
+}
+
+void pagingInitializeProcessor()
+{
+    // PCIDs aren't enabled on this processor yet, so CR3 is loaded as it is
+    asm volatile("mov cr3, %0"
+                 :
+                 : "r"(pagingKernelSpace)
+                 : "memory");
+    tlbSetActiveSpace(processorGetIndex(), pagingKernelSpace);
+
+    uint64_t cr0;
+    asm volatile("mov %0, cr0"
+                 : "=r"(cr0));
+    cr0 |= PAGING_CR0_WP;
+    asm volatile("mov cr0, %0"
+                 :
+                 : "r"(cr0)
+                 : "memory");
+
+    pcidInitializeProcessor();
+}
+
+physical_address_t pagingGetKernelSpace()
+{
+    return pagingKernelSpace;
 }
 
 void pagingSwitchSpace(physical_address_t phys)
 {
-    asm("mov cr3, %[aPhys]"
-        :
-        : [aPhys] "r"(phys));
+    uint64_t rflags = interruptsSave();
+    tlbSetActiveSpace(processorGetIndex(), phys);
+
+    // With PCIDs the TLB entries of the space are kept, unless they are out of date
+    uint64_t cr3 = pcidSelect(phys);
+
+    // Reloading the same space would only throw away the TLB
+    if (phys != pagingGetCurrentSpace() || (pcidEnabled() && !(cr3 & PCID_CR3_NOFLUSH)))
+        asm volatile("mov cr3, %[aCR3]"
+                     :
+                     : [aCR3] "r"(cr3)
+                     : "memory");
+
+    interruptsRestore(rflags);
 }
 
 physical_address_t pagingGetCurrentSpace()
 {
     // Get the address of the current space from cr3
-    pagetable_entry_t *pml4;
+    uint64_t cr3;
     asm volatile("mov %0, cr3"
-                 : "=r"(pml4));
-    return (physical_address_t)pml4;
+                 : "=r"(cr3));
+
+    // The low bits hold the PCID
+    return (physical_address_t)(cr3 & ~PCID_CR3_MASK);
 }
 
 physical_address_t pagingVirtualToPhysical(virtual_address_t virt)
@@ -329,7 +839,7 @@ physical_address_t pagingVirtualToPhysical(virtual_address_t virt)
     if (!(pdpte & PAGETABLE_PRESENT))
         return NULL;
     if (CHECK_FLAG(pdpte, PAGETABLE_PAGE_SIZE))
-        return ADDRESS_EXCLUDE(pdpte); // Handle 4GiB pages
+        return PAGING_LARGE_ADDRESS(pdpte, PAGE_HUGE_SIZE) + (virt & (PAGE_HUGE_SIZE - 1)); // Handle 1GiB pages
 
     pagetable_entry_t *pd = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pdpte));
 
@@ -337,7 +847,7 @@ physical_address_t pagingVirtualToPhysical(virtual_address_t virt)
     if (!(pde & PAGETABLE_PRESENT))
         return NULL;
     if (CHECK_FLAG(pde, PAGETABLE_PAGE_SIZE))
-        return ADDRESS_EXCLUDE(pde); // Handle 2MiB pages
+        return PAGING_LARGE_ADDRESS(pde, PAGE_LARGE_SIZE) + (virt & (PAGE_LARGE_SIZE - 1)); // Handle 2MiB pages
 
     pagetable_entry_t *pt = (pagetable_entry_t *)PAGING_APPLY_DIRECTMAP(ADDRESS_EXCLUDE(pde));
 
@@ -0,0 +1,143 @@
+#include <memory/pcid.hpp>
+
+#include <logger/logger.hpp>
+#include <system/processor/processor.hpp>
+
+static bool pcidIsEnabled = false;
+
+static k_pcid_processor pcidProcessors[PROCESSOR_MAX_CPUS];
+
+/**
+ * @brief Set CR4.PCIDE on this processor
+ */
+static void pcidEnableLocal()
+{
+    uint64_t cr4;
+    asm volatile("mov %0, cr4"
+                 : "=r"(cr4));
+    cr4 |= PCID_CR4_PCIDE;
+    asm volatile("mov cr4, %0"
+                 :
+                 : "r"(cr4)
+                 : "memory");
+}
+
+void pcidInitialize()
+{
+    if (!processorHasPCID())
+    {
+        logDebugn("%! PCIDs aren't supported, every switch flushes the TLB", "[Paging]");
+        return;
+    }
+
+    pcidEnableLocal();
+
+    pcidIsEnabled = true;
+    logDebugn("%! PCIDs have been enabled, %d per processor", "[Paging]", PCID_SLOTS);
+}
+
+void pcidInitializeProcessor()
+{
+    if (pcidIsEnabled)
+        pcidEnableLocal();
+}
+
+bool pcidEnabled()
+{
+    return pcidIsEnabled;
+}
+
+uint64_t pcidSelect(physical_address_t space)
+{
+    if (!pcidIsEnabled)
+        return space;
+
+    k_pcid_processor *processor = &pcidProcessors[processorGetIndex()];
+    processor->clock++;
+
+    // Look for the space's slot, and the least recently used one on the way
+    uint64_t victim = 0;
+    for (uint64_t slot = 0; slot < PCID_SLOTS; slot++)
+    {
+        k_pcid_slot *entry = &processor->slots[slot];
+        if (entry->space == space)
+        {
+            entry->lastUse = processor->clock;
+
+            // The stale flag is cleared atomically, an invalidation may race with the switch
+            if (__sync_lock_test_and_set(&entry->stale, 0))
+            {
+                processor->misses++;
+                return space | (slot + 1);
+            }
+
+            processor->hits++;
+            return space | (slot + 1) | PCID_CR3_NOFLUSH;
+        }
+
+        if (entry->lastUse < processor->slots[victim].lastUse)
+            victim = slot;
+    }
+
+    // Recycle the slot, loading it without the no-flush bit drops the previous space's entries
+    k_pcid_slot *entry = &processor->slots[victim];
+    if (entry->space)
+        processor->recycles++;
+    processor->misses++;
+
+    entry->space = space;
+    entry->stale = 0;
+    entry->lastUse = processor->clock;
+    return space | (victim + 1);
+}
+
+void pcidInvalidateSpace(physical_address_t space)
+{
+    if (!pcidIsEnabled)
+        return;
+
+    for (uint64_t cpu = 0; cpu < processorGetCount(); cpu++)
+        for (uint64_t slot = 0; slot < PCID_SLOTS; slot++)
+            if (pcidProcessors[cpu].slots[slot].space == space)
+                __sync_lock_test_and_set(&pcidProcessors[cpu].slots[slot].stale, 1);
+}
+
+void pcidInvalidateAll()
+{
+    if (!pcidIsEnabled)
+        return;
+
+    for (uint64_t cpu = 0; cpu < processorGetCount(); cpu++)
+        for (uint64_t slot = 0; slot < PCID_SLOTS; slot++)
+            if (pcidProcessors[cpu].slots[slot].space)
+                __sync_lock_test_and_set(&pcidProcessors[cpu].slots[slot].stale, 1);
+}
+
+void pcidReleaseSpace(physical_address_t space)
+{
+    if (!pcidIsEnabled)
+        return;
+
+    // A free slot is always loaded with a flush when it is reused, dropping the old entries
+    for (uint64_t cpu = 0; cpu < processorGetCount(); cpu++)
+        for (uint64_t slot = 0; slot < PCID_SLOTS; slot++)
+            if (pcidProcessors[cpu].slots[slot].space == space)
+            {
+                pcidProcessors[cpu].slots[slot].space = 0;
+                pcidProcessors[cpu].slots[slot].lastUse = 0;
+            }
+}
+
+void pcidDumpStatistics()
+{
+    for (uint64_t cpu = 0; cpu < processorGetCount(); cpu++)
+    {
+        k_pcid_processor *processor = &pcidProcessors[cpu];
+        logDebugn("%! CPU %d: %d switches kept the TLB, %d flushed it, %d PCIDs recycled",
+                  "[Paging]",
+                  cpu,
+                  processor->hits,
+                  processor->misses,
+                  processor->recycles);
+    }
+}
@@ -0,0 +1,173 @@
+#include <memory/physical_zone.hpp>
+
+#include <logger/logger.hpp>
+#include <memory/paging.hpp>
+#include <strings.hpp>
+
+uint8_t physicalZoneOrder(uint64_t frames)
+{
+    uint8_t order = 0;
+    while (((uint64_t)1 << order) < frames)
+        order++;
+
+    return order;
+}
+
+void k_physical_zone::initialize(k_page *frames, uint64_t frameCount)
+{
+    this->frames = frames;
+    this->frameCount = frameCount;
+    this->freePages = 0;
+
+    memset((char *)frames, 0, frameCount * sizeof(k_page));
+
+    for (uint8_t order = 0; order <= PHYSICAL_ZONE_MAX_ORDER; order++)
+    {
+        this->freeLists[order] = PHYSICAL_ZONE_NO_FRAME;
+        this->freeBlocks[order] = 0;
+    }
+}
+
+void k_physical_zone::freeRange(uint64_t firstFrame, uint64_t frames)
+{
+    uint64_t frame = firstFrame;
+    uint64_t end = firstFrame + frames;
+    if (end > this->frameCount)
+        end = this->frameCount;
+
+    while (frame < end)
+    {
+        // The largest block that is aligned at this frame and fits in the range
+        uint8_t order = 0;
+        while (order < PHYSICAL_ZONE_MAX_ORDER &&
+               !(frame & (((uint64_t)2 << order) - 1)) &&
+               frame + ((uint64_t)2 << order) <= end)
+            order++;
+
+        this->free(frame, order);
+        frame += (uint64_t)1 << order;
+    }
+}
+
+uint64_t k_physical_zone::allocate(uint8_t order)
+{
+    if (order > PHYSICAL_ZONE_MAX_ORDER)
+        return PHYSICAL_ZONE_NO_FRAME;
+
+    // Find the smallest order that has a free block
+    uint8_t current = order;
+    while (current <= PHYSICAL_ZONE_MAX_ORDER && this->freeLists[current] == PHYSICAL_ZONE_NO_FRAME)
+        current++;
+
+    // Not enough memory, or too fragmented
+    if (current > PHYSICAL_ZONE_MAX_ORDER)
+        return PHYSICAL_ZONE_NO_FRAME;
+
+    uint64_t frame = this->freeLists[current];
+    this->_remove(frame);
+
+    // Split the block, the upper halves go to the lower-order lists
+    while (current > order)
+    {
+        current--;
+        this->_push(frame + ((uint64_t)1 << current), current);
+    }
+
+    this->freePages -= (uint64_t)1 << order;
+    return frame;
+}
+
+void k_physical_zone::free(uint64_t frame, uint8_t order)
+{
+    if (frame >= this->frameCount || this->frames[frame].free)
+        return;
+
+    this->freePages += (uint64_t)1 << order;
+
+    // Merge with the buddy as long as it is a free block of the same order
+    while (order < PHYSICAL_ZONE_MAX_ORDER)
+    {
+        uint64_t buddy = frame ^ ((uint64_t)1 << order);
+        if (buddy >= this->frameCount ||
+            !this->frames[buddy].free ||
+            this->frames[buddy].order != order)
+            break;
+
+        this->_remove(buddy);
+
+        // The merged block starts at the lower buddy
+        if (buddy < frame)
+            frame = buddy;
+        order++;
+    }
+
+    this->_push(frame, order);
+}
+
+int k_physical_zone::largestFreeOrder()
+{
+    for (int order = PHYSICAL_ZONE_MAX_ORDER; order >= 0; order--)
+        if (this->freeBlocks[order])
+            return order;
+
+    return -1;
+}
+
+uint64_t k_physical_zone::fragmentationIndex(uint8_t order)
+{
+    if (!this->freePages)
+        return 1000;
+
+    // Pages in blocks that are large enough to serve this order
+    uint64_t usable = 0;
+    for (uint8_t current = order; current <= PHYSICAL_ZONE_MAX_ORDER; current++)
+        usable += this->freeBlocks[current] << current;
+
+    return 1000 - usable * 1000 / this->freePages;
+}
+
+void k_physical_zone::dumpStatistics()
+{
+    logDebugn("%! %d free pages (%m), largest free block of order %d",
+              "[Physical Zone]",
+              this->freePages,
+              this->freePages * PAGE_SIZE,
+              this->largestFreeOrder());
+
+    for (uint8_t order = 0; order <= PHYSICAL_ZONE_MAX_ORDER; order++)
+        logDebugn("\t- Order %d: %d free blocks, fragmentation %d/1000",
+                  order,
+                  this->freeBlocks[order],
+                  this->fragmentationIndex(order));
+}
+
+void k_physical_zone::_push(uint64_t frame, uint8_t order)
+{
+    k_page *entry = &this->frames[frame];
+    entry->free = 1;
+    entry->order = order;
+    entry->prev = PHYSICAL_ZONE_NO_FRAME;
+    entry->next = this->freeLists[order];
+
+    if (entry->next != PHYSICAL_ZONE_NO_FRAME)
+        this->frames[entry->next].prev = frame;
+    this->freeLists[order] = frame;
+
+    this->freeBlocks[order]++;
+}
+
+void k_physical_zone::_remove(uint64_t frame)
+{
+    k_page *entry = &this->frames[frame];
+
+    if (entry->prev != PHYSICAL_ZONE_NO_FRAME)
+        this->frames[entry->prev].next = entry->next;
+    else
+        this->freeLists[entry->order] = entry->next;
+
+    if (entry->next != PHYSICAL_ZONE_NO_FRAME)
+        this->frames[entry->next].prev = entry->prev;
+
+    entry->free = 0;
+    this->freeBlocks[entry->order]--;
+}
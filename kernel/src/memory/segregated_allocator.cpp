@@ -0,0 +1,323 @@
+#include <memory/segregated_allocator.hpp>
+
+#include <logger/logger.hpp>
+
+// How many chunks of a power of 2 bin are tried before moving to a bigger bin
+#define HEAP_BIN_SCAN_LIMIT 8
+
+void k_segregated_allocator::init(virtual_address_t start, virtual_address_t end)
+{
+    for (uint64_t i = 0; i < HEAP_BIN_COUNT; i++)
+        this->bins[i] = NULL;
+    this->binmap = 0;
+
+    start = (start + HEAP_CHUNK_FLAGS) & ~HEAP_CHUNK_FLAGS;
+    end &= ~HEAP_CHUNK_FLAGS;
+
+    // The sentinel only needs the boundary tag and the header
+    this->sentinel = (k_heap_chunk *)(end - HEAP_CHUNK_OVERHEAD);
+    this->sentinel->header = HEAP_CHUNK_USED;
+
+    k_heap_chunk *chunk = (k_heap_chunk *)start;
+    chunk->header = ((uint64_t)this->sentinel - start) | HEAP_CHUNK_PREV_USED;
+    this->_insert(chunk);
+}
+
+void *k_segregated_allocator::allocate(uint64_t size)
+{
+    if (size == 0)
+        return NULL;
+
+    uint64_t chunkSize = this->_chunkSize(size);
+    k_heap_chunk *chunk = this->_take(chunkSize);
+    if (!chunk)
+        return NULL;
+
+    this->_use(chunk, chunkSize);
+    return HEAP_CHUNK_PAYLOAD(chunk);
+}
+
+void *k_segregated_allocator::allocateAligned(uint64_t size, uint64_t alignment)
+{
+    if (alignment <= HEAP_CHUNK_ALIGNMENT)
+        return this->allocate(size);
+
+    if (size == 0)
+        return NULL;
+
+    // Enough room to skip to an aligned payload and leave a chunk before it
+    uint64_t chunkSize = this->_chunkSize(size);
+    k_heap_chunk *chunk = this->_take(chunkSize + alignment + HEAP_CHUNK_MIN_SIZE);
+    if (!chunk)
+        return NULL;
+
+    uint64_t payload = ((uint64_t)chunk + HEAP_CHUNK_OVERHEAD + alignment - 1) & ~(alignment - 1);
+    uint64_t lead = payload - HEAP_CHUNK_OVERHEAD - (uint64_t)chunk;
+    if (lead && lead < HEAP_CHUNK_MIN_SIZE)
+    {
+        payload += alignment;
+        lead += alignment;
+    }
+
+    // The memory before the aligned chunk goes back to the bins
+    if (lead)
+    {
+        k_heap_chunk *aligned = (k_heap_chunk *)(payload - HEAP_CHUNK_OVERHEAD);
+        aligned->header = HEAP_CHUNK_SIZE(chunk) - lead;
+        chunk->header = lead | (chunk->header & HEAP_CHUNK_PREV_USED);
+        this->_insert(chunk);
+        chunk = aligned;
+    }
+
+    this->_use(chunk, chunkSize);
+    return HEAP_CHUNK_PAYLOAD(chunk);
+}
+
+bool k_segregated_allocator::resize(void *mem, uint64_t size)
+{
+    k_heap_chunk *chunk = HEAP_CHUNK_OF(mem);
+    uint64_t chunkSize = this->_chunkSize(size);
+    uint64_t currentSize = HEAP_CHUNK_SIZE(chunk);
+
+    if (chunkSize > currentSize)
+    {
+        // Grow into the next chunk if it is free and big enough
+        k_heap_chunk *next = HEAP_CHUNK_NEXT(chunk);
+        if ((next->header & HEAP_CHUNK_USED) || currentSize + HEAP_CHUNK_SIZE(next) < chunkSize)
+            return false;
+
+        this->_unlink(next);
+        chunk->header += HEAP_CHUNK_SIZE(next);
+        HEAP_CHUNK_NEXT(chunk)->header |= HEAP_CHUNK_PREV_USED;
+        currentSize = HEAP_CHUNK_SIZE(chunk);
+    }
+
+    // Give the tail back if it is big enough to be a chunk
+    if (currentSize - chunkSize >= HEAP_CHUNK_MIN_SIZE)
+    {
+        k_heap_chunk *tail = (k_heap_chunk *)((uint64_t)chunk + chunkSize);
+        tail->header = (currentSize - chunkSize) | HEAP_CHUNK_PREV_USED | HEAP_CHUNK_USED;
+        chunk->header = chunkSize | (chunk->header & (HEAP_CHUNK_FLAGS | HEAP_CHUNK_TAG_MASK));
+        this->_insert(this->_coalesce(tail));
+    }
+
+    return true;
+}
+
+uint64_t k_segregated_allocator::free(void *mem)
+{
+    k_heap_chunk *chunk = HEAP_CHUNK_OF(mem);
+
+    if (!(chunk->header & HEAP_CHUNK_USED) || (chunk->header & HEAP_CHUNK_LARGE))
+        return 0; // not in use
+
+    uint64_t size = HEAP_CHUNK_SIZE(chunk) - HEAP_CHUNK_OVERHEAD;
+    this->_insert(this->_coalesce(chunk));
+
+    return size;
+}
+
+void k_segregated_allocator::expand(uint64_t amount)
+{
+    // The old sentinel becomes the header of the new chunk
+    k_heap_chunk *chunk = this->sentinel;
+    chunk->header = amount | (chunk->header & HEAP_CHUNK_PREV_USED) | HEAP_CHUNK_USED;
+
+    this->sentinel = HEAP_CHUNK_NEXT(chunk);
+    this->sentinel->header = HEAP_CHUNK_USED | HEAP_CHUNK_PREV_USED;
+
+    this->_insert(this->_coalesce(chunk));
+}
+
+uint64_t k_segregated_allocator::trailingFree()
+{
+    if (this->sentinel->header & HEAP_CHUNK_PREV_USED)
+        return 0;
+
+    return this->sentinel->prevSize;
+}
+
+void k_segregated_allocator::shrink(uint64_t amount)
+{
+    k_heap_chunk *chunk = (k_heap_chunk *)((uint64_t)this->sentinel - this->sentinel->prevSize);
+    uint64_t remaining = HEAP_CHUNK_SIZE(chunk) - amount;
+
+    this->_unlink(chunk);
+    this->sentinel = (k_heap_chunk *)((uint64_t)this->sentinel - amount);
+    this->sentinel->header = HEAP_CHUNK_USED;
+
+    // The free chunk either keeps its head, or the sentinel takes its place
+    if (remaining)
+    {
+        chunk->header = remaining | (chunk->header & HEAP_CHUNK_PREV_USED);
+        this->_insert(chunk);
+    }
+    else
+        this->sentinel->header |= chunk->header & HEAP_CHUNK_PREV_USED;
+}
+
+uint64_t k_segregated_allocator::largestFree()
+{
+    if (!this->binmap)
+        return 0;
+
+    // The chunks of the top bin aren't sorted, but the other bins are all smaller
+    uint64_t largest = 0;
+    for (k_heap_chunk *chunk = this->bins[63 - __builtin_clzll(this->binmap)]; chunk; chunk = chunk->nextFree)
+        if (HEAP_CHUNK_SIZE(chunk) > largest)
+            largest = HEAP_CHUNK_SIZE(chunk);
+
+    return largest;
+}
+
+void k_segregated_allocator::freeHistogram(uint64_t *chunks, uint64_t *bytes, uint64_t buckets)
+{
+    for (uint64_t i = 0; i < buckets; i++)
+    {
+        chunks[i] = 0;
+        bytes[i] = 0;
+    }
+
+    for (uint64_t index = 0; index < HEAP_BIN_COUNT; index++)
+    {
+        for (k_heap_chunk *chunk = this->bins[index]; chunk; chunk = chunk->nextFree)
+        {
+            uint64_t size = HEAP_CHUNK_SIZE(chunk);
+            uint64_t bucket = 63 - __builtin_clzll(size);
+            if (bucket >= buckets)
+                bucket = buckets - 1;
+
+            chunks[bucket]++;
+            bytes[bucket] += size;
+        }
+    }
+}
+
+uint64_t k_segregated_allocator::usableSize(void *mem)
+{
+    return HEAP_CHUNK_SIZE(HEAP_CHUNK_OF(mem)) - HEAP_CHUNK_OVERHEAD;
+}
+
+uint64_t k_segregated_allocator::_binIndex(uint64_t size)
+{
+    if (size < HEAP_SMALL_LIMIT)
+        return size / HEAP_CHUNK_ALIGNMENT;
+
+    // A bin per power of 2, starting at HEAP_SMALL_LIMIT
+    uint64_t index = HEAP_SMALL_BINS + (63 - __builtin_clzll(size)) - (63 - __builtin_clzll(HEAP_SMALL_LIMIT));
+    return index < HEAP_BIN_COUNT ? index : HEAP_BIN_COUNT - 1;
+}
+
+uint64_t k_segregated_allocator::_chunkSize(uint64_t size)
+{
+    uint64_t chunkSize = (size + HEAP_CHUNK_OVERHEAD + HEAP_CHUNK_FLAGS) & ~HEAP_CHUNK_FLAGS;
+    return chunkSize < HEAP_CHUNK_MIN_SIZE ? HEAP_CHUNK_MIN_SIZE : chunkSize;
+}
+
+void k_segregated_allocator::_insert(k_heap_chunk *chunk)
+{
+    uint64_t size = HEAP_CHUNK_SIZE(chunk);
+    uint64_t index = this->_binIndex(size);
+
+    chunk->header = size | (chunk->header & HEAP_CHUNK_PREV_USED);
+    chunk->prevFree = NULL;
+    chunk->nextFree = this->bins[index];
+    if (chunk->nextFree)
+        chunk->nextFree->prevFree = chunk;
+    this->bins[index] = chunk;
+    this->binmap |= (uint64_t)1 << index;
+
+    // The boundary tag, the next chunk can find this one
+    k_heap_chunk *next = HEAP_CHUNK_NEXT(chunk);
+    next->prevSize = size;
+    next->header &= ~(uint64_t)HEAP_CHUNK_PREV_USED;
+}
+
+void k_segregated_allocator::_unlink(k_heap_chunk *chunk)
+{
+    uint64_t index = this->_binIndex(HEAP_CHUNK_SIZE(chunk));
+
+    if (chunk->prevFree)
+        chunk->prevFree->nextFree = chunk->nextFree;
+    else
+        this->bins[index] = chunk->nextFree;
+
+    if (chunk->nextFree)
+        chunk->nextFree->prevFree = chunk->prevFree;
+
+    if (!this->bins[index])
+        this->binmap &= ~((uint64_t)1 << index);
+}
+
+k_heap_chunk *k_segregated_allocator::_take(uint64_t size)
+{
+    uint64_t index = this->_binIndex(size);
+
+    // Every chunk of a small bin fits, a power of 2 bin may hold smaller chunks
+    if (index >= HEAP_SMALL_BINS)
+    {
+        k_heap_chunk *chunk = this->bins[index];
+        for (uint64_t i = 0; chunk && i < HEAP_BIN_SCAN_LIMIT; i++, chunk = chunk->nextFree)
+        {
+            if (HEAP_CHUNK_SIZE(chunk) >= size)
+            {
+                this->_unlink(chunk);
+                return chunk;
+            }
+        }
+
+        if (++index == HEAP_BIN_COUNT)
+            return NULL;
+    }
+
+    // Any chunk of a bigger bin fits
+    uint64_t candidates = this->binmap & ~(((uint64_t)1 << index) - 1);
+    if (!candidates)
+        return NULL;
+
+    k_heap_chunk *chunk = this->bins[__builtin_ctzll(candidates)];
+    this->_unlink(chunk);
+    return chunk;
+}
+
+void k_segregated_allocator::_use(k_heap_chunk *chunk, uint64_t size)
+{
+    uint64_t chunkSize = HEAP_CHUNK_SIZE(chunk);
+
+    if (chunkSize - size >= HEAP_CHUNK_MIN_SIZE)
+    {
+        // Split the tail off, it goes back to the bins
+        k_heap_chunk *tail = (k_heap_chunk *)((uint64_t)chunk + size);
+        tail->header = (chunkSize - size) | HEAP_CHUNK_PREV_USED;
+        chunk->header = size | (chunk->header & HEAP_CHUNK_PREV_USED) | HEAP_CHUNK_USED;
+        this->_insert(tail);
+    }
+    else
+    {
+        chunk->header |= HEAP_CHUNK_USED;
+        HEAP_CHUNK_NEXT(chunk)->header |= HEAP_CHUNK_PREV_USED;
+    }
+}
+
+k_heap_chunk *k_segregated_allocator::_coalesce(k_heap_chunk *chunk)
+{
+    chunk->header &= ~(uint64_t)HEAP_CHUNK_USED;
+
+    // Two free chunks are never adjacent, so a single merge on each side is enough
+    if (!(chunk->header & HEAP_CHUNK_PREV_USED))
+    {
+        k_heap_chunk *prev = (k_heap_chunk *)((uint64_t)chunk - chunk->prevSize);
+        this->_unlink(prev);
+        prev->header += HEAP_CHUNK_SIZE(chunk);
+        chunk = prev;
+    }
+
+    k_heap_chunk *next = HEAP_CHUNK_NEXT(chunk);
+    if (!(next->header & HEAP_CHUNK_USED))
+    {
+        this->_unlink(next);
+        chunk->header += HEAP_CHUNK_SIZE(next);
+    }
+
+    return chunk;
+}
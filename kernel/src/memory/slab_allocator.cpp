@@ -0,0 +1,303 @@
+#include <memory/slab_allocator.hpp>
+
+#include <memory/memory.hpp>
+#include <memory/paging.hpp>
+#include <interrupts/interrupts.hpp>
+#include <kernel.hpp>
+#include <logger/logger.hpp>
+
+// All the caches that have created a slab
+k_slab_cache *slabCaches = NULL;
+k_spinlock slabCachesLock;
+
+/**
+ * @brief Push a slab to the head of a list
+ */
+static void slabListPush(k_slab **list, k_slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+/**
+ * @brief Remove a slab from a list
+ */
+static void slabListRemove(k_slab **list, k_slab *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/**
+ * @brief Get the free list link of an object
+ */
+static void **slabObjectLink(k_slab_cache *cache, void *object)
+{
+    return (void **)((uint64_t)object + cache->objectStride - sizeof(void *));
+}
+
+void *k_slab_cache::allocate()
+{
+    uint64_t rflags = interruptsSave();
+    k_slab_magazine *magazine = &this->magazines[processorGetIndex()];
+
+    void *object;
+    if (magazine->count > 0)
+    {
+        object = magazine->objects[--magazine->count];
+        __sync_fetch_and_add(&this->magazineHits, 1);
+    }
+    else
+    {
+        // Refill the magazine with a batch, the first object goes to the caller
+        this->lock.lock();
+        object = this->_allocateObject();
+        while (object && magazine->count < SLAB_MAGAZINE_BATCH)
+        {
+            void *extra = this->_allocateObject();
+            if (!extra)
+                break;
+            magazine->objects[magazine->count++] = extra;
+        }
+        this->lock.unlock();
+    }
+
+    if (object)
+    {
+        __sync_fetch_and_add(&this->allocations, 1);
+        __sync_fetch_and_add(&this->activeObjects, 1);
+    }
+    interruptsRestore(rflags);
+
+    if (!object)
+        kernelPanic("%! The %s cache has ran out of memory.", "[Slab Allocator]", this->name);
+
+    return object;
+}
+
+void k_slab_cache::free(void *object)
+{
+    if (!object)
+        return;
+
+    if (!this->slabSize || ((k_slab *)((uint64_t)object & ~(this->slabSize - 1)))->cache != this)
+    {
+        logWarnn("%! Tried to free 0x%64x to the %s cache, which it doesn't belong to.",
+                 "[Slab Allocator]", object, this->name);
+        return;
+    }
+
+    uint64_t rflags = interruptsSave();
+    k_slab_magazine *magazine = &this->magazines[processorGetIndex()];
+
+    // Return a batch to the slabs to make room
+    if (magazine->count == SLAB_MAGAZINE_SIZE)
+    {
+        this->lock.lock();
+        for (uint64_t i = 0; i < SLAB_MAGAZINE_BATCH; i++)
+            this->_freeObject(magazine->objects[--magazine->count]);
+        this->lock.unlock();
+    }
+
+    magazine->objects[magazine->count++] = object;
+
+    __sync_fetch_and_add(&this->frees, 1);
+    __sync_fetch_and_sub(&this->activeObjects, 1);
+    interruptsRestore(rflags);
+}
+
+void k_slab_cache::dumpStatistics()
+{
+    logInfon("%! %s: %d objects of %d bytes in use, %d slabs of %m, %d allocations (%d from magazines), %d frees",
+             "[Slab Allocator]",
+             this->name,
+             this->activeObjects,
+             this->objectSize,
+             this->slabs,
+             this->slabSize,
+             this->allocations,
+             this->magazineHits,
+             this->frees);
+}
+
+void *k_slab_cache::_allocateObject()
+{
+    if (!this->partial)
+    {
+        k_slab *slab = this->empty;
+        if (slab)
+            this->empty = NULL;
+        else
+            slab = this->_grow();
+
+        if (!slab)
+            return NULL;
+        slabListPush(&this->partial, slab);
+    }
+
+    k_slab *slab = this->partial;
+    void *object = slab->freeList;
+    slab->freeList = *slabObjectLink(this, object);
+    slab->used++;
+
+    if (slab->used == this->objectsPerSlab)
+    {
+        slabListRemove(&this->partial, slab);
+        slabListPush(&this->full, slab);
+    }
+
+    return object;
+}
+
+void k_slab_cache::_freeObject(void *object)
+{
+    k_slab *slab = (k_slab *)((uint64_t)object & ~(this->slabSize - 1));
+
+    *slabObjectLink(this, object) = slab->freeList;
+    slab->freeList = object;
+
+    if (slab->used-- == this->objectsPerSlab)
+    {
+        slabListRemove(&this->full, slab);
+        slabListPush(&this->partial, slab);
+    }
+
+    if (slab->used == 0)
+    {
+        slabListRemove(&this->partial, slab);
+
+        // A single empty slab is enough to absorb the next allocations
+        if (this->empty)
+            this->_release(slab);
+        else
+            this->empty = slab;
+    }
+}
+
+k_slab *k_slab_cache::_grow()
+{
+    if (!this->slabSize)
+        this->_setup();
+
+    uint64_t pages = this->slabSize / PAGE_SIZE;
+    physical_address_t phys = pages == 1 ? memoryPhysicalAllocator.allocatePage()
+                                         : memoryPhysicalAllocator.allocatePages(pages, this->slabSize);
+    if (!phys)
+        return NULL;
+
+    // The direct map keeps the natural alignment of the slab
+    k_slab *slab = (k_slab *)PAGING_APPLY_DIRECTMAP(phys);
+    slab->cache = this;
+    slab->used = 0;
+    slab->prev = NULL;
+    slab->next = NULL;
+    slab->freeList = NULL;
+
+    // Link the objects backwards, so they are handed out in address order
+    uint64_t first = ALIGN_UP(sizeof(k_slab), SLAB_CACHE_LINE_SIZE);
+    for (uint64_t i = this->objectsPerSlab; i > 0; i--)
+    {
+        void *object = (void *)((uint64_t)slab + first + (i - 1) * this->objectStride);
+        if (this->constructor)
+            this->constructor(object);
+        *slabObjectLink(this, object) = slab->freeList;
+        slab->freeList = object;
+    }
+
+    this->slabs++;
+
+#ifdef VERBOSE_SLAB
+    logDebugn("%! The %s cache has grown to %d slabs", "[Slab Allocator]", this->name, this->slabs);
+#endif
+
+    return slab;
+}
+
+void k_slab_cache::_release(k_slab *slab)
+{
+    uint64_t pages = this->slabSize / PAGE_SIZE;
+    physical_address_t phys = PAGING_REMOVE_DIRECTMAP(slab);
+
+    if (pages == 1)
+        memoryPhysicalAllocator.freePage(phys);
+    else
+        memoryPhysicalAllocator.freePages(phys, pages);
+
+    this->slabs--;
+}
+
+void k_slab_cache::_setup()
+{
+    this->objectStride = ALIGN_UP(this->objectSize, sizeof(void *)) + sizeof(void *);
+
+    uint64_t first = ALIGN_UP(sizeof(k_slab), SLAB_CACHE_LINE_SIZE);
+    this->slabSize = PAGE_SIZE;
+    while ((this->slabSize - first) / this->objectStride < SLAB_MIN_OBJECTS)
+        this->slabSize *= 2;
+    this->objectsPerSlab = (this->slabSize - first) / this->objectStride;
+
+    slabCachesLock.lock();
+    this->nextCache = slabCaches;
+    slabCaches = this;
+    slabCachesLock.unlock();
+}
+
+void k_slab_pool::init(k_slab_cache *cache)
+{
+    this->cache = cache;
+    this->count = 0;
+    this->lock.locked = 0;
+}
+
+void *k_slab_pool::allocate()
+{
+    void *object = NULL;
+
+    uint64_t rflags = interruptsSave();
+    this->lock.lock();
+    if (this->count > 0)
+        object = this->objects[--this->count];
+    this->lock.unlock();
+    interruptsRestore(rflags);
+
+    return object ? object : this->cache->allocate();
+}
+
+void k_slab_pool::free(void *object)
+{
+    if (!object)
+        return;
+
+    bool kept = false;
+
+    uint64_t rflags = interruptsSave();
+    this->lock.lock();
+    if (this->count < SLAB_POOL_SIZE)
+    {
+        this->objects[this->count++] = object;
+        kept = true;
+    }
+    this->lock.unlock();
+    interruptsRestore(rflags);
+
+    if (!kept)
+        this->cache->free(object);
+}
+
+void slabDumpStatistics()
+{
+    k_slab_cache *cache = slabCaches;
+    while (cache)
+    {
+        cache->dumpStatistics();
+        cache = cache->nextCache;
+    }
+}
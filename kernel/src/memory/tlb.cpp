@@ -0,0 +1,169 @@
+#include <memory/tlb.hpp>
+
+#include <interrupts/interrupts.hpp>
+#include <interrupts/lapic.hpp>
+#include <system/processor/processor.hpp>
+#include <memory/pcid.hpp>
+
+// The space each processor is running
+static physical_address_t tlbActiveSpaces[PROCESSOR_MAX_CPUS];
+
+static k_tlb_mailbox tlbMailboxes[PROCESSOR_MAX_CPUS];
+
+void tlbInvalidatePage(virtual_address_t virt)
+{
+    asm volatile("invlpg [%0]"
+                 :
+                 : "r"(virt)
+                 : "memory");
+}
+
+void tlbFlush()
+{
+    uint64_t cr3;
+    asm volatile("mov %0, cr3"
+                 : "=r"(cr3));
+    asm volatile("mov cr3, %0"
+                 :
+                 : "r"(cr3)
+                 : "memory");
+}
+
+void tlbSetActiveSpace(uint64_t cpu, physical_address_t space)
+{
+    tlbActiveSpaces[cpu] = space;
+}
+
+/**
+ * @brief Invalidate a list of pages on this processor
+ */
+static void tlbInvalidateLocal(virtual_address_t *pages, uint64_t count, bool full)
+{
+    if (full)
+    {
+        tlbFlush();
+        return;
+    }
+
+    for (uint64_t i = 0; i < count; i++)
+        tlbInvalidatePage(pages[i]);
+}
+
+void tlbHandleShootdown(uint64_t)
+{
+    k_tlb_mailbox *mailbox = &tlbMailboxes[processorGetIndex()];
+    if (!mailbox->pending)
+        return;
+
+    tlbInvalidateLocal(mailbox->pages, mailbox->count, mailbox->full);
+    __sync_synchronize();
+    mailbox->pending = 0;
+}
+
+k_tlb_batch::k_tlb_batch(physical_address_t space)
+{
+    this->space = space;
+    this->count = 0;
+    this->full = false;
+    this->kernel = false;
+    this->user = false;
+}
+
+void k_tlb_batch::add(virtual_address_t virt)
+{
+    if (virt < HHDM)
+        this->user = true;
+    else
+        this->kernel = true;
+
+    if (this->full)
+        return;
+
+    if (this->count == TLB_FLUSH_THRESHOLD)
+    {
+        this->full = true;
+        return;
+    }
+
+    this->pages[this->count++] = virt;
+}
+
+void k_tlb_batch::addRange(virtual_address_t virt, uint64_t pages)
+{
+    if (this->count + pages > TLB_FLUSH_THRESHOLD)
+    {
+        if (virt < HHDM)
+            this->user = true;
+        if (virt + pages * PAGE_SIZE > HHDM)
+            this->kernel = true;
+        this->full = true;
+        return;
+    }
+
+    for (uint64_t page = 0; page < pages; page++)
+        this->add(virt + page * PAGE_SIZE);
+}
+
+void k_tlb_batch::flush()
+{
+    if (!this->count && !this->full)
+        return;
+
+    // Kernel mappings are shared by every space, and may be cached anywhere, so a batch
+    // with any of them goes to every processor even if it has user pages too
+    bool kernel = this->kernel;
+
+    uint64_t rflags = interruptsSave();
+    uint64_t self = processorGetIndex();
+
+    // invlpg only reaches the current PCID, the entries other PCIDs hold for these pages
+    // are dropped the next time they are loaded. This must happen before the active spaces
+    // are read, so a processor that is switching to the space either sees it or gets an IPI.
+    if (kernel)
+        pcidInvalidateAll();
+    else
+        pcidInvalidateSpace(this->space);
+    __sync_synchronize();
+
+    if (kernel || (this->user && tlbActiveSpaces[self] == this->space))
+        tlbInvalidateLocal(this->pages, this->count, this->full);
+
+    // Post the request to the other processors running the space, and wait for all of them
+    uint64_t targets[PROCESSOR_MAX_CPUS];
+    uint64_t targetCount = 0;
+    for (uint64_t cpu = 0; cpu < processorGetCount(); cpu++)
+    {
+        if (cpu == self || (!kernel && tlbActiveSpaces[cpu] != this->space))
+            continue;
+
+        k_tlb_mailbox *mailbox = &tlbMailboxes[cpu];
+        mailbox->lock.lock();
+
+        // Wait for a previous request to this processor to be handled
+        while (mailbox->pending)
+            tlbHandleShootdown(0);
+
+        mailbox->count = this->count;
+        mailbox->full = this->full;
+        for (uint64_t i = 0; i < this->count; i++)
+            mailbox->pages[i] = this->pages[i];
+        __sync_synchronize();
+        mailbox->pending = 1;
+        mailbox->lock.unlock();
+
+        lapicSendIPI(processorGetApicId(cpu), TLB_SHOOTDOWN_VECTOR);
+        targets[targetCount++] = cpu;
+    }
+
+    // Keep serving requests to this processor while waiting, two processors may shoot at each other
+    for (uint64_t i = 0; i < targetCount; i++)
+        while (tlbMailboxes[targets[i]].pending)
+            tlbHandleShootdown(0);
+
+    interruptsRestore(rflags);
+
+    this->count = 0;
+    this->full = false;
+    this->kernel = false;
+    this->user = false;
+}
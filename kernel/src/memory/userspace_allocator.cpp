@@ -4,20 +4,40 @@
 #include <memory/heap.hpp>
 #include <memory/paging.hpp>
 #include <memory/memory.hpp>
+#include <memory/pcid.hpp>
+#include <memory/tlb.hpp>
+#include <interrupts/interrupts.hpp>
 #include <kernel.hpp>
 #include <logger/logger.hpp>
 
+/**
+ * @brief Get the start of the pages of a range that may be mapped, lazy ranges
+ *        were only backed from their lowest touched page up
+ */
+static virtual_address_t userspaceBackedStart(k_address_range_header *range)
+{
+    return range->lazy ? range->backedBase : range->base + range->guardPages * PAGE_SIZE;
+}
+
+/**
+ * @brief Get the end of a range
+ */
+static virtual_address_t userspaceRangeEnd(k_address_range_header *range)
+{
+    return range->base + range->pages * PAGE_SIZE;
+}
+
 k_userspace_allocator::k_userspace_allocator()
 {
     this->userspaceCodeStart = NULL;
     this->userspaceHeapStart = NULL;
+    this->kernelspaceRanges = NULL;
+    this->faultLock.locked = 0;
     this->memoryAllocator = new k_virtual_address_range_allocator();
     this->memoryAllocator->addRange(USERSPACE_MEMORY_START + 0x1000, USERSPACE_STACK_MAX);
 
     // Map the memory for the process
-    this->pml4Physical = memoryPhysicalAllocator.allocatePage();
-
-    memset((char*)PAGING_APPLY_DIRECTMAP(this->pml4Physical), 0, PAGE_SIZE);
+    this->pml4Physical = memoryPhysicalAllocator.allocateZeroedPage();
 
     // Copy the kernel mappings
     pagingCopyKernelMappings(this->pml4Physical);
@@ -31,23 +51,15 @@ physical_address_t k_userspace_allocator::getSpace()
     return this->pml4Physical;
 }
 
-static int FAULT_COUNT = 0;
 void k_userspace_allocator::allocateUserspaceCode(uint64_t userspaceCodeSize)
 {
     // Calculate the starting page for the userspace code
     this->userspaceCodeStart = PAGING_ALIGN_PAGE_DOWN(USERSPACE_MEMORY_END - userspaceCodeSize);
 
     // Allocate the space physically
-    uint64_t pages = (USERSPACE_MEMORY_END - this->userspaceCodeStart) / PAGE_SIZE;
-    for (uint64_t page = 0; page < pages; page++)
-    {
-        FAULT_COUNT++;
-        physical_address_t phys = memoryPhysicalAllocator.allocatePage();
-        virtual_address_t virt = this->userspaceCodeStart + PAGE_SIZE * page;
-
-        // Map the page
-        pagingMapPageInSpace(virt, phys, this->pml4Physical, USERSPACE_DEFAULT_PAGING_FLAGS);
-    }
+    if (!pagingAllocateMemoryInTable(this->userspaceCodeStart, USERSPACE_MEMORY_END - this->userspaceCodeStart,
+                                     this->pml4Physical, USERSPACE_DEFAULT_PAGING_FLAGS))
+        kernelPanic("%! Couldn't allocate memory for the userspace code.", "[Userspace Allocator]");
     #ifdef VERBOSE_USERSPACEALLOCATOR
     logDebugn("%! Mapped code area from 0x%64x with size %m.", "[Userspace Allocator]", this->userspaceCodeStart, userspaceCodeSize);
     #endif
@@ -61,11 +73,12 @@ void k_userspace_allocator::allocateUserspaceHeap()
     uint64_t heapEnd = USERSPACE_MEMORY_END - 1 * GiB_unit;//this->userspaceCodeStart;
     uint64_t heapStart = PAGING_ALIGN_PAGE_DOWN(heapEnd - USERSPACE_HEAP_INITIAL_SIZE);
 
-    for (uint64_t virt = heapStart; virt < heapEnd; virt += PAGE_SIZE)
-    {
-        physical_address_t phys = memoryPhysicalAllocator.allocatePage();
-        pagingMapPageInSpace(virt, phys, this->pml4Physical, USERSPACE_DEFAULT_PAGING_FLAGS);
-    }
+    // The heap is only reserved, its pages are backed on first touch
+    this->memoryAllocator->addRange(heapStart, heapEnd);
+    if (!this->memoryAllocator->useRange(heapStart, (heapEnd - heapStart) / PAGE_SIZE))
+        kernelPanic("%! Couldn't reserve the userspace heap.", "[Userspace Allocator]");
+    this->reserve(heapStart, USERSPACE_DEFAULT_PAGING_FLAGS);
+    this->userspaceHeapStart = heapStart;
 
     #ifdef VERBOSE_USERSPACEALLOCATOR
     logDebugn("%! Allocated heap at 0x%64x-0x%64x.", "[Userspace Allocator]", heapStart, heapEnd);
@@ -82,14 +95,16 @@ void k_userspace_allocator::expandUserspaceHeap()
     }
 
     virtual_address_t oldStart = this->userspaceHeapStart;
-    this->userspaceHeapStart -= USERSPACE_HEAP_EXPANSION;
 
-    // Allocate physical memory and map the pages
-    for (uint64_t virt = this->userspaceHeapStart; virt < oldStart; virt += PAGE_SIZE)
+    // Reserve the new window, its pages are backed on first touch
+    this->memoryAllocator->addRange(oldStart - USERSPACE_HEAP_EXPANSION, oldStart);
+    if (!this->memoryAllocator->useRange(oldStart - USERSPACE_HEAP_EXPANSION, USERSPACE_HEAP_EXPANSION / PAGE_SIZE))
     {
-        physical_address_t phys = memoryPhysicalAllocator.allocatePage();
-        pagingMapPageInSpace(virt, phys, this->pml4Physical, USERSPACE_DEFAULT_PAGING_FLAGS);
+        logWarnn("%! Cannot grow heap, the range is in use.", "[Userspace Allocator]");
+        return;
     }
+    this->reserve(oldStart - USERSPACE_HEAP_EXPANSION, USERSPACE_DEFAULT_PAGING_FLAGS);
+    this->userspaceHeapStart -= USERSPACE_HEAP_EXPANSION;
 
     #ifdef VERBOSE_USERSPACEALLOCATOR
     logDebugn("%! Heap expanded now at starts at 0x%64x (instead of 0x%64x)", "[Userspace Allocator]", this->userspaceHeapStart, oldStart);
@@ -104,149 +119,120 @@ void k_userspace_allocator::free()
     #endif
 
     // Free userspace code
-    for (uint64_t virt = this->getUserspaceCodeStart(); virt < this->getUserspaceCodeEnd(); virt += PAGE_SIZE)
-    {
-        physical_address_t phys = pagingUnmapPageInSpace(virt, this->pml4Physical);
-        memoryPhysicalAllocator.freePage(phys);
-    }
+    if (this->getUserspaceCodeStart())
+        pagingFreeMemoryInTable(this->getUserspaceCodeStart(),
+                                this->getUserspaceCodeEnd() - this->getUserspaceCodeStart(),
+                                this->pml4Physical);
 
     #ifdef VERBOSE_USERSPACEALLOCATOR
     logDebugn("\t- Code has been freed");
     #endif
 
-    // Free userspace heap
-    for (uint64_t virt = this->getUserspaceHeapStart(); virt < this->getUserspaceHeapEnd(); virt += PAGE_SIZE)
-    {
-        physical_address_t phys = pagingUnmapPageInSpace(virt, this->pml4Physical);
-        memoryPhysicalAllocator.freePage(phys);
-    }
-
-    #ifdef VERBOSE_USERSPACEALLOCATOR
-    logDebugn("\t- Heap has been freed");
-    #endif
-
-    // Free userspace stacks
+    // Free userspace heap, stacks and reserved ranges, only the touched pages are walked
     k_address_range_header *range = this->memoryAllocator->getRanges();
     while (range)
     {
         if (range->used)
         {
-            virtual_address_t virt = range->base;
-            uint64_t pages = range->pages;
-
-            // Unmap and free each page
-            for (uint64_t page = 0; page < pages; page++)
-            {
-                physical_address_t phys = pagingUnmapPageInSpace(virt + PAGE_SIZE * page, this->pml4Physical);
-                memoryPhysicalAllocator.freePage(phys);
-            }
+            virtual_address_t start = userspaceBackedStart(range);
+            pagingFreeMemoryInTable(start, userspaceRangeEnd(range) - start, this->pml4Physical);
         }
         range = range->next;
     }
 
     #ifdef VERBOSE_USERSPACEALLOCATOR
-    logDebugn("\t- Userspace stacks has been freed");
+    logDebugn("\t- Heap and userspace stacks has been freed");
     #endif
 
     // Free kernelspace stacks and interrupt stacks
     range = this->kernelspaceRanges;
     while (range)
     {
-        if (range->used)
-        {
-            virtual_address_t virt = range->base;
-            uint64_t pages = range->pages;
+        virtual_address_t start = userspaceBackedStart(range);
+        pagingFreeMemoryInTable(start, userspaceRangeEnd(range) - start, this->pml4Physical);
+        virtualAddressRangeAllocator.freeRange(range->base);
 
-            // Unmap and free each page
-            for (uint64_t page = 0; page < pages; page++)
-            {
-                physical_address_t phys = pagingUnmapPageInSpace(virt + PAGE_SIZE * page, this->pml4Physical);
-                memoryPhysicalAllocator.freePage(phys);
-            }
-        }
-        range = range->next;
+        k_address_range_header *next = range->next;
+        delete range;
+        range = next;
     }
+    this->kernelspaceRanges = NULL;
 
     #ifdef VERBOSE_USERSPACEALLOCATOR
     logDebugn("\t- Kernelspace stacks and interrupt stacks has been freed");
     #endif
+
+    // The PML4 may be reused by another space, which must not inherit its PCIDs
+    pcidReleaseSpace(this->pml4Physical);
 }
 
 virtual_address_t k_userspace_allocator::allocateStack(uint64_t stackSize, bool kernelStack)
 {
     uint64_t pages = PAGING_ALIGN_PAGE_UP(stackSize) / PAGE_SIZE;
 
-    virtual_address_t stackPtr;
-    k_paging_flags flags;
-    if (!kernelStack)
-    {
-        stackPtr = this->memoryAllocator->allocateRange(pages, "usal");
-        flags = USERSPACE_DEFAULT_PAGING_FLAGS;
-    }
-    else
-    {
-        stackPtr = virtualAddressRangeAllocator.allocateRange(pages, "usal");
-        k_address_range_header *range = new k_address_range_header();
-        range->base = stackPtr;
-        range->pages = pages;
-        range->next = this->kernelspaceRanges;
-        this->kernelspaceRanges = range->next;
-        flags = PAGING_DEFAULT_FLAGS;
-    }
+    if (kernelStack)
+        return this->_allocateKernelStack(pages);
 
-    if (!stackPtr)
+    // The whole extent is reserved, the stack grows downwards into it as it's touched
+    virtual_address_t rangeStart = this->memoryAllocator->allocateRange(pages + STACK_GUARD_PAGES, "usal");
+    if (!rangeStart)
     {
         logWarnn("%! Couldn't allocate %d pages for a thread stack", "[Userspace Allocator]", pages);
         // TODO: do something about it
         return NULL;
     }
 
-    // Allocated on physical memory
-    for (uint64_t page = 0; page < pages; page++)
-    {
-        physical_address_t phys = memoryPhysicalAllocator.allocatePage();
-        pagingMapPageInSpace(stackPtr + PAGE_SIZE * page, phys, this->pml4Physical, flags);
-    }
+    this->reserve(rangeStart, USERSPACE_DEFAULT_PAGING_FLAGS);
+    this->memoryAllocator->findRange(rangeStart)->guardPages = STACK_GUARD_PAGES;
+
+    virtual_address_t stackPtr = rangeStart + STACK_GUARD_PAGES * PAGE_SIZE;
 
     #ifdef VERBOSE_USERSPACEALLOCATOR
-    logDebugn("%! Allocated stack starting at 0x%64x with size %m", "[Userspace Allocator]", stackPtr, PAGING_ALIGN_PAGE_UP(stackSize));
+    logDebugn("%! Reserved stack starting at 0x%64x with size %m", "[Userspace Allocator]", stackPtr, pages * PAGE_SIZE);
     #endif
 
-    return stackPtr - sizeof(uint64_t);
+    return stackPtr;
 }
 
 virtual_address_t k_userspace_allocator::allocateInterruptStack(uint64_t stackSize)
 {
-    uint64_t pages = PAGING_ALIGN_PAGE_UP(stackSize) / PAGE_SIZE;
-
-    virtual_address_t stackPtr;
-
-    stackPtr = virtualAddressRangeAllocator.allocateRange(pages, "usal");
-    k_address_range_header *range = new k_address_range_header();
-    range->base = stackPtr;
-    range->pages = pages;
-    range->next = this->kernelspaceRanges;
-    this->kernelspaceRanges = range->next;
+    return this->_allocateKernelStack(PAGING_ALIGN_PAGE_UP(stackSize) / PAGE_SIZE);
+}
 
-    if (!stackPtr)
+virtual_address_t k_userspace_allocator::_allocateKernelStack(uint64_t pages)
+{
+    virtual_address_t rangeStart = virtualAddressRangeAllocator.allocateRange(pages + STACK_GUARD_PAGES, "usal");
+    if (!rangeStart)
     {
-        logWarnn("%! Couldn't allocate %d pages for a thread interrupt stack", "[Userspace Allocator]", pages);
+        logWarnn("%! Couldn't allocate %d pages for a kernel stack", "[Userspace Allocator]", pages);
         // TODO: do something about it
         return NULL;
     }
 
-    // Allocated on physical memory
-    for (uint64_t page = 0; page < pages; page++)
+    virtual_address_t stackPtr = rangeStart + STACK_GUARD_PAGES * PAGE_SIZE;
+
+    // Kernel stacks can't fault, allocate them on physical memory, the guard pages stay unmapped
+    if (!pagingAllocateMemoryInTable(stackPtr, pages * PAGE_SIZE, this->pml4Physical, PAGING_DEFAULT_FLAGS))
     {
-        physical_address_t phys = memoryPhysicalAllocator.allocatePage();
-        pagingMapPageInSpace(stackPtr + PAGE_SIZE * page, phys, this->pml4Physical, PAGING_DEFAULT_FLAGS);
+        logWarnn("%! Couldn't allocate %d physical pages for a kernel stack", "[Userspace Allocator]", pages);
+        virtualAddressRangeAllocator.freeRange(rangeStart);
+        // TODO: do something about it
+        return NULL;
     }
 
+    k_address_range_header *range = new k_address_range_header();
+    range->base = rangeStart;
+    range->pages = pages + STACK_GUARD_PAGES;
+    range->guardPages = STACK_GUARD_PAGES;
+    range->used = true;
+    range->next = this->kernelspaceRanges;
+    this->kernelspaceRanges = range;
+
     #ifdef VERBOSE_USERSPACEALLOCATOR
-    logDebugn("%! Allocated interrupt stack starting at 0x%64x with size %m", "[Userspace Allocator]", stackPtr, PAGING_ALIGN_PAGE_UP(stackSize));
+    logDebugn("%! Allocated kernel stack starting at 0x%64x with size %m", "[Userspace Allocator]", stackPtr, pages * PAGE_SIZE);
     #endif
 
-    return stackPtr - sizeof(uint64_t);
+    return stackPtr;
 }
 
 void k_userspace_allocator::copyTo(k_userspace_allocator *target)
@@ -256,13 +242,34 @@ void k_userspace_allocator::copyTo(k_userspace_allocator *target)
     {
         if (range->used)
         {
-            target->allocateStack(range->base, range->pages * PAGE_SIZE);
+            // The heap lies outside of the initial range
+            if (!target->memoryAllocator->useRange(range->base, range->pages))
+            {
+                target->memoryAllocator->addRange(range->base, range->base + range->pages * PAGE_SIZE);
+                if (!target->memoryAllocator->useRange(range->base, range->pages))
+                    kernelPanic("%! Couldn't copy the range at 0x%64x.", "[Userspace Allocator]", range->base);
+            }
+
+            k_address_range_header *copy = target->memoryAllocator->findRange(range->base);
+            copy->lazy = range->lazy;
+            copy->flags = range->flags;
+            copy->backedBase = range->backedBase;
+            copy->guardPages = range->guardPages;
+
+            // Only the pages that were touched can be mapped
+            virtual_address_t start = userspaceBackedStart(range);
+            uint64_t shared = pagingShareMemoryInTable(start, userspaceRangeEnd(range) - start,
+                                                       this->pml4Physical, target->pml4Physical, range->flags);
+            (void)shared;
+
+            #ifdef VERBOSE_USERSPACEALLOCATOR
+            logDebugn("%! Shared %d pages of range 0x%64x", "[Userspace Allocator]", shared, range->base);
+            #endif
         }
         range = range->next;
     }
 
-    virtual_address_t stackPtr;
-    k_paging_flags flags;
+    target->userspaceHeapStart = this->userspaceHeapStart;
 }
 
 bool k_userspace_allocator::allocateRange(virtual_address_t start, uint64_t size) {
@@ -272,21 +279,175 @@ bool k_userspace_allocator::allocateRange(virtual_address_t start, uint64_t size
 
     if (!this->memoryAllocator->useRange(startAligned, pages))
         return false;
-        
-    for (uint64_t page = 0; page < pages; page++)
+
+    // The pages are zeroed when they are backed
+    this->reserve(startAligned, USERSPACE_DEFAULT_PAGING_FLAGS);
+
+    return true;
+}
+
+virtual_address_t k_userspace_allocator::reserveRange(uint64_t size)
+{
+    uint64_t pages = PAGING_ALIGN_PAGE_UP(size) / PAGE_SIZE;
+
+    virtual_address_t start = this->memoryAllocator->allocateRange(pages, "usal");
+    if (!start)
+        return NULL;
+
+    this->reserve(start, USERSPACE_DEFAULT_PAGING_FLAGS);
+
+    return start;
+}
+
+void k_userspace_allocator::freeRange(virtual_address_t start)
+{
+    k_address_range_header *range = this->memoryAllocator->findRange(start);
+    if (!range || range->base != start)
+    {
+        logWarnn("%! Tried to free a non-existing range, base 0x%64x.", "[Userspace Allocator]", start);
+        return;
+    }
+
+    // Only the pages that were touched are mapped
+    virtual_address_t backed = userspaceBackedStart(range);
+    pagingFreeMemoryInTable(backed, userspaceRangeEnd(range) - backed, this->pml4Physical);
+    this->memoryAllocator->freeRange(start);
+}
+
+void k_userspace_allocator::reserve(virtual_address_t start, k_paging_flags flags)
+{
+    k_address_range_header *range = this->memoryAllocator->findRange(start);
+    range->lazy = true;
+    range->flags = flags;
+    range->backedBase = userspaceRangeEnd(range);
+}
+
+bool k_userspace_allocator::handlePageFault(virtual_address_t address)
+{
+    k_address_range_header *range = this->memoryAllocator->findRange(address);
+    if (!range || !range->lazy)
+        return false;
+
+    virtual_address_t page = PAGING_ALIGN_PAGE_DOWN(address);
+
+    if (page < range->base + range->guardPages * PAGE_SIZE)
+    {
+        logWarnn("%! Stack overflow, 0x%64x hit the guard page of the stack at 0x%64x.", "[Userspace Allocator]",
+                 address, range->base + range->guardPages * PAGE_SIZE);
+        return false;
+    }
+
+    uint64_t rflags = interruptsSave();
+    this->faultLock.lock();
+
+    // Another thread of the process may have backed the page while we waited
+    if (!pagingVirtualToPhysical(page))
     {
-        physical_address_t phys = memoryPhysicalAllocator.allocatePage();
-        pagingMapPageInSpace(start + page * PAGE_SIZE, phys, this->pml4Physical, USERSPACE_DEFAULT_PAGING_FLAGS);
+        physical_address_t phys = memoryPhysicalAllocator.allocateZeroedPage();
+        if (!phys)
+        {
+            this->faultLock.unlock();
+            interruptsRestore(rflags);
+            logWarnn("%! Out of physical memory while backing 0x%64x.", "[Userspace Allocator]", page);
+            return false;
+        }
+
+        pagingMapPageInSpace(page, phys, this->pml4Physical, range->flags);
+        this->_ownPage(phys);
+
+        if (page < range->backedBase)
+            range->backedBase = page;
+
+        #ifdef VERBOSE_USERSPACEALLOCATOR
+        logDebugn("%! Backed page 0x%64x with 0x%64x", "[Userspace Allocator]", page, phys);
+        #endif
     }
-    
-    memset((char *)startAligned, 0, pages * PAGE_SIZE);
+
+    this->faultLock.unlock();
+    interruptsRestore(rflags);
 
     return true;
 }
 
+bool k_userspace_allocator::handleWriteFault(virtual_address_t address)
+{
+    k_address_range_header *range = this->memoryAllocator->findRange(address);
+    if (!range || !(range->flags.ptFlags & PAGE_READWRITE))
+        return false;
+
+    virtual_address_t page = PAGING_ALIGN_PAGE_DOWN(address);
+
+    uint64_t rflags = interruptsSave();
+    this->faultLock.lock();
+
+    pagetable_entry_t *pte = pagingGetPageEntryInSpace(page, this->pml4Physical);
+    if (!pte || !(*pte & PAGE_PRESENT))
+    {
+        this->faultLock.unlock();
+        interruptsRestore(rflags);
+        return false;
+    }
+
+    // Another thread of the process may have copied the page while we waited
+    if (!(*pte & PAGE_READWRITE))
+    {
+        physical_address_t shared = ADDRESS_EXCLUDE(*pte);
+        if (!memoryPhysicalAllocator.pageShares(shared))
+        {
+            // Every other space let go of the page, it is ours now
+            *pte |= PAGE_READWRITE;
+            tlbInvalidatePage(page);
+        }
+        else
+        {
+            physical_address_t copy = memoryPhysicalAllocator.allocatePage();
+            if (!copy)
+            {
+                this->faultLock.unlock();
+                interruptsRestore(rflags);
+                logWarnn("%! Out of physical memory while copying 0x%64x.", "[Userspace Allocator]", page);
+                return false;
+            }
+
+            memcpy((void *)PAGING_APPLY_DIRECTMAP(copy), (void *)PAGING_APPLY_DIRECTMAP(shared), PAGE_SIZE);
+            pagingMapPageInSpace(page, copy, this->pml4Physical, range->flags, true);
+            this->_ownPage(copy);
+
+            // Drops this space's share of the page
+            memoryPhysicalAllocator.freePage(shared);
+        }
+
+        #ifdef VERBOSE_USERSPACEALLOCATOR
+        logDebugn("%! Copied on write page 0x%64x", "[Userspace Allocator]", page);
+        #endif
+    }
+
+    this->faultLock.unlock();
+    interruptsRestore(rflags);
+
+    return true;
+}
+
+void k_userspace_allocator::_ownPage(physical_address_t phys)
+{
+    k_page *page = memoryPhysicalAllocator.getPage(phys);
+    if (!page)
+        return;
+
+    page->flags |= PAGE_FRAME_USER;
+    page->owner = this->pml4Physical;
+}
+
 void k_userspace_allocator::freeStack(virtual_address_t stackPtr)
 {
-    this->memoryAllocator->freeRange(stackPtr);
+    k_address_range_header *range = this->memoryAllocator->findRange(stackPtr);
+    if (!range || !range->used)
+    {
+        logWarnn("%! Tried to free a non-existing stack, 0x%64x.", "[Userspace Allocator]", stackPtr);
+        return;
+    }
+
+    this->freeRange(range->base);
 }
 
 virtual_address_t k_userspace_allocator::getUserspaceCodeStart()
@@ -2,164 +2,144 @@
 
 #include <memory/heap.hpp>
 #include <memory/paging.hpp>
+#include <interrupts/interrupts.hpp>
 #include <logger/logger.hpp>
 #include <stddef.h>
 #include <strings.hpp>
 
+k_slab_cache addressRangeCache = SLAB_CACHE_INITIALIZER("k_address_range_header", k_address_range_header, NULL);
+SLAB_DEFINE_OPERATORS(k_address_range_header, addressRangeCache)
+
+/**
+ * @brief Orders ranges by their base
+ */
+static int rangeCompareBase(const k_avl_node *a, const k_avl_node *b)
+{
+    virtual_address_t baseA = AVL_ENTRY(a, k_address_range_header, addressNode)->base;
+    virtual_address_t baseB = AVL_ENTRY(b, k_address_range_header, addressNode)->base;
+    return baseA < baseB ? -1 : baseA > baseB;
+}
+
+/**
+ * @brief Orders ranges by their size, and ranges of the same size by their base
+ */
+static int rangeCompareSize(const k_avl_node *a, const k_avl_node *b)
+{
+    k_address_range_header *rangeA = AVL_ENTRY(a, k_address_range_header, sizeNode);
+    k_address_range_header *rangeB = AVL_ENTRY(b, k_address_range_header, sizeNode);
+
+    if (rangeA->pages != rangeB->pages)
+        return rangeA->pages < rangeB->pages ? -1 : 1;
+    return rangeA->base < rangeB->base ? -1 : rangeA->base > rangeB->base;
+}
+
 k_virtual_address_range_allocator::k_virtual_address_range_allocator()
 {
     this->head = 0;
+    this->addressTree.root = NULL;
+    this->sizeTree.root = NULL;
+    this->lock.locked = 0;
 }
 
 void k_virtual_address_range_allocator::addRange(virtual_address_t start, virtual_address_t end)
 {
     // TODO: check that start and end are page aligned
-    k_address_range_header *addressHeader = new k_address_range_header();
-
-    addressHeader->base = start;
-    addressHeader->pages = (end - start) / PAGE_SIZE;
-    addressHeader->used = false;
-
-    if (!this->head)
-    {
-        this->head = addressHeader;
-    }
-    else
-    {
-        // We need to sort the list, so we may be able to merge ranges
-        k_address_range_header *found = 0;
-        k_address_range_header *curr = this->head;
+    uint64_t rflags = interruptsSave();
+    this->lock.lock();
 
-        while (curr)
-        {
-            if (addressHeader->base < curr->base)
-                found = curr;
-            curr = curr->next;
-        }
-
-        if (found)
-        {
-            // Put it in between the lower range and higher range
-            addressHeader->next = found->next;
-            found->next = addressHeader;
-        }
-        else
-        {
-            // It's the smallest in the list, it shall be first
-            addressHeader->next = this->head->next;
-            this->head = addressHeader;
-        }
-    }
+    k_address_range_header *addressHeader = this->insertRange(this->floorRange(start), start, (end - start) / PAGE_SIZE);
 
 #ifdef VERBOSE_VADDRALLOCATOR
     logDebugn("%! Added range 0x%64x-0x%64x (%d pages)", "[VAddr Allocator]", start, end, addressHeader->pages);
 #endif
 
-    this->mergeAll();
+    this->mergeRange(addressHeader);
+
+    this->lock.unlock();
+    interruptsRestore(rflags);
 }
 
 virtual_address_t k_virtual_address_range_allocator::allocateRange(uint64_t pages, const char *request)
 {
-    k_address_range_header *range = this->head;
+    uint64_t rflags = interruptsSave();
+    this->lock.lock();
 
-    // Find a range to fit the allocation
-    while (range)
+    // Find the smallest range to fit the allocation
+    k_address_range_header *range = NULL;
+    k_avl_node *node = this->sizeTree.root;
+    while (node)
     {
-        if (!range->used && range->pages >= pages)
-            break;
-
-        range = range->next;
+        k_address_range_header *candidate = AVL_ENTRY(node, k_address_range_header, sizeNode);
+        if (candidate->pages >= pages)
+        {
+            range = candidate;
+            node = node->left;
+        }
+        else
+            node = node->right;
     }
 
     if (!range)
     {
+        this->lock.unlock();
+        interruptsRestore(rflags);
         logWarnn("%! Couldn't find any virtual ranges to fit allocation of %d pages.", "[VAddr Allocator]", pages);
         return NULL;
     }
 
+    this->sizeTree.remove(&range->sizeNode);
     range->used = true;
     memcpy(range->requestBy, request, 4);
 
     if (range->pages > pages)
-    {
-        k_address_range_header *split = new k_address_range_header();
-        split->used = false;
-        split->next = range->next;
-        split->pages = range->pages - pages;
-        split->base = range->base + pages * PAGE_SIZE;
-
-        lastSplit = split;
-
-        range->next = split;
-    }
-
-    range->pages = pages;
-
-#ifdef VERBOSE_VADDRALLOCATOR
-    logDebugn("%! Allocated %d pages, from base 0x%64x.", "[VAddr Allocator]", pages, range->base);
-#endif
-
-    return range->base;
-}
+        this->splitRange(range, pages);
 
-void k_virtual_address_range_allocator::mergeAll()
-{
-    k_address_range_header *range = this->head;
-
-    while (range && range->next)
-    {
-        if (!range->used &&
-            !range->next->used &&
-            (range->base + range->pages * PAGE_SIZE == range->next->base))
-        {
-            // Ranges aren't in use, and they continue each other
-            // therefore we can merge them
-            range->pages += range->next->pages;
-            k_address_range_header *followingRange = range->next;
-            range->next = followingRange->next;
+    virtual_address_t base = range->base;
+    this->lock.unlock();
+    interruptsRestore(rflags);
 
 #ifdef VERBOSE_VADDRALLOCATOR
-            logDebugn("%! Successfully merged ranges from %d pages to %d pages.",
-                      "[VAddr Allocator]",
-                      range->pages - followingRange->pages,
-                      range->pages);
+    logDebugn("%! Allocated %d pages, from base 0x%64x.", "[VAddr Allocator]", pages, base);
 #endif
 
-            // no longer need to next range header
-            delete followingRange;
-        }
-        else
-        {
-            range = range->next;
-        }
-    }
+    return base;
 }
 
 void k_virtual_address_range_allocator::freeRange(virtual_address_t base)
 {
-    // find the range to free
-    k_address_range_header *range = this->head;
+    uint64_t rflags = interruptsSave();
+    this->lock.lock();
 
-    while (range && range->base != base)
-        range = range->next;
+    // find the range to free
+    k_address_range_header *range = this->floorRange(base);
 
-    if (!range)
+    if (!range || range->base != base)
     {
+        this->lock.unlock();
+        interruptsRestore(rflags);
         logWarnn("%! Tried to free a non-existing range, base 0x%64x.", "[VAddr Allocator]", base);
         return;
     }
 
     if (!range->used)
     {
+        this->lock.unlock();
+        interruptsRestore(rflags);
         logWarnn("%! Tried to free a free range, base 0x%64x.", "[VAddr Allocator]", base);
         return;
     }
 
     range->used = false;
+    range->lazy = false;
+    range->guardPages = 0;
+    range->backedBase = 0;
 #ifdef VERBOSE_VADDRALLOCATOR
     logDebugn("%! Successfully freed range of size %d pages, base 0x%64x", "[VAddr Allocator]", range->pages, range->base);
 #endif
-    this->mergeAll();
+    this->mergeRange(range);
+
+    this->lock.unlock();
+    interruptsRestore(rflags);
 }
 
 k_address_range_header *k_virtual_address_range_allocator::getRanges()
@@ -169,58 +149,140 @@ k_address_range_header *k_virtual_address_range_allocator::getRanges()
 
 bool k_virtual_address_range_allocator::useRange(virtual_address_t start, uint64_t size)
 {
+    uint64_t rflags = interruptsSave();
+    this->lock.lock();
+
     // Look for the range contains the range to remove
-    k_address_range_header *range = this->head;
-    k_address_range_header *prev = NULL;
+    k_address_range_header *range = this->floorRange(start);
+    if (!range || range->used || start + size * PAGE_SIZE > range->base + range->pages * PAGE_SIZE)
+    {
+        this->lock.unlock();
+        interruptsRestore(rflags);
+        return false;
+    }
+
+    this->sizeTree.remove(&range->sizeNode);
+
+    if (range->base != start)
+    {
+        // Split the lower part off, it stays free
+        uint64_t lowerPages = (start - range->base) / PAGE_SIZE;
+        k_address_range_header *split = this->insertRange(range, start, range->pages - lowerPages);
+
+        range->pages = lowerPages;
+        this->sizeTree.insert(&range->sizeNode, rangeCompareSize);
+        range = split;
+    }
+
+    // Split the higher part off, it stays free
+    if (range->pages > size)
+        this->splitRange(range, size);
+
+    range->used = true;
+
+    this->lock.unlock();
+    interruptsRestore(rflags);
+    return true;
+}
 
-    uint64_t startAligned = PAGING_ALIGN_PAGE_DOWN(start);
-    uint64_t sizePages = size;
-    uint64_t sizeAligned = size * PAGE_SIZE;
-    while (range)
+k_address_range_header *k_virtual_address_range_allocator::findRange(virtual_address_t address)
+{
+    uint64_t rflags = interruptsSave();
+    this->lock.lock();
+
+    k_address_range_header *range = this->floorRange(address);
+    if (range && !(range->used && address < range->base + range->pages * PAGE_SIZE))
+        range = NULL;
+
+    this->lock.unlock();
+    interruptsRestore(rflags);
+    return range;
+}
+
+k_address_range_header *k_virtual_address_range_allocator::floorRange(virtual_address_t address)
+{
+    k_address_range_header *floor = NULL;
+    k_avl_node *node = this->addressTree.root;
+    while (node)
     {
-        if (!range->used)
+        k_address_range_header *range = AVL_ENTRY(node, k_address_range_header, addressNode);
+        if (range->base <= address)
         {
-            if (((virtual_address_t)range->base <= startAligned) &&
-                startAligned + sizeAligned < ((virtual_address_t)range->base + range->pages * PAGE_SIZE))
-            {
-                if (range->base == startAligned)
-                {
-                    k_address_range_header *split = new k_address_range_header();
-                    split->used = false;
-                    split->next = range->next;
-                    split->pages = range->pages - sizePages;
-                    split->base = range->base + sizeAligned;
-                    range->used = true;
-
-                    range->next = split;
-                }
-                else
-                {
-                    k_address_range_header *split1 = new k_address_range_header();
-                    k_address_range_header *split2 = new k_address_range_header();
-
-                    split1->pages = sizePages;
-                    split1->base = startAligned;
-                    split1->used = true;
-                    split1->next = split2;
-
-                    split2->next = range->next;
-                    split2->pages = range->pages;
-                    split2->base = split1->base + split1->pages * PAGE_SIZE;
-                    split2->used = false;
-
-                    range->next = split1;
-                    range->pages = (split1->base - range->base) / PAGE_SIZE;
-
-                    split2->pages -= range->pages + split1->pages;
-                }
-
-                return true;
-            }
+            floor = range;
+            node = node->right;
         }
-        prev = range;
-        range = range->next;
+        else
+            node = node->left;
     }
 
-    return false;
-}
\ No newline at end of file
+    return floor;
+}
+
+k_address_range_header *k_virtual_address_range_allocator::insertRange(k_address_range_header *after,
+                                                                       virtual_address_t base, uint64_t pages)
+{
+    k_address_range_header *range = new k_address_range_header();
+    range->base = base;
+    range->pages = pages;
+    range->used = false;
+
+    range->prev = after;
+    range->next = after ? after->next : this->head;
+    if (range->next)
+        range->next->prev = range;
+    if (after)
+        after->next = range;
+    else
+        this->head = range;
+
+    this->addressTree.insert(&range->addressNode, rangeCompareBase);
+    return range;
+}
+
+void k_virtual_address_range_allocator::removeRange(k_address_range_header *range)
+{
+    if (range->prev)
+        range->prev->next = range->next;
+    else
+        this->head = range->next;
+    if (range->next)
+        range->next->prev = range->prev;
+
+    this->addressTree.remove(&range->addressNode);
+    delete range;
+}
+
+void k_virtual_address_range_allocator::splitRange(k_address_range_header *range, uint64_t pages)
+{
+    k_address_range_header *split = this->insertRange(range, range->base + pages * PAGE_SIZE, range->pages - pages);
+    range->pages = pages;
+
+    this->sizeTree.insert(&split->sizeNode, rangeCompareSize);
+}
+
+void k_virtual_address_range_allocator::mergeRange(k_address_range_header *range)
+{
+    // Ranges that aren't in use, and continue each other, are merged
+    k_address_range_header *prev = range->prev;
+    if (prev && !prev->used && prev->base + prev->pages * PAGE_SIZE == range->base)
+    {
+        this->sizeTree.remove(&prev->sizeNode);
+        prev->pages += range->pages;
+        this->removeRange(range);
+        range = prev;
+    }
+
+    k_address_range_header *next = range->next;
+    if (next && !next->used && range->base + range->pages * PAGE_SIZE == next->base)
+    {
+        this->sizeTree.remove(&next->sizeNode);
+        range->pages += next->pages;
+        this->removeRange(next);
+    }
+
+#ifdef VERBOSE_VADDRALLOCATOR
+    logDebugn("%! Free range at 0x%64x has %d pages.", "[VAddr Allocator]", range->base, range->pages);
+#endif
+
+    this->sizeTree.insert(&range->sizeNode, rangeCompareSize);
+}
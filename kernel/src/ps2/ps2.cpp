@@ -10,6 +10,7 @@
 #include <system/pit.hpp>
 
 #include <tasking/tasking.hpp>
+#include <filesystem.hpp>
 
 #include <strings.hpp>
 
@@ -183,6 +184,9 @@ namespace PS2
                 if (focusedProcess != NULL)
                 {
                     FIL *stdin = &focusedProcess->stdin;
+
+                    // The interrupts are already disabled in the handler
+                    filesystemLock();
                     long stdinReadPtr = f_tell(stdin);
 
                     f_lseek(stdin, focusedProcess->stdinWritePtr);
@@ -192,6 +196,10 @@ namespace PS2
 
                     focusedProcess->stdinWritePtr += bytesWritten;
                     f_lseek(stdin, stdinReadPtr);
+                    filesystemUnlock();
+
+                    // Readers blocked on stdin read again
+                    focusedProcess->stdinWaiters.wakeAll();
                 }
             }
     }
@@ -3,8 +3,10 @@
 #include <logger/logger.hpp>
 #include <memory/paging.hpp>
 #include <memory/memory.hpp>
+#include <memory/heap.hpp>
 #include <stddef.h>
 #include <kernel.hpp>
+#include <interrupts/interrupts.hpp>
 
 #include <strings.hpp>
 
@@ -41,17 +43,28 @@ bool k_ahci_driver::initialize(uint8_t drive)
 
     k_ahci_port *port = this->ports[drive];
 
+    uint64_t rflags = interruptsSave();
+    port->lock.lock();
+
     if (port->initialized)
+    {
+        port->lock.unlock();
+        interruptsRestore(rflags);
         return true;
+    }
 
     port->rebase();
 
-    port->identity = (k_SATA_ident *)virtualAddressRangeAllocator.allocateRange(1, "ahci");
-    pagingMapPage((virtual_address_t)port->identity, memoryPhysicalAllocator.allocatePage());
+    // The identify buffer is a single PRD, so it must not cross a page
+    port->identity = (k_SATA_ident *)heapAllocateAligned(PAGE_SIZE, PAGE_SIZE);
     memset((char *)port->identity, 0, 0x1000);
 
     port->identify();
 
+    bool initialized = port->initialized;
+    port->lock.unlock();
+    interruptsRestore(rflags);
+
 #ifdef VERBOSE_AHCI
     logDebugn("%! Initialized drive on port %d with:\
                 \n\t- Sector count: %d",
@@ -59,7 +72,7 @@ bool k_ahci_driver::initialize(uint8_t drive)
 
 #endif
 
-    return port->initialized;
+    return initialized;
 }
 
 bool k_ahci_driver::status(uint8_t drive)
@@ -86,11 +99,17 @@ bool k_ahci_driver::read(uint8_t drive, uint64_t sector, uint32_t count, uint8_t
     if (!port->initialized)
         return false;
 
-    port->buffer = buf;
     uint32_t sectorl = (uint32_t)sector;
     uint32_t sectorh = (uint32_t)(sector >> 32);
 
-    return port->read(sectorl, sectorh, count, buf);
+    uint64_t rflags = interruptsSave();
+    port->lock.lock();
+    port->buffer = buf;
+    bool result = port->read(sectorl, sectorh, count, buf);
+    port->lock.unlock();
+    interruptsRestore(rflags);
+
+    return result;
 }
 
 bool k_ahci_driver::write(uint8_t drive, uint64_t sector, uint32_t count, uint8_t *buf)
@@ -103,11 +122,17 @@ bool k_ahci_driver::write(uint8_t drive, uint64_t sector, uint32_t count, uint8_
     if (!port->initialized)
         return false;
 
-    port->buffer = buf;
     uint32_t sectorl = (uint32_t)sector;
     uint32_t sectorh = (uint32_t)(sector >> 32);
 
-    return port->write(sectorl, sectorh, count, buf);
+    uint64_t rflags = interruptsSave();
+    port->lock.lock();
+    port->buffer = buf;
+    bool result = port->write(sectorl, sectorh, count, buf);
+    port->lock.unlock();
+    interruptsRestore(rflags);
+
+    return result;
 }
 
 // Check device type
@@ -225,25 +250,12 @@ void k_ahci_port::rebase()
     this->initialized = true;
 
     // Rebase the CLB (Command List Base Address)
-    // Note that that address must be 1024byte-aligned and we complying with this
-    // request since a page is 4096byte-aligned
-    physical_address_t clbPhys = memoryPhysicalAllocator.allocatePage();
-    if (!clbPhys)
-    {
-        this->initialized = false;
-        return;
-    }
-
+    // Note that that address must be 1024byte-aligned, so it doesn't cross a page
+    virtual_address_t clbVirt = (virtual_address_t)heapAllocateAligned(1024, 1024);
+    physical_address_t clbPhys = pagingVirtualToPhysical(clbVirt);
     this->hbaPort->clb = clbPhys;
     this->hbaPort->clbu = clbPhys >> 32;
 
-    virtual_address_t clbVirt = virtualAddressRangeAllocator.allocateRange(1, "ahci");
-    if (!clbVirt)
-    {
-        this->initialized = false;
-        return;
-    }
-    pagingMapPage(clbVirt, clbPhys);
     // Reset the memory
     memset((char *)clbVirt, 0, 1024);
 
@@ -251,14 +263,12 @@ void k_ahci_port::rebase()
     this->virtualCLB = (k_HBA_cmd_header *)clbVirt;
 
     // Rebase the FB
-    // Note that that address must be 256byte-aligned and we complying with this
-    // request since a we are 1024byte-aligned
-    physical_address_t fbPhys = clbPhys + 1024;
+    // Note that that address must be 256byte-aligned
+    virtual_address_t fbVirt = (virtual_address_t)heapAllocateAligned(256, 256);
+    physical_address_t fbPhys = pagingVirtualToPhysical(fbVirt);
     this->hbaPort->fb = fbPhys;
     this->hbaPort->fbu = fbPhys >> 32;
 
-    virtual_address_t fbVirt = clbVirt + 1024;
-    // We don't need (and can't) to map a page, it the same page of the CLB
     // Reset the memory
     memset((char *)fbVirt, 0, 256);
 
@@ -266,36 +276,26 @@ void k_ahci_port::rebase()
     this->virtualFB = fbVirt;
 
     // Rebase all the CTBs (Command Table Base Addresses)
+    // There are in total 8KiB for the CTBs, the heap's pages aren't physically
+    // contiguous, but a page aligned block keeps every CTB inside a single page
     k_HBA_cmd_header *cmdheader = this->virtualCLB;
-    // There are in total 8KiB for the CTBs, so we will map 2 pages for it
-    int CHi = 0;
-    for (int t = 0; t < 2; t++)
-    {
-        physical_address_t ctbPhys = memoryPhysicalAllocator.allocatePage();
-        virtual_address_t ctbVirt = virtualAddressRangeAllocator.allocateRange(1, "ahci");
-        if (!ctbPhys || !ctbVirt)
-        {
-            this->initialized = false;
-            return;
-        }
-        pagingMapPage(ctbVirt, ctbPhys);
-
-        for (int offset = 0; offset < PAGE_SIZE; offset += 256)
-        {
-            cmdheader[CHi].prdtl = 8; // 8 PRDT entries per CTB
+    virtual_address_t ctbVirt = (virtual_address_t)heapAllocateAligned(2 * PAGE_SIZE, PAGE_SIZE);
 
-            // Set the pointer to the physical address of the command table
-            cmdheader[CHi].ctba = ctbPhys + offset;
-            cmdheader[CHi].ctbau = (ctbPhys + offset) >> 32;
+    // Reset the memory
+    memset((char *)ctbVirt, 0, 2 * PAGE_SIZE);
 
-            // Save a copy of the virtual address
-            this->virtualCTBs[CHi] = (k_HBA_cmd_table *)(ctbVirt + offset);
+    for (int CHi = 0; CHi < 32; CHi++)
+    {
+        uint64_t offset = CHi * 256;
+        cmdheader[CHi].prdtl = 8; // 8 PRDT entries per CTB
 
-            CHi++;
-        }
+        // Set the pointer to the physical address of the command table
+        physical_address_t ctbPhys = pagingVirtualToPhysical(ctbVirt + offset);
+        cmdheader[CHi].ctba = ctbPhys;
+        cmdheader[CHi].ctbau = ctbPhys >> 32;
 
-        // Reset the memory
-        memset((char *)ctbVirt, 0, PAGE_SIZE);
+        // Save a copy of the virtual address
+        this->virtualCTBs[CHi] = (k_HBA_cmd_table *)(ctbVirt + offset);
     }
 
     startCMD(); // Start command engine
@@ -344,6 +344,7 @@ void k_ahci_driver::probePorts()
                 this->ports[portCount]->cmdSlots = this->cmdSlots;
                 this->ports[portCount]->initialized = false;
                 this->ports[portCount]->inWrite = false;
+                this->ports[portCount]->lock.locked = 0;
                 this->portCount++;
             }
         }
@@ -6,6 +6,7 @@
 #include <strings.hpp>
 
 #include <tasking/tasking.hpp>
+#include <tasking/scheduler.hpp>
 
 #include <syscalls/syscalls_calls.hpp>
 #include <syscalls/syscalls_data.hpp>
@@ -24,6 +25,9 @@ namespace Syscall
         // runHandler(thread, systemCalls[thread->context->rax], syscallData);
         pagingSwitchSpace(thread->process->addressSpace);
         systemCalls[syscallId](thread, syscallData);
+
+        // The system call's transient buffers are no longer needed
+        thread->arena.reset();
     }
 
     void runHandler(k_thread *caller, SyscallHandler_t syscall, SyscallData *data)
@@ -49,11 +53,17 @@ namespace Syscall
 
         syscallThread->syscall.handler(targetThread, syscallData);
 
-        targetThread->status = READY;
+        schedulerWake(targetThread);
         syscallThread->status = DEAD;
         taskingSwitch();
     }
 
+    void restart(k_thread *thread)
+    {
+        // Step back over the int 0x80, so the thread issues it again
+        thread->context->rip -= SYSCALL_INSTRUCTION_SIZE;
+    }
+
     void registerHandler(uint16_t id, SyscallHandler_t handler)
     {
         if (id > 255)
@@ -112,6 +122,7 @@ namespace Syscall
         registerHandler(SYS_WRITE, (SyscallHandler_t)Calls::write);
         registerHandler(SYS_READDIR, (SyscallHandler_t)Calls::readDir);
         registerHandler(SYS_OPENDIR, (SyscallHandler_t)Calls::openDir);
+        registerHandler(SYS_HEAP_STATISTICS, (SyscallHandler_t)Calls::heapStatistics);
         registerHandler(254, (SyscallHandler_t)Calls::printSTDOUT);
     }
 }
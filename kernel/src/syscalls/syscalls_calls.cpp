@@ -3,37 +3,66 @@
 #include <logger/logger.hpp>
 #include <syscalls/errno.h>
 #include <fatfs/ff.h>
+#include <filesystem.hpp>
 #include <memory/heap.hpp>
 #include <system/processor/processor.hpp>
+#include <interrupts/interrupts.hpp>
+#include <tasking/scheduler.hpp>
 #include <strings.hpp>
+#include <memory/userspace_allocator.hpp>
 
 namespace Syscall::Calls
 {
+    /**
+     * @brief Check that memory a process passed lies in its half of the address space
+     */
+    static bool isUserPointer(const void *pointer, uint64_t size)
+    {
+        virtual_address_t address = (virtual_address_t)pointer;
+        return address != 0 && address < USERSPACE_MEMORY_END && size <= USERSPACE_MEMORY_END - address;
+    }
+
     void printSTDOUT(k_thread *thread, SyscallData *data)
     {
         // 1 is for STDOUT
         FIL *stdout = thread->process->fileDescriptors->get(1);
+        uint64_t rflags = interruptsSave();
+        filesystemLock();
         long prevPtr = f_tell(stdout);
         f_lseek(stdout, thread->process->stdoutReadPtr);
         size_t size = f_size(stdout) - thread->process->stdoutReadPtr;
-        char buf[size + 1];
+        char *buf = (char *)thread->arena.allocate(size + 1);
         unsigned int bw;
         f_read(stdout, buf, size, &bw);
         buf[size] = '\0';
 
         thread->process->stdoutReadPtr += bw;
         f_lseek(stdout, prevPtr);
+        filesystemUnlock();
+        interruptsRestore(rflags);
 
         logInfo("%s", buf);
     }
 
+    void heapStatistics(k_thread *thread, SyscallData *data)
+    {
+        heapDumpStatistics();
+        data->result = true;
+    }
+
     void readDir(k_thread *thread, ReadDir *data)
     {
         DIR *dir = thread->process->openDirectories->get(data->fd);
         FILINFO info;
         if (dir != NULL)
         {
-            if (f_readdir(dir, &info) == FR_OK)
+            uint64_t rflags = interruptsSave();
+            filesystemLock();
+            FRESULT res = f_readdir(dir, &info);
+            filesystemUnlock();
+            interruptsRestore(rflags);
+
+            if (res == FR_OK)
             {
                 memcpy((void *)data->name, (void *)info.fname, strlen(info.fname));
                 data->result = true;
@@ -47,8 +76,13 @@ namespace Syscall::Calls
 
     void openDir(k_thread *thread, OpenDir *data)
     {
-        DIR *dir = new DIR();
+        DIR *dir = (DIR *)thread->process->directoryPool.allocate();
+        memset((char *)dir, 0, sizeof(DIR));
+        uint64_t rflags = interruptsSave();
+        filesystemLock();
         FRESULT res = f_opendir(dir, data->path);
+        filesystemUnlock();
+        interruptsRestore(rflags);
         if (res == FR_OK)
         {
             thread->process->openDirectories->add(dir);
@@ -57,6 +91,7 @@ namespace Syscall::Calls
         }
         else
         {
+            thread->process->directoryPool.free(dir);
             data->result = false;
         }
     }
@@ -70,7 +105,11 @@ namespace Syscall::Calls
     void chdir(k_thread *thread, ChdirData *data)
     {
         FILINFO filInfo;
+        uint64_t rflags = interruptsSave();
+        filesystemLock();
         FRESULT res = f_stat(data->path, &filInfo);
+        filesystemUnlock();
+        interruptsRestore(rflags);
         if (res == FR_OK)
         {
             memcpy((void *)thread->process->cwd, (void *)data->path, 256);
@@ -92,11 +131,19 @@ namespace Syscall::Calls
     {
         k_process *proc = thread->process;
 
-        FIL *fil = new FIL();
+        filesystemRefreshProcFile(data->name);
+
+        FIL *fil = (FIL *)proc->filePool.allocate();
+        memset((char *)fil, 0, sizeof(FIL));
+        uint64_t rflags = interruptsSave();
+        filesystemLock();
         FRESULT res = f_open(fil, data->name, data->flags);
+        filesystemUnlock();
+        interruptsRestore(rflags);
 
         if (res != FR_OK)
         {
+            proc->filePool.free(fil);
             data->result = false;
             return;
         }
@@ -118,7 +165,19 @@ namespace Syscall::Calls
             return;
         }
 
+        uint64_t rflags = interruptsSave();
+        filesystemLock();
         FRESULT res = f_close(fil);
+        filesystemUnlock();
+        interruptsRestore(rflags);
+
+        // The standard streams are part of the process, the rest go back to the pool
+        if (fil != &proc->stdin && fil != &proc->stdout && fil != &proc->stderr)
+        {
+            proc->fileDescriptors->set(data->fd, NULL);
+            proc->filePool.free(fil);
+        }
+
         data->result = true;
         return;
     }
@@ -134,7 +193,28 @@ namespace Syscall::Calls
             return;
         }
 
+        uint64_t rflags = interruptsSave();
+        filesystemLock();
+
+        if (fil == &proc->stdin)
+        {
+            // Nothing was typed yet, wait for the keyboard and read again. The check is
+            // made under the queue's lock, so a key pressed meanwhile still wakes the thread
+            proc->stdinWaiters.lock.lock();
+            if ((long)f_tell(fil) >= proc->stdinWritePtr)
+            {
+                filesystemUnlock();
+                Syscall::restart(thread);
+                proc->stdinWaiters.waitLocked();
+                interruptsRestore(rflags);
+                return;
+            }
+            proc->stdinWaiters.lock.unlock();
+        }
+
         FRESULT res = f_read(fil, data->buf, data->count, &data->byteRead);
+        filesystemUnlock();
+        interruptsRestore(rflags);
         data->result = true;
         return;
     }
@@ -150,7 +230,11 @@ namespace Syscall::Calls
             return;
         }
 
+        uint64_t rflags = interruptsSave();
+        filesystemLock();
         FRESULT res = f_write(fil, data->buf, data->btw, (unsigned int *)data->bw);
+        filesystemUnlock();
+        interruptsRestore(rflags);
         if (res == FR_OK)
             data->result = true;
         else
@@ -173,9 +257,21 @@ namespace Syscall::Calls
 
     void fork(k_thread *thread, ForkData *data)
     {
-        logInfon("'fork' syscall not implemented");
-        data->result = false;
-        data->errno = ENOSYS;
+        // The child sees the data as it was before the parent's result is written
+        data->pid = 0;
+        data->result = true;
+
+        k_process *child = taskingDuplicateProcess(thread->process);
+        if (child == NULL)
+        {
+            data->errno = ENOMEM;
+            data->result = false;
+            return;
+        }
+        taskingDuplicateThread(thread, child);
+
+        // Copies the page for the parent
+        data->pid = child->pid;
     }
 
     void execve(k_thread *thread, ExecveData *data)
@@ -241,18 +337,26 @@ namespace Syscall::Calls
         k_process *process = thread->process;
         if (data->hint != NULL)
         {
-            if (process->processAllocator->allocateRange(
-                    (virtual_address_t)data->hint, (virtual_address_t)data->size))
+            // The mapping starts at the page of the hint
+            virtual_address_t start = PAGING_ALIGN_PAGE_DOWN((virtual_address_t)data->hint);
+            if (process->processAllocator->allocateRange(start, (virtual_address_t)data->size))
             {
                 // Range allocated
-                data->allocatedRange = data->hint;
+                data->allocatedRange = (void *)start;
                 data->result = true;
                 return;
             }
+
+            if (data->flags & VM_MAP_FIXED)
+            {
+                data->errno = ENOMEM;
+                data->result = false;
+                return;
+            }
         }
 
         // Allocate just anywhere
-        data->allocatedRange = (void *)process->processAllocator->allocateStack((virtual_address_t)data->size, false);
+        data->allocatedRange = (void *)process->processAllocator->reserveRange((uint64_t)data->size);
         if (data->allocatedRange == NULL)
         {
             data->result = false;
@@ -265,7 +369,7 @@ namespace Syscall::Calls
     void vmUnmap(k_thread *thread, VMUnmapData *data)
     {
         k_process *process = thread->process;
-        process->processAllocator->freeStack((virtual_address_t)data->pointer);
+        process->processAllocator->freeRange((virtual_address_t)data->pointer);
 
         data->result = true;
     }
@@ -286,9 +390,30 @@ namespace Syscall::Calls
 
     void sleep(k_thread *thread, SleepData *data)
     {
-        logInfon("'sleep' syscall not implemented");
-        data->result = false;
-        data->errno = ENOSYS;
+        if (!isUserPointer(data->secs, sizeof(*data->secs)) || !isUserPointer(data->nanos, sizeof(*data->nanos)))
+        {
+            data->errno = EFAULT;
+            data->result = false;
+            return;
+        }
+
+        if (*data->secs < 0 || *data->nanos < 0 || *data->nanos >= 1000000000)
+        {
+            data->errno = EINVAL;
+            data->result = false;
+            return;
+        }
+
+        // A part of a millisecond still sleeps a whole one
+        uint64_t ms = *data->secs * 1000 + (*data->nanos + 999999) / 1000000;
+        data->result = true;
+
+        // The sleep isn't interrupted, nothing remains of it when the thread wakes up
+        *data->secs = 0;
+        *data->nanos = 0;
+
+        if (ms)
+            schedulerSleep(thread, ms);
     }
 
     void getuid(k_thread *thread, SyscallData *data)
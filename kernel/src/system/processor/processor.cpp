@@ -2,6 +2,9 @@
 
 #include <logger/logger.hpp>
 
+static k_processor_local processorLocals[PROCESSOR_MAX_CPUS];
+static uint64_t processorCount = 1;
+
 bool processorHasAPIC()
 {
     unsigned int eax, unused, edx;
@@ -16,6 +19,28 @@ bool processorHasSSE()
     return edx & CPUID_FEAT_EDX_SSE;
 }
 
+bool processorHas1GiBPages()
+{
+    unsigned int eax, unused, edx;
+    if (!__get_cpuid(0x80000001, &eax, &unused, &unused, &edx))
+        return false;
+    return edx & CPUID_FEAT_EXT_EDX_PDPE1GB;
+}
+
+bool processorHasPCID()
+{
+    unsigned int eax, unused, ecx;
+    __get_cpuid(1, &eax, &unused, &ecx, &unused);
+    return ecx & CPUID_FEAT_ECX_PCID;
+}
+
+bool processorHasTSCDeadline()
+{
+    unsigned int eax, unused, ecx;
+    __get_cpuid(1, &eax, &unused, &ecx, &unused);
+    return ecx & CPUID_FEAT_ECX_TSC;
+}
+
 bool processorEnableSSE()
 {
     if (processorHasSSE())
@@ -49,4 +74,62 @@ uint64_t processorGetMSR(msr_t msr) {
     uint32_t *lo;
     uint32_t *hi;
     asm volatile("rdmsr" : "=a"(*lo), "=d"(*hi) : "c"(msr));
+}
+
+uint64_t processorReadTSC()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void processorInitializeLocal(uint64_t index)
+{
+    k_processor_local *local = &processorLocals[index];
+    local->self = local;
+    local->index = index;
+
+    processorSetMSR(PROCESSOR_MSR_GS_BASE, (uint64_t)local);
+    processorSetMSR(PROCESSOR_MSR_KERNEL_GS_BASE, 0);
+}
+
+k_processor_local *processorGetLocal()
+{
+    k_processor_local *local;
+    asm volatile("mov %0, gs:[0]"
+                 : "=r"(local));
+    return local;
+}
+
+k_processor_local *processorGetLocalOf(uint64_t index)
+{
+    return &processorLocals[index];
+}
+
+uint64_t processorGetIndex()
+{
+    uint64_t index;
+    asm volatile("mov %0, gs:[8]"
+                 : "=r"(index));
+    return index;
+}
+
+uint64_t processorGetCount()
+{
+    return processorCount;
+}
+
+void processorRegister(uint64_t index, uint32_t apicId)
+{
+    processorLocals[index].apicId = apicId;
+
+    // Processors come up concurrently
+    uint64_t count = processorCount;
+    while (index >= count && !__sync_bool_compare_and_swap(&processorCount, count, index + 1))
+        count = processorCount;
+}
+
+uint32_t processorGetApicId(uint64_t index)
+{
+    return processorLocals[index].apicId;
 }
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include <system/processor/smp.hpp>
+
+#include <system/processor/processor.hpp>
+#include <stivale2/stivale2_tools.hpp>
+#include <gdt/gdt.hpp>
+#include <interrupts/idt.hpp>
+#include <interrupts/lapic.hpp>
+#include <interrupts/interrupts.hpp>
+#include <memory/memory.hpp>
+#include <memory/paging.hpp>
+#include <tasking/tasking.hpp>
+#include <logger/logger.hpp>
+#include <kernel.hpp>
+
+// Set by an application processor once it is set up, the next one is started only after it
+static volatile bool smpApOnline = false;
+
+uint64_t smpCountProcessors(stivale2_struct *stivaleInfo)
+{
+    stivale2_struct_tag_smp *smp = (stivale2_struct_tag_smp *)stivale2_get_tag(stivaleInfo, STIVALE2_STRUCT_TAG_SMP_ID);
+    if (!smp)
+        return 1;
+
+    if (smp->cpu_count > PROCESSOR_MAX_CPUS)
+        logWarnn("%! Only %d of the %d processors are used.", "[SMP]", PROCESSOR_MAX_CPUS, smp->cpu_count);
+
+    return smp->cpu_count < PROCESSOR_MAX_CPUS ? smp->cpu_count : PROCESSOR_MAX_CPUS;
+}
+
+void smpInitialize(stivale2_struct *stivaleInfo)
+{
+    stivale2_struct_tag_smp *smp = (stivale2_struct_tag_smp *)stivale2_get_tag(stivaleInfo, STIVALE2_STRUCT_TAG_SMP_ID);
+    if (!smp)
+    {
+        logWarnn("%! The bootloader didn't start the application processors.", "[SMP]");
+        return;
+    }
+
+    // Every processor's timer uses the rate measured here
+    lapicCalibrateTimer();
+
+    uint64_t count = smpCountProcessors(stivaleInfo);
+    uint64_t index = 1;
+    for (uint64_t i = 0; i < smp->cpu_count && index < count; i++)
+    {
+        stivale2_smp_info *info = &smp->smp_info[i];
+        if (info->lapic_id == smp->bsp_lapic_id)
+            continue;
+
+        taskingAddCPU(index);
+
+        physical_address_t stack = memoryPhysicalAllocator.allocatePages(SMP_AP_STACK_SIZE / PAGE_SIZE);
+        if (!stack)
+            kernelPanic("%! Couldn't allocate a stack for processor %d.", "[SMP]", index);
+
+        info->target_stack = PAGING_APPLY_DIRECTMAP(stack) + SMP_AP_STACK_SIZE;
+        info->extra_argument = index;
+
+        // The processor jumps as soon as it sees the address
+        smpApOnline = false;
+        __atomic_store_n(&info->goto_address, (uint64_t)smpApEntry, __ATOMIC_SEQ_CST);
+
+        while (!smpApOnline)
+            asm volatile("pause");
+
+        logDebugn("%! Processor %d (LAPIC %d) is online.", "[SMP]", index, info->lapic_id);
+        index++;
+    }
+
+    logInfon("%! %d processors are online.", "[SMP]", processorGetCount());
+}
+
+extern "C" void smpApEntry(stivale2_smp_info *info)
+{
+    uint64_t index = info->extra_argument;
+
+    gdtInitialize(index);
+    processorInitializeLocal(index);
+    pagingInitializeProcessor();
+    idtLoad();
+    _processorEnableSSE();
+    lapicInitialize();
+
+    smpApOnline = true;
+
+    // The first tick switches to a thread, or to the processor's idle thread
+    lapicStartTimer();
+    interruptsEnable();
+
+    for (;;)
+        asm("hlt");
+}
@@ -2,28 +2,44 @@
 
 #include <memory/heap.hpp>
 #include <interrupts/lapic.hpp>
+#include <interrupts/interrupts.hpp>
+#include <system/processor/processor.hpp>
 
 #include <logger/logger.hpp>
 
 // #define VERBOSE_SCHEDULER
 
-k_jobs_queue jobsQueues[K_CONST_SCHEDULER_QUEUES];
-k_scheduler_job *runningJob;
-uint64_t priorityBoostTime;
+// The run queue of each processor
+k_run_queue runQueues[PROCESSOR_MAX_CPUS];
 static bool initialized = false;
 
+k_slab_cache schedulerJobCache = SLAB_CACHE_INITIALIZER("k_scheduler_job", k_scheduler_job, NULL);
+SLAB_DEFINE_OPERATORS(k_scheduler_job, schedulerJobCache)
+
 void schedulerInit()
 {
-    for (job_priority_t priority = 0; priority < K_CONST_SCHEDULER_QUEUES; priority++)
+    for (uint64_t cpu = 0; cpu < PROCESSOR_MAX_CPUS; cpu++)
     {
-        jobsQueues[priority].head = NULL;
-        jobsQueues[priority].tail = NULL;
-        jobsQueues[priority].isEmpty = true;
-        jobsQueues[priority].timeAllotment = 50;//schedulerGetTimeAllotment(priority);
+        k_run_queue *runQueue = &runQueues[cpu];
+        for (job_priority_t priority = 0; priority < K_CONST_SCHEDULER_QUEUES; priority++)
+        {
+            runQueue->queues[priority].head = NULL;
+            runQueue->queues[priority].tail = NULL;
+            runQueue->queues[priority].timeAllotment = 50;//schedulerGetTimeAllotment(priority);
+        }
+
+        runQueue->readyMap = 0;
+        runQueue->runningJob = NULL;
+        runQueue->jobCount = 0;
+        runQueue->clock = 0;
+        runQueue->priorityBoostTime = 0;
+        runQueue->balanceTime = 0;
+        runQueue->boostEpoch = 0;
+        runQueue->sleepers = NULL;
+        runQueue->idle = false;
+        runQueue->lock.locked = 0;
     }
 
-    priorityBoostTime = 0;
-    runningJob = NULL;
     initialized = true;
 }
 
@@ -39,158 +55,577 @@ uint64_t schedulerGetTimeAllotment(uint8_t priority)
 
 static uint64_t i = 0;
 
+/**
+ * @brief Account the time since the run queue was last accounted, the run queue's lock must be held
+ */
+static void schedulerAccount(k_run_queue *runQueue)
+{
+    uint64_t now = lapicGetTime();
+    uint64_t elapsed = now - runQueue->clock;
+    runQueue->clock = now;
+
+    if (runQueue->runningJob != NULL)
+    {
+        runQueue->runningJob->timeInPriority += elapsed;
+        runQueue->runningJob->lastRan = now;
+    }
+
+    runQueue->priorityBoostTime += elapsed;
+    runQueue->balanceTime += elapsed;
+}
+
+/**
+ * @brief Kick a processor to schedule a job that was added to a run queue. The run queue's own
+ *        processor is kicked if it is idle, otherwise an idle processor that can steal the job.
+ *
+ * @param targetIdle Whether the run queue's processor was idle, read under the run queue's lock
+ *                   when the job was added, so a processor going idle meanwhile isn't missed
+ */
+static void schedulerKick(k_run_queue *runQueue, bool targetIdle)
+{
+    uint64_t target = runQueue - runQueues;
+    if (targetIdle)
+    {
+        lapicSendIPI(processorGetApicId(target), SCHEDULER_WAKE_VECTOR);
+        return;
+    }
+
+    // The job waits behind the running one, an idle processor can take it
+    for (uint64_t other = 0; other < processorGetCount(); other++)
+    {
+        if (other != target && runQueues[other].idle)
+        {
+            lapicSendIPI(processorGetApicId(other), SCHEDULER_WAKE_VECTOR);
+            return;
+        }
+    }
+}
+
 void schedulerTime()
 {
     if (!initialized)
         return;
 
-    if (runningJob != NULL)
-        runningJob->timeInPriority += APIC_TIMER_TIMESLOT_MS;
-    priorityBoostTime += APIC_TIMER_TIMESLOT_MS;
-    if (priorityBoostTime > K_CONST_PRIORITY_BOOST) {
-        schedulerPriorityBoost();
-        priorityBoostTime = 0;
+    k_run_queue *runQueue = &runQueues[processorGetIndex()];
+
+    uint64_t rflags = interruptsSave();
+    runQueue->lock.lock();
+
+    schedulerAccount(runQueue);
+
+    if (runQueue->priorityBoostTime > K_CONST_PRIORITY_BOOST)
+    {
+        schedulerPriorityBoost(runQueue);
+        runQueue->priorityBoostTime = 0;
+    }
+
+    // Take the sleeping threads that are due, they are woken without the lock
+    k_thread *due = NULL;
+    k_thread **link = &runQueue->sleepers;
+    while (*link != NULL && (*link)->wakeTime <= runQueue->clock)
+        link = &(*link)->waitNext;
+    if (link != &runQueue->sleepers)
+    {
+        due = runQueue->sleepers;
+        runQueue->sleepers = *link;
+        *link = NULL;
     }
-}
 
+    runQueue->lock.unlock();
 
+    while (due != NULL)
+    {
+        k_thread *next = due->waitNext;
+        due->waitNext = NULL;
+        schedulerWake(due);
+        due = next;
+    }
 
-k_thread *schedulerSchedule()
+    if (runQueue->balanceTime >= K_CONST_SCHEDULER_BALANCE)
+    {
+        runQueue->balanceTime = 0;
+        schedulerBalance();
+    }
+
+    interruptsRestore(rflags);
+}
+
+/**
+ * @brief Get how long until a period that started the given time ago ends, at least 1ms
+ */
+static uint64_t schedulerTimeLeft(uint64_t elapsed, uint64_t period)
+{
+    return elapsed < period ? period - elapsed : 1;
+}
+
+uint64_t schedulerNextDeadline()
 {
     if (!initialized)
-        return NULL;
+        return 0;
+
+    k_run_queue *runQueue = &runQueues[processorGetIndex()];
+
+    uint64_t rflags = interruptsSave();
+    runQueue->lock.lock();
 
-    if (runningJob == NULL ||
-        runningJob->thread->status == WAITING ||
-        runningJob->thread->status == DEAD ||
-        runningJob->timeInPriority > jobsQueues[runningJob->priority].timeAllotment)
+    uint64_t deadline = 0;
+    k_scheduler_job *job = runQueue->runningJob;
+    if (job != NULL)
     {
-        if (runningJob != NULL)
+        // The job is switched out once its time exceeds the allotment
+        deadline = schedulerTimeLeft(job->timeInPriority, runQueue->queues[job->priority].timeAllotment + 1);
+
+        uint64_t boost = schedulerTimeLeft(runQueue->priorityBoostTime, K_CONST_PRIORITY_BOOST + 1);
+        if (boost < deadline)
+            deadline = boost;
+
+        uint64_t balance = schedulerTimeLeft(runQueue->balanceTime, K_CONST_SCHEDULER_BALANCE);
+        if (balance < deadline)
+            deadline = balance;
+    }
+
+    // An idle processor still wakes up for its sleeping threads
+    if (runQueue->sleepers != NULL)
+    {
+        uint64_t now = lapicGetTime();
+        uint64_t wake = runQueue->sleepers->wakeTime > now ? runQueue->sleepers->wakeTime - now : 1;
+        if (deadline == 0 || wake < deadline)
+            deadline = wake;
+    }
+
+    runQueue->lock.unlock();
+    interruptsRestore(rflags);
+
+    return deadline;
+}
+
+void schedulerSleep(k_thread *thread, uint64_t ms)
+{
+    k_run_queue *runQueue = &runQueues[processorGetIndex()];
+
+    uint64_t rflags = interruptsSave();
+    runQueue->lock.lock();
+
+    // Keep the sleeping threads sorted, the first one is the next to wake up
+    thread->wakeTime = lapicGetTime() + ms;
+    k_thread **link = &runQueue->sleepers;
+    while (*link != NULL && (*link)->wakeTime <= thread->wakeTime)
+        link = &(*link)->waitNext;
+    thread->waitNext = *link;
+    *link = thread;
+
+    thread->status = WAITING;
+    runQueue->lock.unlock();
+
+    // The scheduler parks the thread, the processor runs another one when the interrupt returns
+    taskingSwitch();
+    interruptsRestore(rflags);
+}
+
+/**
+ * @brief Catch a job up with the priority boosts of its run queue it has missed
+ */
+static void schedulerCatchUp(k_run_queue *runQueue, k_scheduler_job *job)
+{
+    if (job->boostEpoch != runQueue->boostEpoch)
+    {
+        job->priority = 0;
+        job->timeInPriority = 0;
+        job->boostEpoch = runQueue->boostEpoch;
+    }
+}
+
+/**
+ * @brief Take the first job of the highest priority queue that isn't empty, the run queue's lock must be held
+ *
+ * @return k_scheduler_job* The job, NULL if no job is ready
+ */
+static k_scheduler_job *schedulerPop(k_run_queue *runQueue)
+{
+    while (runQueue->readyMap)
+    {
+        job_priority_t priority = __builtin_ctzll(runQueue->readyMap);
+        k_scheduler_job *job = runQueue->queues[priority].head;
+        schedulerRemoveJob(runQueue, job, priority);
+
+        // The thread was killed while it was ready, drop it
+        if (job->thread->status == DEAD)
         {
-            if (runningJob->thread->status == DEAD)
-            {
-                // The thread had stopped, remove it
-                schedulerRemoveJob(runningJob);
-                runningJob = NULL;
-            }
-            // Job has used all of it's time in the priority, lower it
-            else if (runningJob->timeInPriority > jobsQueues[runningJob->priority].timeAllotment &&
-                     runningJob->priority < K_CONST_SCHEDULER_QUEUES)
-            {
-                // First remove it from the current priority
-                schedulerRemoveJob(runningJob);
-                runningJob->thread->status = READY;
-
-                // Kernel jobs shouldn't be demoted, but only go to the "back of the line"
-                if (runningJob->thread->privilege == USER && runningJob->priority < K_CONST_SCHEDULER_QUEUES - 1)
-                    // Now add it to one lower priority
-                    schedulerAddJob(runningJob, runningJob->priority + 1);
-                else 
-                    schedulerAddJob(runningJob, runningJob->priority);
-
-                // Reset it's time
-                runningJob->timeInPriority = 0;
-            }
+            job->thread->job = NULL;
+            delete job;
+            continue;
         }
-        // Select the next job to run
-        for (job_priority_t priority = 0; priority < K_CONST_SCHEDULER_QUEUES; priority++)
-        {
-            // We want to select job with highest priority
-            if (jobsQueues[priority].isEmpty)
-                continue;
 
-            k_scheduler_job *job = jobsQueues[priority].head;
+        // The queue is authoritative, the job may have been spliced by a boost
+        job->priority = priority;
+        schedulerCatchUp(runQueue, job);
+        return job;
+    }
 
-            // Get the next ready to run job
-            while (job && job->thread->status != READY)
-            {
-                // Remove the job since it's not ready to be executed
-                schedulerRemoveJob(runningJob);
+    return NULL;
+}
 
-                // If the job isn't dead move it to the queue's end
-                if (job->thread->status != DEAD)
-                    schedulerAddJob(runningJob, priority);
-            }
-            i++;
-#ifdef VERBOSE_SCHEDULER
-            logDebugn("%d) Selected job to run PID: %d TID: %d", i,job->thread->process->pid, job->thread->id);
-#endif
+/**
+ * @brief Lock the run queue of a job
+ *
+ * @return k_run_queue* The run queue, locked
+ */
+static k_run_queue *schedulerLockJob(k_scheduler_job *job)
+{
+    // A queued job may move to another run queue until its run queue is locked
+    for (;;)
+    {
+        k_run_queue *runQueue = job->runQueue;
+        runQueue->lock.lock();
+        if (job->runQueue == runQueue)
+            return runQueue;
+        runQueue->lock.unlock();
+    }
+}
+
+/**
+ * @brief Decide the next job of a run queue, the run queue's lock must be held
+ *
+ * @return k_thread* The selected thread, NULL if no thread is ready
+ */
+static k_thread *schedulerSelect(k_run_queue *runQueue)
+{
+    k_scheduler_job *previousJob = runQueue->runningJob;
+    bool previousRunnable = false;
+    if (previousJob != NULL)
+    {
+        // A waker may have made it ready again before it got to block
+        previousRunnable = previousJob->thread->status == RUNNING || previousJob->thread->status == READY;
+        bool expired = previousJob->timeInPriority > runQueue->queues[previousJob->priority].timeAllotment;
+
+        if (previousRunnable && !expired)
+            return previousJob->thread;
 
-            // Round-robin on the highest priority queue
-            // Therefore the current job to run is the first job
-            runningJob = job;
-            break;
+        // Job has used all of it's time in the priority, lower it
+        if (previousRunnable)
+        {
+            // Kernel jobs shouldn't be demoted, but only go to the "back of the line"
+            if (previousJob->thread->privilege == USER && previousJob->priority < K_CONST_SCHEDULER_QUEUES - 1)
+                previousJob->priority++;
+
+            // Reset it's time
+            previousJob->timeInPriority = 0;
         }
     }
 
-    if (runningJob == NULL)
+    // Round-robin on the highest priority queue, the previous job goes back to the queues
+    // when the processor is off its stack
+    k_scheduler_job *job = schedulerPop(runQueue);
+
+    // Nothing else is ready, the previous job goes on
+    if (job == NULL && previousRunnable)
+        job = previousJob;
+
+    runQueue->runningJob = job;
+
+    // Published under the lock, a job added after it is kicked for
+    runQueue->idle = job == NULL;
+    if (job == NULL)
         return NULL;
-    return runningJob->thread;
+
+    i++;
+#ifdef VERBOSE_SCHEDULER
+    logDebugn("%d) Selected job to run PID: %d TID: %d", i, job->thread->process->pid, job->thread->id);
+#endif
+
+    job->onProcessor = true;
+    job->thread->status = RUNNING;
+    job->lastRan = runQueue->clock;
+
+    return job->thread;
 }
 
-void schedulerPriorityBoost()
+k_thread *schedulerSchedule()
 {
     if (!initialized)
-        return;
+        return NULL;
+
+    uint64_t rflags = interruptsSave();
+    k_run_queue *runQueue = &runQueues[processorGetIndex()];
+
+    runQueue->lock.lock();
+    schedulerAccount(runQueue);
+    k_thread *thread = schedulerSelect(runQueue);
+    runQueue->lock.unlock();
+
+    // Nothing to run here, rather than idle take work from the busiest processor
+    if (thread == NULL && schedulerSteal())
+    {
+        runQueue->lock.lock();
+        thread = schedulerSelect(runQueue);
+        runQueue->lock.unlock();
+    }
+
+    interruptsRestore(rflags);
+
+    return thread;
+}
+
+/**
+ * @brief Find the run queue with the most jobs, other than this processor's
+ *
+ * @return k_run_queue* The run queue, NULL if no other run queue has jobs
+ */
+static k_run_queue *schedulerFindBusiest()
+{
+    uint64_t cpu = processorGetIndex();
+    k_run_queue *busiest = NULL;
+    uint64_t mostJobs = 0;
 
-    for (job_priority_t priority = 0; priority < K_CONST_SCHEDULER_QUEUES - 1; priority++)
+    // The counts are read without the locks, a stale count only makes a worse choice
+    for (uint64_t other = 0; other < processorGetCount(); other++)
     {
-        k_scheduler_job *job = jobsQueues[priority].head;
-        while (job)
+        uint64_t jobs = runQueues[other].jobCount;
+        if (other != cpu && jobs > mostJobs)
         {
-            // If it's already in priority 0, just set the time to 0
-            job->timeInPriority = 0;
-            if (priority != 0 && job != runningJob)
+            busiest = &runQueues[other];
+            mostJobs = jobs;
+        }
+    }
+
+    return busiest;
+}
+
+/**
+ * @brief Move ready jobs from a run queue to this processor's, the jobs keep their priority
+ *
+ * @param source The run queue to take from
+ * @param maxJobs How many jobs to move at most
+ * @param coldOnly Whether cache-hot jobs stay on their processor
+ * @return uint64_t How many jobs were moved
+ */
+static uint64_t schedulerMigrate(k_run_queue *source, uint64_t maxJobs, bool coldOnly)
+{
+    k_run_queue *target = &runQueues[processorGetIndex()];
+
+    // Lower run queue first, so two processors pulling from each other don't deadlock
+    k_run_queue *first = source < target ? source : target;
+    k_run_queue *second = source < target ? target : source;
+    first->lock.lock();
+    second->lock.lock();
+
+    uint64_t now = lapicGetTime();
+    uint64_t moved = 0;
+    uint64_t levels = source->readyMap;
+    while (levels && moved < maxJobs)
+    {
+        job_priority_t priority = __builtin_ctzll(levels);
+        levels &= levels - 1;
+
+        k_scheduler_job *job = source->queues[priority].head;
+        while (job && moved < maxJobs)
+        {
+            // The job is moved to another queue, so its next job is taken first
+            k_scheduler_job *next = job->next;
+
+            bool cold = job->lastRan == 0 || now - job->lastRan >= K_CONST_SCHEDULER_CACHE_HOT;
+            if (job->thread->status == READY && (cold || !coldOnly))
             {
-                schedulerRemoveJob(job);
-                schedulerAddJob(job, 0);
+                schedulerRemoveJob(source, job, priority);
+                schedulerCatchUp(source, job);
+
+                job->boostEpoch = target->boostEpoch;
+                job->runQueue = target;
+                schedulerAddJob(target, job, priority);
+                moved++;
             }
 
-            job = job->next;
+            job = next;
         }
     }
+
+    second->lock.unlock();
+    first->lock.unlock();
+
+#ifdef VERBOSE_SCHEDULER
+    if (moved)
+        logDebugn("%! Processor %d took %d jobs.", "[Scheduler]", processorGetIndex(), moved);
+#endif
+
+    return moved;
 }
 
-void schedulerRemoveJob(k_scheduler_job *job)
+bool schedulerSteal()
+{
+    k_run_queue *busiest = schedulerFindBusiest();
+    if (!busiest)
+        return false;
+
+    // Running a cache-cold job beats idling, a cache-hot one is taken only if there is no cold one
+    return schedulerMigrate(busiest, 1, true) || schedulerMigrate(busiest, 1, false);
+}
+
+void schedulerBalance()
+{
+    k_run_queue *busiest = schedulerFindBusiest();
+    if (!busiest)
+        return;
+
+    uint64_t busiestJobs = busiest->jobCount;
+    uint64_t ownJobs = runQueues[processorGetIndex()].jobCount;
+    if (busiestJobs <= ownJobs + 1)
+        return;
+
+    // Take half of the difference, so both end up with about the same load
+    schedulerMigrate(busiest, (busiestJobs - ownJobs) / 2, true);
+}
+
+void schedulerPriorityBoost(k_run_queue *runQueue)
+{
+    if (!initialized)
+        return;
+
+    k_jobs_queue *top = &runQueue->queues[0];
+    for (job_priority_t priority = 1; priority < K_CONST_SCHEDULER_QUEUES; priority++)
+    {
+        k_jobs_queue *queue = &runQueue->queues[priority];
+        if (queue->head == NULL)
+            continue;
+
+        // Splice the whole queue onto the end of priority 0
+        queue->head->prev = top->tail;
+        if (top->tail != NULL)
+            top->tail->next = queue->head;
+        else
+            top->head = queue->head;
+        top->tail = queue->tail;
+
+        queue->head = NULL;
+        queue->tail = NULL;
+    }
+
+    if (runQueue->readyMap)
+        runQueue->readyMap = 1;
+
+    // The jobs reset their priority and time when they are next taken
+    runQueue->boostEpoch++;
+    if (runQueue->runningJob != NULL)
+        schedulerCatchUp(runQueue, runQueue->runningJob);
+}
+
+void schedulerRemoveJob(k_run_queue *runQueue, k_scheduler_job *job, job_priority_t priority)
 {
     if (!initialized)
         return;
 
     k_scheduler_job *prev = job->prev;
     k_scheduler_job *next = job->next;
-    job_priority_t priority = job->priority;
+    k_jobs_queue *queue = &runQueue->queues[priority];
 
     if (prev != NULL)
         prev->next = job->next;
     else
-        jobsQueues[priority].head = job->next;
+        queue->head = job->next;
 
     if (next != NULL)
         next->prev = job->prev;
     else
-        jobsQueues[priority].tail = job->prev;
+        queue->tail = job->prev;
 
-    if (jobsQueues[priority].head == NULL)
-        jobsQueues[priority].isEmpty = true;
+    if (queue->head == NULL)
+        runQueue->readyMap &= ~(1ULL << priority);
+    runQueue->jobCount--;
 }
 
-void schedulerAddJob(k_scheduler_job *job, job_priority_t priority)
+void schedulerAddJob(k_run_queue *runQueue, k_scheduler_job *job, job_priority_t priority)
 {
     if (!initialized)
         return;
 
+    k_jobs_queue *queue = &runQueue->queues[priority];
+
     // Set it's priority
     job->priority = priority;
 
     // Add it to the end of the list
-    job->prev = jobsQueues->tail;
+    job->prev = queue->tail;
     job->next = NULL;
-    if (jobsQueues[priority].tail != NULL)
-        jobsQueues[priority].tail->next = job;
-    if (jobsQueues[priority].head == NULL)
-        jobsQueues[priority].head = job;
-    jobsQueues[priority].tail = job;
-    jobsQueues[priority].isEmpty = false;
+    if (queue->tail != NULL)
+        queue->tail->next = job;
+    if (queue->head == NULL)
+        queue->head = job;
+    queue->tail = job;
+
+    runQueue->readyMap |= 1ULL << priority;
+    runQueue->jobCount++;
+}
+
+void schedulerRelease(k_thread *thread)
+{
+    k_scheduler_job *job = thread->job;
+    if (!initialized || job == NULL)
+    {
+        // Threads that aren't scheduled (the idle threads) are just ready again
+        if (thread->status == RUNNING)
+            thread->status = READY;
+        return;
+    }
+
+    uint64_t rflags = interruptsSave();
+    k_run_queue *runQueue = schedulerLockJob(job);
+
+    bool added = false;
+    job->onProcessor = false;
+    if (thread->status == DEAD)
+    {
+        thread->job = NULL;
+        delete job;
+    }
+    else if (thread->status == RUNNING || thread->status == READY)
+    {
+        thread->status = READY;
+        schedulerCatchUp(runQueue, job);
+        schedulerAddJob(runQueue, job, job->priority);
+        added = true;
+    }
+    // A waiting job stays parked until it is woken
+
+    bool targetIdle = runQueue->idle;
+    runQueue->lock.unlock();
+
+    if (added)
+        schedulerKick(runQueue, targetIdle);
+    interruptsRestore(rflags);
+}
+
+void schedulerWake(k_thread *thread)
+{
+    k_scheduler_job *job = thread->job;
+    if (!initialized || job == NULL)
+    {
+        if (thread->status == WAITING)
+            thread->status = READY;
+        return;
+    }
+
+    uint64_t rflags = interruptsSave();
+    k_run_queue *runQueue = schedulerLockJob(job);
+
+    bool added = false;
+    if (thread->status == WAITING)
+    {
+        thread->status = READY;
+
+        // A job that is still on a processor goes back to the queues when the processor releases it
+        if (!job->onProcessor)
+        {
+            schedulerCatchUp(runQueue, job);
+            schedulerAddJob(runQueue, job, job->priority);
+            added = true;
+        }
+    }
+
+    bool targetIdle = runQueue->idle;
+    runQueue->lock.unlock();
+
+    if (added)
+        schedulerKick(runQueue, targetIdle);
+    interruptsRestore(rflags);
 }
 
 void schedulerNewJob(k_thread *thread)
@@ -201,8 +636,30 @@ void schedulerNewJob(k_thread *thread)
     k_scheduler_job *job = new k_scheduler_job();
 
     job->thread = thread;
+    thread->job = job;
 
     // All new jobs starts with priority 0
     job->timeInPriority = 0;
-    schedulerAddJob(job, 0);
-}
\ No newline at end of file
+    // It hasn't ran anywhere, so it can go anywhere
+    job->lastRan = 0;
+    job->onProcessor = false;
+
+    uint64_t rflags = interruptsSave();
+
+    // The least loaded run queue takes it, this processor's on a tie
+    uint64_t cpu = processorGetIndex();
+    k_run_queue *runQueue = &runQueues[cpu];
+    for (uint64_t other = 0; other < processorGetCount(); other++)
+        if (runQueues[other].jobCount < runQueue->jobCount)
+            runQueue = &runQueues[other];
+
+    runQueue->lock.lock();
+    job->runQueue = runQueue;
+    job->boostEpoch = runQueue->boostEpoch;
+    schedulerAddJob(runQueue, job, 0);
+    bool targetIdle = runQueue->idle;
+    runQueue->lock.unlock();
+
+    schedulerKick(runQueue, targetIdle);
+    interruptsRestore(rflags);
+}
@@ -6,8 +6,12 @@
 #include <tasking/scheduler.hpp>
 #include <memory/heap.hpp>
 #include <interrupts/interrupts.hpp>
+#include <interrupts/lapic.hpp>
 
 #include <gdt/gdt.hpp>
+#include <system/processor/processor.hpp>
+#include <utils/spinlock.hpp>
+#include <filesystem.hpp>
 
 #include <logger/printf.hpp>
 #include <strings.hpp>
@@ -16,37 +20,70 @@ static k_processor_tasking *processorTaskingArray;
 static uint8_t processorCout;
 static k_process *focusedProcess;
 
-uint64_t k_processor_tasking::getNextID()
+// The process of the kernel threads, the idle threads belong to it
+static k_process *kernelProcess;
+
+// All the processes, every processor looks them up
+static k_process_entry *taskingProcesses = NULL;
+static k_spinlock taskingProcessesLock;
+
+// The next process or thread id
+static uint64_t taskingNextID = 0;
+
+k_slab_cache threadCache = SLAB_CACHE_INITIALIZER("k_thread", k_thread, NULL);
+k_slab_cache threadEntryCache = SLAB_CACHE_INITIALIZER("k_thread_entry", k_thread_entry, NULL);
+k_slab_cache processEntryCache = SLAB_CACHE_INITIALIZER("k_process_entry", k_process_entry, NULL);
+k_slab_cache fileCache = SLAB_CACHE_INITIALIZER("FIL", FIL, NULL);
+k_slab_cache directoryCache = SLAB_CACHE_INITIALIZER("DIR", DIR, NULL);
+
+SLAB_DEFINE_OPERATORS(k_thread, threadCache)
+SLAB_DEFINE_OPERATORS(k_thread_entry, threadEntryCache)
+SLAB_DEFINE_OPERATORS(k_process_entry, processEntryCache)
+
+static k_thread *taskingBuildThread(virtual_address_t entryPoint, k_process *process, THREAD_PRIVILEGE privilege);
+
+/**
+ * @brief Returns the next id for a process or a thread
+ */
+static uint64_t taskingGetNextID()
 {
-    return this->nextPID++;
+    return __sync_fetch_and_add(&taskingNextID, 1);
 }
 
 void _idleThread()
 {
     interruptsEnable();
     for (;;)
-        ;
+    {
+        // Use the spare time to zero pages for the allocations that need them, then
+        // halt until an interrupt, the timer isn't armed unless something is due
+        if (!memoryPhysicalAllocator.fillZeroedPool(BITMAP_ALLOCATOR_ZERO_BATCH))
+            asm volatile("hlt");
+    }
 }
 
 void taskingInitialize(uint8_t numOfCPUs)
 {
     processorTaskingArray = new k_processor_tasking[numOfCPUs];
     processorCout = numOfCPUs;
-    for (int i = 0; i < numOfCPUs; i++)
-        memset((char *)processorTaskingArray, 0, numOfCPUs * sizeof(k_processor_tasking));
+    memset((char *)processorTaskingArray, 0, numOfCPUs * sizeof(k_processor_tasking));
 
-    // Start with idle thread
-    k_process *proc = taskingCreateProcess();
-    k_thread *thread = taskingCreateThread((uint64_t)_idleThread, proc, KERNEL);
+    // taskingGetProcessor() finds the structure through the processor's data
+    for (int i = 0; i < numOfCPUs; i++)
+        processorGetLocalOf(i)->tasking = &processorTaskingArray[i];
 
-    taskingGetProcessor()->currentThread = thread;
+    kernelProcess = taskingCreateProcess();
 }
 
 void taskingAddCPU(uint8_t id)
 {
     processorTaskingArray[id].currentThread = NULL;
-    processorTaskingArray[id].processes = 0;
+    processorTaskingArray[id].switchedFrom = NULL;
     processorTaskingArray[id].processorId = id;
+
+    // The first timer interrupt of the processor switches to a thread, until then it runs its boot code
+    processorTaskingArray[id].idleThread = taskingBuildThread((uint64_t)_idleThread, kernelProcess, KERNEL);
+    processorTaskingArray[id].idleThread->status = READY;
 }
 
 k_process *taskingCreateProcess()
@@ -58,19 +95,28 @@ k_process *taskingCreateProcess()
     // process->processAllocator->allocateUserspaceHeap();
     process->addressSpace = process->processAllocator->getSpace();
 
-    process->pid = processorTaskingArray[0].getNextID();
+    process->pid = taskingGetNextID();
 
     k_process_entry *entry = new k_process_entry();
     entry->process = process;
-    entry->next = taskingGetProcessor()->processes;
-    taskingGetProcessor()->processes = entry;
+
+    uint64_t rflags = interruptsSave();
+    taskingProcessesLock.lock();
+    entry->next = taskingProcesses;
+    taskingProcesses = entry;
+    taskingProcessesLock.unlock();
+    interruptsRestore(rflags);
 
     process->openDirectories = new List<DIR *>(5);
+    process->directoryPool.init(&directoryCache);
+    process->filePool.init(&fileCache);
 
     // Initialize file descriptors hash map
     process->fileDescriptors = new List<FIL *>(5);
 
-    
+    // The directories are walked relative to FatFs' current directory, which all the processors share
+    rflags = interruptsSave();
+    filesystemLock();
 
     f_chdir("/root");
     f_mkdir("proc");
@@ -83,43 +129,57 @@ k_process *taskingCreateProcess()
     f_chdir("fd");
     
     if (f_open(&process->stdin, "0", FA_READ | FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+    {
+        filesystemUnlock();
+        interruptsRestore(rflags);
         return NULL;
+    }
 
     process->fileDescriptors->add(&process->stdin); // stdin
     process->stdinWritePtr = 0;
+    process->stdinWaiters.init();
 
     if (f_open(&process->stdout, "1", FA_READ | FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+    {
+        filesystemUnlock();
+        interruptsRestore(rflags);
         return NULL;
+    }
     process->fileDescriptors->add(&process->stdout); // stdin
 
     if (f_open(&process->stderr, "2", FA_READ | FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+    {
+        filesystemUnlock();
+        interruptsRestore(rflags);
         return NULL;
+    }
     process->fileDescriptors->add(&process->stderr); // stdin
 
 
     f_chdir("/");
 
+    filesystemUnlock();
+    interruptsRestore(rflags);
+
     memcpy(process->cwd, "/root\0", 6);
 
 
     return process;
 }
 
-k_process *taskingDuplicateProcess(k_process *parent) {
-    k_process *child = new k_process();
+k_process *taskingDuplicateProcess(k_process *parent)
+{
+    k_process *child = taskingCreateProcess();
+    if (!child)
+        return NULL;
 
-    child->processAllocator = new k_userspace_allocator();
-    child->addressSpace = child->processAllocator->getSpace();
-    child->pid = processorTaskingArray[0].getNextID();
+    // Share the parent's memory copy-on-write
+    parent->processAllocator->copyTo(child->processAllocator);
 
-    k_process_entry *entry = new k_process_entry();
-    entry->process = child;
-    entry->next = taskingGetProcessor()->processes;
-    taskingGetProcessor()->processes = entry;
+    child->masterTLS = parent->masterTLS;
+    memcpy(child->cwd, parent->cwd, sizeof(child->cwd));
 
-    // Copy from parent to child
-    // Copy memory of parent
-    // k_address_range_header *range = parent->processAllocator->copyTo(child->processAllocator);
+    return child;
 }
 
 void taskingInitializeThreadMemory(k_thread *thread, THREAD_PRIVILEGE privilege)
@@ -137,8 +197,9 @@ void taskingInitializeThreadMemory(k_thread *thread, THREAD_PRIVILEGE privilege)
     }
     else
     {
-        thread->stack.start = thread->process->processAllocator->allocateStack(USERSPACE_STACK_SIZE, false);
-        thread->stack.end = thread->stack.start + USERSPACE_STACK_SIZE;
+        // Userspace stacks grow on demand up to the limit
+        thread->stack.start = thread->process->processAllocator->allocateStack(USERSPACE_STACK_LIMIT, false);
+        thread->stack.end = thread->stack.start + USERSPACE_STACK_LIMIT;
         thread->interruptStack.start = thread->process->processAllocator->allocateInterruptStack(INTERRUPT_STACK_SIZE);
         thread->interruptStack.end = thread->interruptStack.start + INTERRUPT_STACK_SIZE;
 
@@ -146,7 +207,7 @@ void taskingInitializeThreadMemory(k_thread *thread, THREAD_PRIVILEGE privilege)
         k_process *process = thread->process;
         size_t alignment = process->masterTLS.alignment; // process->masterTLS.alignment > alignof(UserThread) ? process->masterTLS.alignment : alignof(UserThread);
         size_t totalSizeAligned = ALIGN_UP(process->masterTLS.totalSize, alignment) + sizeof(UserThread);
-        thread->tls.start = process->processAllocator->allocateStack(totalSizeAligned, false);
+        thread->tls.start = process->processAllocator->reserveRange(totalSizeAligned);
         thread->tls.end = thread->tls.start + totalSizeAligned;
 
         memset((char *)thread->tls.start, 0, totalSizeAligned);
@@ -157,7 +218,7 @@ void taskingInitializeThreadMemory(k_thread *thread, THREAD_PRIVILEGE privilege)
         userThread->self = userThread;
         thread->tls.userThread = (virtual_address_t)userThread;
 
-        virtual_address_t argv = process->processAllocator->allocateStack(4096, false);
+        virtual_address_t argv = process->processAllocator->reserveRange(4096);
 
         const char *name = "heyo";
         char *stackStr = (char *)thread->stack.end;
@@ -202,16 +263,21 @@ void taskingAddThreadToProcess(k_thread *thread, k_process *process)
     }
     else
     {
-        thread->id = taskingGetProcessor()->getNextID();
+        thread->id = taskingGetNextID();
     }
 }
 
 
 
-k_thread *taskingCreateThread(virtual_address_t entryPoint, k_process *process, THREAD_PRIVILEGE privilege)
+/**
+ * @brief Creates a thread without handing it to the scheduler
+ */
+static k_thread *taskingBuildThread(virtual_address_t entryPoint, k_process *process, THREAD_PRIVILEGE privilege)
 {
     k_thread *thread = new k_thread();
     thread->process = process;
+    thread->job = NULL;
+    thread->waitNext = NULL;
 
     pagingSwitchSpace(thread->process->addressSpace);
 
@@ -227,16 +293,56 @@ k_thread *taskingCreateThread(virtual_address_t entryPoint, k_process *process,
     // Add the thread to it's parent process and assign an id to it
     taskingAddThreadToProcess(thread, process);
 
+    return thread;
+}
+
+k_thread *taskingCreateThread(virtual_address_t entryPoint, k_process *process, THREAD_PRIVILEGE privilege)
+{
+    k_thread *thread = taskingBuildThread(entryPoint, process, privilege);
+
     thread->status = READY;
     schedulerNewJob(thread);
     return thread;
 }
 
+k_thread *taskingDuplicateThread(k_thread *thread, k_process *process)
+{
+    k_thread *child = new k_thread();
+    child->process = process;
+    child->privilege = thread->privilege;
+    child->job = NULL;
+    child->waitNext = NULL;
+
+    // The stack and the TLS are at the same addresses in the duplicated space
+    child->stack.start = thread->stack.start;
+    child->stack.end = thread->stack.end;
+    child->tls.start = thread->tls.start;
+    child->tls.end = thread->tls.end;
+    child->tls.userThread = thread->tls.userThread;
+
+    child->interruptStack.start = process->processAllocator->allocateInterruptStack(INTERRUPT_STACK_SIZE);
+    child->interruptStack.end = child->interruptStack.start + INTERRUPT_STACK_SIZE;
+
+    // The thread resumes from the same state, the context is on its interrupt stack
+    child->context = (k_thread_state *)(child->interruptStack.end - sizeof(k_thread_state));
+    memcpy(child->context, thread->context, sizeof(k_thread_state));
+
+    taskingAddThreadToProcess(child, process);
+
+    child->status = READY;
+    schedulerNewJob(child);
+    return child;
+}
+
 void taskingSwitch()
 {
     k_thread *previousThread = taskingGetRunningThread();
     k_thread *threadToRun = schedulerSchedule();
 
+    // Nothing is ready to run, the processor idles
+    if (threadToRun == NULL)
+        threadToRun = taskingGetProcessor()->idleThread;
+
     if (threadToRun != NULL)
     {
 
@@ -249,17 +355,37 @@ void taskingSwitch()
         taskingGetProcessor()->currentThread = threadToRun;
         threadToRun->status = RUNNING;
 
-        // The previouse thread should be ready to execute again
+        // The previouse thread should be ready to execute again, but only once
+        // the processor has left its stack
         if (previousThread != NULL && previousThread != threadToRun)
-            if (previousThread->status == RUNNING)
-                previousThread->status = READY;
+        {
+            // Switched twice in one interrupt, the thread in between never ran
+            if (taskingGetProcessor()->switchedFrom != NULL)
+                schedulerRelease(previousThread);
+            else
+                taskingGetProcessor()->switchedFrom = previousThread;
+        }
     }
+
+    // There is no periodic tick, the timer fires when the scheduler needs it next
+    lapicArmTimer(schedulerNextDeadline());
+}
+
+extern "C" void taskingFinishSwitch()
+{
+    // Interrupts may come before tasking is initialized
+    k_processor_tasking *processor = taskingGetProcessor();
+    if (processor == NULL || processor->switchedFrom == NULL)
+        return;
+
+    k_thread *previousThread = processor->switchedFrom;
+    processor->switchedFrom = NULL;
+    schedulerRelease(previousThread);
 }
 
 void taskingDumpProcesses()
 {
-    k_processor_tasking *processorTasking = processorTaskingArray;
-    k_process_entry *curr = processorTasking->processes;
+    k_process_entry *curr = taskingProcesses;
 
     logInfon("%! Dumping processes:", "[Tasking]");
     while (curr)
@@ -274,9 +400,36 @@ k_thread *taskingGetRunningThread()
     return taskingGetProcessor()->currentThread;
 }
 
+k_process *taskingGetProcessBySpace(physical_address_t space)
+{
+    // The running thread's process is the common case
+    k_thread *thread = taskingGetRunningThread();
+    if (thread && thread->process && thread->process->addressSpace == space)
+        return thread->process;
+
+    k_process *process = NULL;
+
+    uint64_t rflags = interruptsSave();
+    taskingProcessesLock.lock();
+    k_process_entry *entry = taskingProcesses;
+    while (entry)
+    {
+        if (entry->process->addressSpace == space)
+        {
+            process = entry->process;
+            break;
+        }
+        entry = entry->next;
+    }
+    taskingProcessesLock.unlock();
+    interruptsRestore(rflags);
+
+    return process;
+}
+
 k_processor_tasking *taskingGetProcessor()
 {
-    return &processorTaskingArray[0];
+    return (k_processor_tasking *)processorGetLocal()->tasking;
 }
 
 void taskingSetupPrivileges(k_thread *thread)
@@ -310,19 +463,25 @@ void taskingSetFocusedProcess(k_process *proc) {
 }
 
 void taskingFinalize() {
-    for (uint8_t processorI = 0; processorI < processorCout; processorI++)
+    // The panic may have come from under the filesystem's lock, the files can't be closed then
+    uint64_t rflags = interruptsSave();
+    if (!filesystemTryLock())
     {
-        k_processor_tasking processor = processorTaskingArray[processorI];
-        k_process_entry *entry = processor.processes;
-        while (entry)
-        {
-            k_process *process = entry->process;
-            uint8_t fd;
-            for (uint8_t fd = 0; fd < process->fileDescriptors->size(); fd++)
-                f_close(process->fileDescriptors->get(fd));
-            
-            entry = entry->next;
-        }
+        interruptsRestore(rflags);
+        return;
     }
-    
+
+    k_process_entry *entry = taskingProcesses;
+    while (entry)
+    {
+        k_process *process = entry->process;
+        uint8_t fd;
+        for (uint8_t fd = 0; fd < process->fileDescriptors->size(); fd++)
+            f_close(process->fileDescriptors->get(fd));
+        
+        entry = entry->next;
+    }
+
+    filesystemUnlock();
+    interruptsRestore(rflags);
 }
\ No newline at end of file
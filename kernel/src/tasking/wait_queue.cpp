@@ -0,0 +1,93 @@
+#include <tasking/wait_queue.hpp>
+
+#include <tasking/tasking.hpp>
+#include <tasking/scheduler.hpp>
+#include <interrupts/interrupts.hpp>
+
+void k_wait_queue::init()
+{
+    this->head = NULL;
+    this->tail = NULL;
+    this->lock.locked = 0;
+}
+
+void k_wait_queue::wait()
+{
+    uint64_t rflags = interruptsSave();
+    this->lock.lock();
+    this->waitLocked();
+    interruptsRestore(rflags);
+}
+
+void k_wait_queue::waitLocked()
+{
+    k_thread *thread = taskingGetRunningThread();
+    if (thread == NULL)
+    {
+        this->lock.unlock();
+        return;
+    }
+
+    thread->waitNext = NULL;
+    if (this->tail != NULL)
+        this->tail->waitNext = thread;
+    else
+        this->head = thread;
+    this->tail = thread;
+
+    thread->status = WAITING;
+    this->lock.unlock();
+
+    // The scheduler parks the thread, the processor runs another one when the interrupt returns
+    taskingSwitch();
+}
+
+bool k_wait_queue::wakeOne()
+{
+    uint64_t rflags = interruptsSave();
+    this->lock.lock();
+
+    k_thread *thread = this->head;
+    if (thread != NULL)
+    {
+        this->head = thread->waitNext;
+        if (this->head == NULL)
+            this->tail = NULL;
+        thread->waitNext = NULL;
+    }
+
+    this->lock.unlock();
+
+    if (thread != NULL)
+        schedulerWake(thread);
+
+    interruptsRestore(rflags);
+    return thread != NULL;
+}
+
+uint64_t k_wait_queue::wakeAll()
+{
+    uint64_t rflags = interruptsSave();
+    this->lock.lock();
+
+    // Take the whole queue, the threads are woken without the lock
+    k_thread *thread = this->head;
+    this->head = NULL;
+    this->tail = NULL;
+
+    this->lock.unlock();
+
+    uint64_t woken = 0;
+    while (thread != NULL)
+    {
+        k_thread *next = thread->waitNext;
+        thread->waitNext = NULL;
+        schedulerWake(thread);
+
+        thread = next;
+        woken++;
+    }
+
+    interruptsRestore(rflags);
+    return woken;
+}
@@ -0,0 +1,150 @@
+#include <utils/avl_tree.hpp>
+
+static int64_t avlHeight(k_avl_node *node)
+{
+    return node ? node->height : 0;
+}
+
+static void avlUpdateHeight(k_avl_node *node)
+{
+    int64_t left = avlHeight(node->left);
+    int64_t right = avlHeight(node->right);
+    node->height = (left > right ? left : right) + 1;
+}
+
+void k_avl_tree::insert(k_avl_node *node, k_avl_compare compare)
+{
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+
+    k_avl_node *parent = NULL;
+    k_avl_node **link = &this->root;
+    while (*link)
+    {
+        parent = *link;
+        link = compare(node, parent) < 0 ? &parent->left : &parent->right;
+    }
+
+    node->parent = parent;
+    *link = node;
+
+    this->_rebalance(parent);
+}
+
+void k_avl_tree::remove(k_avl_node *node)
+{
+    k_avl_node *start;
+
+    if (node->left && node->right)
+    {
+        // The successor takes the node's place, it has no left child
+        k_avl_node *successor = node->right;
+        while (successor->left)
+            successor = successor->left;
+
+        if (successor->parent == node)
+            start = successor;
+        else
+        {
+            start = successor->parent;
+
+            start->left = successor->right;
+            if (successor->right)
+                successor->right->parent = start;
+
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+
+        successor->left = node->left;
+        node->left->parent = successor;
+
+        successor->parent = node->parent;
+        this->_replaceChild(node->parent, node, successor);
+        successor->height = node->height;
+    }
+    else
+    {
+        k_avl_node *child = node->left ? node->left : node->right;
+        if (child)
+            child->parent = node->parent;
+        this->_replaceChild(node->parent, node, child);
+
+        start = node->parent;
+    }
+
+    this->_rebalance(start);
+}
+
+void k_avl_tree::_replaceChild(k_avl_node *parent, k_avl_node *oldChild, k_avl_node *newChild)
+{
+    if (!parent)
+        this->root = newChild;
+    else if (parent->left == oldChild)
+        parent->left = newChild;
+    else
+        parent->right = newChild;
+}
+
+k_avl_node *k_avl_tree::_rotateLeft(k_avl_node *node)
+{
+    k_avl_node *pivot = node->right;
+
+    node->right = pivot->left;
+    if (pivot->left)
+        pivot->left->parent = node;
+
+    pivot->parent = node->parent;
+    this->_replaceChild(node->parent, node, pivot);
+
+    pivot->left = node;
+    node->parent = pivot;
+
+    avlUpdateHeight(node);
+    avlUpdateHeight(pivot);
+    return pivot;
+}
+
+k_avl_node *k_avl_tree::_rotateRight(k_avl_node *node)
+{
+    k_avl_node *pivot = node->left;
+
+    node->left = pivot->right;
+    if (pivot->right)
+        pivot->right->parent = node;
+
+    pivot->parent = node->parent;
+    this->_replaceChild(node->parent, node, pivot);
+
+    pivot->right = node;
+    node->parent = pivot;
+
+    avlUpdateHeight(node);
+    avlUpdateHeight(pivot);
+    return pivot;
+}
+
+void k_avl_tree::_rebalance(k_avl_node *node)
+{
+    while (node)
+    {
+        avlUpdateHeight(node);
+        int64_t balance = avlHeight(node->left) - avlHeight(node->right);
+
+        if (balance > 1)
+        {
+            if (avlHeight(node->left->left) < avlHeight(node->left->right))
+                this->_rotateLeft(node->left);
+            node = this->_rotateRight(node);
+        }
+        else if (balance < -1)
+        {
+            if (avlHeight(node->right->right) < avlHeight(node->right->left))
+                this->_rotateRight(node->right);
+            node = this->_rotateLeft(node);
+        }
+
+        node = node->parent;
+    }
+}
@@ -32,10 +32,11 @@ void HashMap::emhashmap_deinitialize() {
 bool HashMap::emhashmap_initialize(int capacity, float load_factor) {
     this->bucket_count = ((int)(capacity / load_factor) + 1);
     this->capacity = capacity;
-    this->entries = (MapEntry*) heapAllocate(sizeof(MapEntry) * this->capacity);
+    // Cache line aligned, so a bucket or an entry never straddles two lines
+    this->entries = (MapEntry*) heapAllocateAligned(sizeof(MapEntry) * this->capacity, HASHMAP_ALIGNMENT);
     memset(this->entries, 0, sizeof(MapEntry) * this->capacity);
-    this->buckets = (MapBucketList*) heapAllocate(sizeof(MapBucketList) *
-            this->bucket_count);
+    this->buckets = (MapBucketList*) heapAllocateAligned(sizeof(MapBucketList) *
+            this->bucket_count, HASHMAP_ALIGNMENT);
     memset(this->buckets, 0, sizeof(MapBucketList) * this->bucket_count);
 
     int i;
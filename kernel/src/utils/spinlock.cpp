@@ -0,0 +1,16 @@
+#include <utils/spinlock.hpp>
+
+void k_spinlock::lock()
+{
+    while (__sync_lock_test_and_set(&this->locked, 1))
+    {
+        // Spin on a plain read so the cache line isn't bounced around while waiting
+        while (this->locked)
+            asm volatile("pause");
+    }
+}
+
+void k_spinlock::unlock()
+{
+    __sync_lock_release(&this->locked);
+}